@@ -0,0 +1,165 @@
+/*
+
+  NX584 modem interface to SMS controller
+  (C) Copyright Paul Gardner-Stephen 2018-2019
+
+  State checkpoints and log replay.
+
+  The nx584_server log only tells us about changes, so after a restart we
+  would otherwise not know whether the alarm is armed, whether the siren is
+  sounding, or which zones are faulted, until each of those next changes.
+  We therefore save that state from time to time, along with the inode and
+  offset in the log that it corresponds to.  On start up, we load the saved
+  state, and then replay only the part of the log written since.
+
+  The file is plain text, so that it can be inspected or edited by hand:
+
+    armed <-1|0|1>
+    siren <-1|0|1>
+    zones <one digit per zone>
+    log <dev> <inode> <offset> <path>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "code_instrumentation.h"
+#include "checkpoint.h"
+
+// Longest log line we will replay
+#define CHECKPOINT_LINE_MAX 1024
+
+int checkpoint_load(const char *file, struct checkpoint *c)
+{
+  FILE *f=fopen(file,"r");
+  if (!f) return -1;
+
+  c->armed=-1;
+  c->siren=-1;
+  for(int i=0;i<CHECKPOINT_MAX_ZONES;i++) c->zones[i]=0;
+  c->log_count=0;
+
+  char line[1200];
+  char zones[CHECKPOINT_MAX_ZONES+1];
+  line[0]=0; fgets(line,sizeof(line),f);
+  while(line[0]) {
+    struct checkpoint_log *l=&c->logs[c->log_count];
+    if (sscanf(line,"armed %d",&c->armed)==1) ;
+    else if (sscanf(line,"siren %d",&c->siren)==1) ;
+    else if (sscanf(line,"zones %64[0-9]",zones)==1) {
+      for(int i=0;zones[i]&&i<CHECKPOINT_MAX_ZONES;i++) c->zones[i]=zones[i]-'0';
+    } else if (c->log_count<CHECKPOINT_MAX_LOGS
+	       &&sscanf(line,"log %llu %llu %lld %1023[^\n]",
+			&l->dev,&l->ino,&l->offset,l->path)==4)
+      c->log_count++;
+    else
+      LOG_WARN("Unrecognised line in checkpoint file: '%s'",line);
+    line[0]=0; fgets(line,sizeof(line),f);
+  }
+  fclose(f);
+  return 0;
+}
+
+// Write the checkpoint to a temporary file, and rename it into place, so
+// that a crash part way through can't leave us with a damaged checkpoint.
+int checkpoint_save(const char *file, struct checkpoint *c)
+{
+  char tmp[1100];
+  snprintf(tmp,sizeof(tmp),"%s.tmp",file);
+  FILE *f=fopen(tmp,"w");
+  if (!f) return -1;
+
+  fprintf(f,"armed %d\nsiren %d\nzones ",c->armed,c->siren);
+  for(int i=0;i<CHECKPOINT_MAX_ZONES;i++) fputc('0'+c->zones[i],f);
+  fputc('\n',f);
+  for(int i=0;i<c->log_count;i++)
+    fprintf(f,"log %llu %llu %lld %s\n",
+	    c->logs[i].dev,c->logs[i].ino,c->logs[i].offset,c->logs[i].path);
+  if (fclose(f)) {
+    unlink(tmp);
+    return -1;
+  }
+  if (rename(tmp,file)) {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+struct checkpoint_log *checkpoint_find_log(struct checkpoint *c, const char *path)
+{
+  for(int i=0;i<c->log_count;i++)
+    if (!strcmp(c->logs[i].path,path)) return &c->logs[i];
+  return NULL;
+}
+
+/*
+  Pass each complete line between the two offsets of the file to the
+  handler.  The file is mapped rather than read, so that replaying a large
+  stretch of log costs no more than scanning it for newlines.  If
+  skip_partial is set, the text up to the first newline is skipped, as
+  "from" may be part way through a line.  Returns the offset just after the
+  last complete line, so that reading can carry on from there, or -1 on
+  error.
+*/
+long long checkpoint_replay(int fd, long long from, long long to, int skip_partial,
+			    checkpoint_line_handler handler, long long *lines)
+{
+  *lines=0;
+  if (to<=from) return from;
+
+  // mmap() offsets must be page aligned
+  long page=sysconf(_SC_PAGESIZE);
+  long long base=from-(from%page);
+  size_t len=to-base;
+  char *map=mmap(NULL,len,PROT_READ,MAP_PRIVATE,fd,base);
+  if (map==MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  madvise(map,len,MADV_SEQUENTIAL);
+
+  const char *p=&map[from-base];
+  const char *end=&map[len];
+  if (skip_partial) {
+    const char *eol=memchr(p,'\n',end-p);
+    p=eol?eol+1:end;
+  }
+  const char *done=p;
+  char line[CHECKPOINT_LINE_MAX];
+  while(p<end) {
+    const char *eol=memchr(p,'\n',end-p);
+    // A partial line at the end will be read normally once it is complete
+    if (!eol) break;
+    int line_len=eol-p;
+    if (line_len>0&&p[line_len-1]=='\r') line_len--;
+    if (line_len<CHECKPOINT_LINE_MAX) {
+      memcpy(line,p,line_len);
+      line[line_len]=0;
+      handler(line);
+      (*lines)++;
+    }
+    p=eol+1;
+    done=p;
+  }
+
+  long long offset=base+(done-map);
+  munmap(map,len);
+  return offset;
+}
@@ -0,0 +1,36 @@
+#ifndef __CHECKPOINT_H__
+#define __CHECKPOINT_H__
+
+//
+// 'checkpoint.h/.c' save and restore the alarm state, along with how far
+// through each nx584_server log we had read, so that a restart only needs
+// to replay what was logged since.
+//
+
+#define CHECKPOINT_MAX_LOGS 16
+#define CHECKPOINT_MAX_ZONES 64
+
+struct checkpoint_log {
+  char path[1024];
+  unsigned long long dev;
+  unsigned long long ino;
+  long long offset;
+};
+
+struct checkpoint {
+  int armed;
+  int siren;
+  int zones[CHECKPOINT_MAX_ZONES];
+  int log_count;
+  struct checkpoint_log logs[CHECKPOINT_MAX_LOGS];
+};
+
+typedef void (*checkpoint_line_handler)(char *line);
+
+int checkpoint_load(const char *file, struct checkpoint *c);
+int checkpoint_save(const char *file, struct checkpoint *c);
+struct checkpoint_log *checkpoint_find_log(struct checkpoint *c, const char *path);
+long long checkpoint_replay(int fd, long long from, long long to, int skip_partial,
+			    checkpoint_line_handler handler, long long *lines);
+
+#endif
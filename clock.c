@@ -0,0 +1,102 @@
+/*
+
+  NX584 modem interface to SMS controller
+  (C) Copyright Paul Gardner-Stephen 2018-2019
+
+  Time of day, and the steady clock used for scheduling.
+
+  Everything that decides when something should happen (the siren debounce,
+  SMS polling, escalation, retries and rate limits, checkpoints, restarts)
+  asks this file for the time, rather than calling time() directly.
+  Normally that is just the system clock.
+
+  With clock=sim (or clock=sim@<seconds since 1970> to pick the starting
+  time), time stands still until it is moved on by clock_advance(), which
+  the advance command does.  A test can then feed a script of log lines and
+  advance commands on stdin, and see in the log exactly when each
+  notification would have been sent, covering hours in a few seconds.
+
+  How long things actually take (external programs, main loop stalls) is
+  still measured with the real clock.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "clock.h"
+
+int clock_mode=CLOCK_REAL;
+
+// Simulated time, as a time of day when simulation started, and a steady
+// clock in milliseconds since then.
+time_t clock_sim_start=0;
+long long clock_sim_ms=0;
+
+time_t clock_now(void)
+{
+  if (clock_mode==CLOCK_SIMULATED) return clock_sim_start+clock_sim_ms/1000;
+  return time(0);
+}
+
+// Milliseconds on a clock that never goes backwards
+long long clock_ms(void)
+{
+  if (clock_mode==CLOCK_SIMULATED) return clock_sim_ms;
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1000LL+ts.tv_nsec/1000000;
+}
+
+// The time of day, in milliseconds since 1970, for comparing with times
+// that come from elsewhere (e.g., the panel's log)
+long long clock_time_ms(void)
+{
+  if (clock_mode==CLOCK_SIMULATED) return clock_sim_start*1000LL+clock_sim_ms;
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME,&ts);
+  return ts.tv_sec*1000LL+ts.tv_nsec/1000000;
+}
+
+// Parse the value of clock=, which is real, sim or sim@<start>
+int clock_parse(const char *spec)
+{
+  long long start;
+  if (!strcmp(spec,"real")) {
+    clock_mode=CLOCK_REAL;
+    return 0;
+  }
+  if (!strcmp(spec,"sim")) {
+    clock_mode=CLOCK_SIMULATED;
+    clock_sim_start=time(0);
+    return 0;
+  }
+  if (sscanf(spec,"sim@%lld",&start)==1) {
+    clock_mode=CLOCK_SIMULATED;
+    clock_sim_start=start;
+    return 0;
+  }
+  return -1;
+}
+
+// Move simulated time on.  Returns -1 if the clock isn't simulated.
+int clock_advance(long long ms)
+{
+  if (clock_mode!=CLOCK_SIMULATED||ms<0) return -1;
+  clock_sim_ms+=ms;
+  return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef __CLOCK_H__
+#define __CLOCK_H__
+
+#include <time.h>
+
+//
+// 'clock.h/.c' give the time of day, and a steady clock for scheduling,
+// either from the system, or simulated, so that timed behaviour can be
+// tested without waiting for it.
+//
+
+#define CLOCK_REAL 0
+#define CLOCK_SIMULATED 1
+
+extern int clock_mode;
+
+time_t clock_now(void);
+long long clock_ms(void);
+long long clock_time_ms(void);
+int clock_parse(const char *spec);
+int clock_advance(long long ms);
+
+#endif
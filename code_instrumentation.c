@@ -1,4 +1,5 @@
 #include "code_instrumentation.h"
+#include "clock.h"
 
 #include <time.h>
 #include <stdio.h>
@@ -11,7 +12,7 @@ void code_instrumentation_log(const char* fileName, int line, const char* functi
 {
 	if (logLevel <= COMPILE_LOG_LEVEL)
 	{
-		time_t now = time(0);
+		time_t now = clock_now();
 		struct tm* localtm = localtime(&now);
 
 		static char timeBuffer[BUFFER_SIZE];
@@ -0,0 +1,58 @@
+#include "code_instrumentation.h"
+#include "command.h"
+#include "watchdog.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+
+unsigned long long command_spawns=0;
+long long command_total_ms=0;
+long long command_max_ms=0;
+
+long long command_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1000LL+ts.tv_nsec/1000000;
+}
+
+// Describe a command by the program and its first argument, e.g., "gammu
+// sendsms", skipping any environment settings in front of it.
+void command_name(const char *cmd, char *out, int max_len)
+{
+  while(1) {
+    while(*cmd==' ') cmd++;
+    int word_len=strcspn(cmd," ");
+    const char *equals=memchr(cmd,'=',word_len);
+    if (!equals||!word_len) break;
+    cmd+=word_len;
+  }
+  int program_len=strcspn(cmd," ");
+  const char *slash=cmd;
+  for(int i=0;i<program_len;i++) if (cmd[i]=='/') slash=&cmd[i+1];
+  program_len-=slash-cmd;
+  const char *arg=slash+program_len;
+  while(*arg==' ') arg++;
+  snprintf(out,max_len,"%.*s %.*s",program_len,slash,(int)strcspn(arg," >"),arg);
+}
+
+// Run a shell command, as system() does, but keeping track of the cost.
+int run_command_at(const char *fileName, int line, const char *cmd)
+{
+  long long start=command_ms();
+  int r=system(cmd);
+  long long elapsed=command_ms()-start;
+
+  command_spawns++;
+  command_total_ms+=elapsed;
+  if (elapsed>command_max_ms) command_max_ms=elapsed;
+  LOG_TRACE("%s:%d took %lldms to run '%s'",fileName,line,elapsed,cmd);
+
+  char name[WATCHDOG_OP_NAME];
+  command_name(cmd,name,sizeof(name));
+  watchdog_op(fileName,line,name,elapsed);
+
+  return r;
+}
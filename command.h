@@ -0,0 +1,19 @@
+#ifndef __COMMAND_H__
+#define __COMMAND_H__
+
+//
+// 'command.h/.c' run external programs (gammu, nx584_client), keeping
+// count of how many we run, and how long they take.
+//
+
+#define run_command(cmd) \
+  run_command_at(__FILE__, __LINE__, cmd)
+
+int run_command_at(const char *fileName, int line, const char *cmd);
+long long command_ms(void);
+
+extern unsigned long long command_spawns;
+extern long long command_total_ms;
+extern long long command_max_ms;
+
+#endif
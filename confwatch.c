@@ -0,0 +1,110 @@
+/*
+
+  NX584 modem interface to SMS controller
+  (C) Copyright Paul Gardner-Stephen 2018-2019
+
+  Watching the config file for changes.
+
+  Editors and configuration management tools rarely rewrite a file in place.
+  More often they write a new file and rename it over the old one, which
+  leaves an inotify watch on the file itself watching the old, now deleted,
+  copy.  We therefore watch the directory containing the file instead, and
+  pick out the events for the file's name.
+
+  Only completed changes are reported (the file being closed after writing,
+  or renamed into place), so that a reload never sees a half-written file.
+  All events waiting are read at once, so a burst of changes results in a
+  single reload.  Several files can be watched, and each is reported
+  separately.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/inotify.h>
+#include "code_instrumentation.h"
+#include "confwatch.h"
+
+int confwatch_fd=-1;
+char confwatch_names[CONFWATCH_MAX_FILES][256];
+int confwatch_wds[CONFWATCH_MAX_FILES];
+int confwatch_count=0;
+
+// Start watching a file.  Returns the bit that confwatch_poll() will set
+// when it changes, or 0 if it can't be watched.
+unsigned int confwatch_setup(const char *path)
+{
+  if (confwatch_count>=CONFWATCH_MAX_FILES) {
+    LOG_WARN("Too many files to watch, not watching '%s'",path);
+    return 0;
+  }
+  char *name=confwatch_names[confwatch_count];
+  int name_size=sizeof(confwatch_names[confwatch_count]);
+  char dir[1024];
+  const char *slash=strrchr(path,'/');
+  if (slash) {
+    snprintf(dir,sizeof(dir),"%.*s",(int)(slash-path),path);
+    if (!dir[0]) snprintf(dir,sizeof(dir),"/");
+    snprintf(name,name_size,"%s",slash+1);
+  } else {
+    snprintf(dir,sizeof(dir),".");
+    snprintf(name,name_size,"%s",path);
+  }
+
+  if (confwatch_fd==-1) confwatch_fd=inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+  if (confwatch_fd==-1) {
+    perror("inotify_init1");
+    LOG_WARN("Could not watch '%s' for changes",path);
+    return 0;
+  }
+  // Watching the same directory twice gives the same watch descriptor
+  int wd=inotify_add_watch(confwatch_fd,dir,IN_CLOSE_WRITE|IN_MOVED_TO);
+  if (wd==-1) {
+    perror("inotify_add_watch");
+    LOG_WARN("Could not watch directory '%s' for changes to '%s'",dir,name);
+    return 0;
+  }
+  confwatch_wds[confwatch_count]=wd;
+  return 1U<<confwatch_count++;
+}
+
+// Returns the bits for the files that have changed since the last call.
+unsigned int confwatch_poll(void)
+{
+  if (confwatch_fd==-1) return 0;
+
+  unsigned int changed=0;
+  // Big enough for many events, and aligned as struct inotify_event needs
+  char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  while(1) {
+    ssize_t r=read(confwatch_fd,buffer,sizeof(buffer));
+    if (r<=0) {
+      if (r==-1&&errno!=EAGAIN&&errno!=EINTR) perror("read(inotify)");
+      break;
+    }
+    for(char *p=buffer;p<buffer+r;) {
+      struct inotify_event *e=(struct inotify_event *)p;
+      for(int i=0;i<confwatch_count;i++)
+	if (e->len&&e->wd==confwatch_wds[i]&&!strcmp(e->name,confwatch_names[i]))
+	  changed|=1U<<i;
+      p+=sizeof(struct inotify_event)+e->len;
+    }
+  }
+  return changed;
+}
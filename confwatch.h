@@ -0,0 +1,15 @@
+#ifndef __CONFWATCH_H__
+#define __CONFWATCH_H__
+
+//
+// 'confwatch.h/.c' notice when a file has been changed, however it was
+// changed (rewritten in place, or replaced by renaming a new file over it),
+// without having to stat() it on every pass of the main loop.
+//
+
+#define CONFWATCH_MAX_FILES 8
+
+unsigned int confwatch_setup(const char *path);
+unsigned int confwatch_poll(void);
+
+#endif
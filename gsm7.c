@@ -0,0 +1,156 @@
+/*
+
+  NX584 modem interface to SMS controller
+  (C) Copyright Paul Gardner-Stephen 2018-2019
+
+  GSM 7-bit alphabet handling for outgoing SMS.
+
+  A single character outside the GSM 03.38 alphabet makes the whole message
+  go out as UCS-2, which drops each segment from 160 to 70 characters, and
+  so can turn a long status report into several times as many (billable)
+  messages.  Everything we send is therefore first normalised to characters
+  that are in the GSM alphabet, replacing look-alikes (curly quotes, dashes,
+  accented letters) with their plain equivalents.
+
+  We restrict ourselves to the printable ASCII subset of the alphabet, as
+  gammu is run with LANG=C, and so would not pass other characters through
+  reliably anyway.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include <string.h>
+#include "gsm7.h"
+
+// Characters that need the GSM escape, and so take two septets
+#define GSM7_EXTENSION "^{}\\[~]|"
+
+struct gsm7_substitute {
+  unsigned int codepoint;
+  const char *replacement;
+};
+
+struct gsm7_substitute gsm7_substitutes[]={
+  {0x00a0," "},   // no-break space
+  {0x00a9,"(c)"},
+  {0x00ab,"\""},{0x00bb,"\""},
+  {0x00b0," deg"},
+  {0x00c0,"A"},{0x00c1,"A"},{0x00c2,"A"},{0x00c3,"A"},{0x00c4,"A"},{0x00c5,"A"},
+  {0x00c7,"C"},
+  {0x00c8,"E"},{0x00c9,"E"},{0x00ca,"E"},{0x00cb,"E"},
+  {0x00cc,"I"},{0x00cd,"I"},{0x00ce,"I"},{0x00cf,"I"},
+  {0x00d1,"N"},
+  {0x00d2,"O"},{0x00d3,"O"},{0x00d4,"O"},{0x00d5,"O"},{0x00d6,"O"},{0x00d8,"O"},
+  {0x00d9,"U"},{0x00da,"U"},{0x00db,"U"},{0x00dc,"U"},
+  {0x00dd,"Y"},
+  {0x00df,"ss"},
+  {0x00e0,"a"},{0x00e1,"a"},{0x00e2,"a"},{0x00e3,"a"},{0x00e4,"a"},{0x00e5,"a"},
+  {0x00e7,"c"},
+  {0x00e8,"e"},{0x00e9,"e"},{0x00ea,"e"},{0x00eb,"e"},
+  {0x00ec,"i"},{0x00ed,"i"},{0x00ee,"i"},{0x00ef,"i"},
+  {0x00f1,"n"},
+  {0x00f2,"o"},{0x00f3,"o"},{0x00f4,"o"},{0x00f5,"o"},{0x00f6,"o"},{0x00f8,"o"},
+  {0x00f9,"u"},{0x00fa,"u"},{0x00fb,"u"},{0x00fc,"u"},
+  {0x00fd,"y"},{0x00ff,"y"},
+  {0x2010,"-"},{0x2011,"-"},{0x2012,"-"},{0x2013,"-"},{0x2014,"-"},{0x2015,"-"},
+  {0x2018,"'"},{0x2019,"'"},{0x201a,"'"},{0x201b,"'"},
+  {0x201c,"\""},{0x201d,"\""},{0x201e,"\""},{0x201f,"\""},
+  {0x2022,"*"},
+  {0x2026,"..."},
+  {0x20ac,"EUR"},
+  {0x2122,"(TM)"},
+  {0,NULL}
+};
+
+// Decode one UTF-8 sequence, returning its length (at least 1, so that
+// invalid input still makes progress).
+int gsm7_utf8_decode(const unsigned char *s,unsigned int *cp)
+{
+  if (s[0]<0x80) { *cp=s[0]; return 1; }
+  int len=0;
+  if ((s[0]&0xe0)==0xc0) { *cp=s[0]&0x1f; len=2; }
+  else if ((s[0]&0xf0)==0xe0) { *cp=s[0]&0x0f; len=3; }
+  else if ((s[0]&0xf8)==0xf0) { *cp=s[0]&0x07; len=4; }
+  else { *cp=0xfffd; return 1; }
+  for(int i=1;i<len;i++) {
+    if ((s[i]&0xc0)!=0x80) { *cp=0xfffd; return i; }
+    *cp=(*cp<<6)|(s[i]&0x3f);
+  }
+  return len;
+}
+
+// Copy in to out, replacing anything outside the GSM 7-bit alphabet.
+// Returns the length of the result.
+int gsm7_normalise(const char *in, char *out, int out_size)
+{
+  int out_len=0;
+  const unsigned char *s=(const unsigned char *)in;
+
+  while(*s&&out_len<out_size-1) {
+    unsigned int cp;
+    s+=gsm7_utf8_decode(s,&cp);
+
+    const char *rep=NULL;
+    char single[2]={0,0};
+    if (cp=='\n'||cp=='\r') single[0]=cp;
+    else if (cp=='\t') single[0]=' ';
+    else if (cp=='`') single[0]='\'';
+    else if (cp>=0x20&&cp<0x7f) single[0]=cp;
+    else {
+      for(int i=0;gsm7_substitutes[i].replacement;i++)
+	if (gsm7_substitutes[i].codepoint==cp) {
+	  rep=gsm7_substitutes[i].replacement;
+	  break;
+	}
+      if (!rep&&cp>=0x20) single[0]='?';
+    }
+    if (!rep) rep=single;
+
+    int rep_len=strlen(rep);
+    if (out_len+rep_len>out_size-1) break;
+    memcpy(&out[out_len],rep,rep_len);
+    out_len+=rep_len;
+  }
+  out[out_len]=0;
+  return out_len;
+}
+
+int gsm7_septets(const char *s)
+{
+  int septets=0;
+  for(;*s;s++)
+    septets+=strchr(GSM7_EXTENSION,*s)?2:1;
+  return septets;
+}
+
+// Number of segments needed for a (normalised) message.  Escaped characters
+// cannot be split across segments, so a segment can end up one short.
+int gsm7_segments(const char *s)
+{
+  if (gsm7_septets(s)<=GSM7_SINGLE_SEGMENT) return 1;
+
+  int segments=1;
+  int used=0;
+  for(;*s;s++) {
+    int width=strchr(GSM7_EXTENSION,*s)?2:1;
+    if (used+width>GSM7_MULTI_SEGMENT) {
+      segments++;
+      used=0;
+    }
+    used+=width;
+  }
+  return segments;
+}
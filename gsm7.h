@@ -0,0 +1,16 @@
+#ifndef __GSM7_H__
+#define __GSM7_H__
+
+//
+// 'gsm7.h/.c' keep outgoing text within the GSM 03.38 7-bit alphabet, and
+// work out exactly how many SMS segments a message will need.
+//
+
+#define GSM7_SINGLE_SEGMENT 160  // septets in a single-part message
+#define GSM7_MULTI_SEGMENT 153   // septets per part of a concatenated message
+
+int gsm7_normalise(const char *in, char *out, int out_size);
+int gsm7_septets(const char *s);
+int gsm7_segments(const char *s);
+
+#endif
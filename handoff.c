@@ -0,0 +1,304 @@
+/*
+
+  NX584 modem interface to SMS controller
+  (C) Copyright Paul Gardner-Stephen 2018-2019
+
+  Handing over to a new copy of ourselves.
+
+  Stopping and starting the daemon closes the serial ports and logs, and
+  leaves a gap during which alarm activity goes unnoticed.  Instead, the
+  running daemon can start the new binary as a child, connected to it by a
+  unix socket, and pass it the file descriptors it is reading from
+  (SCM_RIGHTS), along with the state it has built up, and partly-read
+  lines.  The new process takes them over, says so, and only then does the
+  old one exit.  Input that arrives in the meantime simply waits in the
+  kernel to be read by the new process, so nothing is lost, and as the
+  file descriptors share their offsets, nothing is read twice either.
+
+  If the new process fails to start, or doesn't take over in time, the old
+  one carries on as if nothing had happened.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include "code_instrumentation.h"
+#include "handoff.h"
+
+#define HANDOFF_MAGIC 0x6e783538
+
+struct handoff_header {
+  unsigned int magic;
+  int fd_count;
+  int state_len;
+};
+
+int handoff_fd=-1;
+
+/*
+  Run a new copy of the program, with the same arguments as we were given,
+  plus handoff=<fd> to tell it where to get everything else from.  Returns
+  the pid of the new process, with *sock set to our end of the socket, or
+  -1 if it could not be started.
+*/
+pid_t handoff_start(char **argv, int *sock)
+{
+  pid_t retVal=-1;
+  LOG_ENTRY;
+
+  do {
+    int sv[2];
+    // Only the new process should get the other end, not anything else we
+    // run in the meantime
+    if (socketpair(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0,sv)) {
+      perror("socketpair");
+      LOG_ERROR("Could not create socket to hand over to a new process");
+      break;
+    }
+
+    int argc=0;
+    while(argv[argc]) argc++;
+    char **new_argv=calloc(argc+2,sizeof(char *));
+    char handoff_arg[32];
+    if (!new_argv) {
+      close(sv[0]); close(sv[1]);
+      break;
+    }
+    snprintf(handoff_arg,sizeof(handoff_arg),"handoff=%d",sv[1]);
+    int n=0;
+    new_argv[n++]=argv[0];
+    new_argv[n++]=handoff_arg;
+    for(int i=1;i<argc;i++)
+      // We may have been handed over to ourselves
+      if (strncmp(argv[i],"handoff=",8)) new_argv[n++]=argv[i];
+    new_argv[n]=NULL;
+
+    pid_t pid=fork();
+    if (pid==-1) {
+      perror("fork");
+      LOG_ERROR("Could not fork to hand over to a new process");
+      close(sv[0]); close(sv[1]);
+      free(new_argv);
+      break;
+    }
+    if (!pid) {
+      // Child: everything it needs comes through the socket, so close the
+      // rest, rather than have two copies of each.
+      for(int fd=3;fd<1024;fd++) if (fd!=sv[1]) close(fd);
+      fcntl(sv[1],F_SETFD,0);
+      // The systemd watchdog will be our job once we have taken over
+      if (getenv("WATCHDOG_PID")) {
+	char pid_text[32];
+	snprintf(pid_text,sizeof(pid_text),"%d",(int)getpid());
+	setenv("WATCHDOG_PID",pid_text,1);
+      }
+      execvp(new_argv[0],new_argv);
+      perror("execvp");
+      _exit(127);
+    }
+
+    close(sv[1]);
+    free(new_argv);
+    *sock=sv[0];
+    LOG_NOTE("Started '%s' as pid %d to take over from us",argv[0],(int)pid);
+    retVal=pid;
+  } while(0);
+
+  LOG_EXIT;
+  return retVal;
+}
+
+int handoff_write_all(int sock, const char *data, int len)
+{
+  while(len>0) {
+    ssize_t w=write(sock,data,len);
+    if (w<0&&errno==EINTR) continue;
+    if (w<=0) return -1;
+    data+=w;
+    len-=w;
+  }
+  return 0;
+}
+
+int handoff_read_all(int sock, char *data, int len)
+{
+  while(len>0) {
+    ssize_t r=read(sock,data,len);
+    if (r<0&&errno==EINTR) continue;
+    if (r<=0) return -1;
+    data+=r;
+    len-=r;
+  }
+  return 0;
+}
+
+// Pass the file descriptors, and then the state, to the new process.
+int handoff_send(int sock, const int *fds, int fd_count, const char *state, int state_len)
+{
+  if (fd_count>HANDOFF_MAX_FDS) return -1;
+
+  struct handoff_header h={HANDOFF_MAGIC,fd_count,state_len};
+  struct iovec iov={&h,sizeof(h)};
+  union {
+    char buf[CMSG_SPACE(sizeof(int)*HANDOFF_MAX_FDS)];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg;
+  memset(&msg,0,sizeof(msg));
+  msg.msg_iov=&iov;
+  msg.msg_iovlen=1;
+  if (fd_count) {
+    msg.msg_control=control.buf;
+    msg.msg_controllen=CMSG_SPACE(sizeof(int)*fd_count);
+    struct cmsghdr *c=CMSG_FIRSTHDR(&msg);
+    c->cmsg_level=SOL_SOCKET;
+    c->cmsg_type=SCM_RIGHTS;
+    c->cmsg_len=CMSG_LEN(sizeof(int)*fd_count);
+    memcpy(CMSG_DATA(c),fds,sizeof(int)*fd_count);
+  }
+  if (sendmsg(sock,&msg,MSG_NOSIGNAL)!=sizeof(h)) {
+    perror("sendmsg");
+    LOG_ERROR("Could not pass file descriptors to the new process");
+    return -1;
+  }
+  if (handoff_write_all(sock,state,state_len)) {
+    LOG_ERROR("Could not pass state to the new process");
+    return -1;
+  }
+  return 0;
+}
+
+// Wait for the new process to say it has taken over.  Returns 0 if it has.
+int handoff_wait(int sock, int timeout_ms)
+{
+  struct pollfd p={sock,POLLIN,0};
+  int r;
+  do r=poll(&p,1,timeout_ms); while(r<0&&errno==EINTR);
+  if (r!=1) {
+    LOG_ERROR("The new process did not take over within %dms",timeout_ms);
+    return -1;
+  }
+  char ack;
+  if (read(sock,&ack,1)!=1||ack!='K') {
+    LOG_ERROR("The new process failed to take over");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+  Collect the file descriptors and state from the process we are taking
+  over from.  The state is returned in a malloc()'d buffer, with a
+  terminating nul.
+*/
+int handoff_receive(int sock, int *fds, int max_fds, int *fd_count, char **state, int *state_len)
+{
+  int retVal=-1;
+  LOG_ENTRY;
+
+  do {
+    struct handoff_header h;
+    struct iovec iov={&h,sizeof(h)};
+    union {
+      char buf[CMSG_SPACE(sizeof(int)*HANDOFF_MAX_FDS)];
+      struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    memset(&msg,0,sizeof(msg));
+    msg.msg_iov=&iov;
+    msg.msg_iovlen=1;
+    msg.msg_control=control.buf;
+    msg.msg_controllen=sizeof(control.buf);
+    ssize_t r;
+    do r=recvmsg(sock,&msg,MSG_CMSG_CLOEXEC); while(r<0&&errno==EINTR);
+    if (r!=sizeof(h)||h.magic!=HANDOFF_MAGIC||h.state_len<0) {
+      LOG_ERROR("Did not get a valid hand over from the previous process");
+      break;
+    }
+    if (msg.msg_flags&MSG_CTRUNC) {
+      LOG_ERROR("Some file descriptors were lost in the hand over");
+      break;
+    }
+
+    *fd_count=0;
+    for(struct cmsghdr *c=CMSG_FIRSTHDR(&msg);c;c=CMSG_NXTHDR(&msg,c)) {
+      if (c->cmsg_level!=SOL_SOCKET||c->cmsg_type!=SCM_RIGHTS) continue;
+      int n=(c->cmsg_len-CMSG_LEN(0))/sizeof(int);
+      if (n>max_fds) n=max_fds;
+      memcpy(fds,CMSG_DATA(c),sizeof(int)*n);
+      *fd_count=n;
+    }
+    if (*fd_count!=h.fd_count) {
+      LOG_ERROR("Expected %d file descriptors, but got %d",h.fd_count,*fd_count);
+      break;
+    }
+
+    *state=malloc(h.state_len+1);
+    if (!*state) {
+      LOG_ERROR("Could not allocate %d bytes for the hand over",h.state_len);
+      break;
+    }
+    if (handoff_read_all(sock,*state,h.state_len)) {
+      LOG_ERROR("The hand over was cut short");
+      free(*state);
+      *state=NULL;
+      break;
+    }
+    (*state)[h.state_len]=0;
+    *state_len=h.state_len;
+    retVal=0;
+  } while(0);
+
+  LOG_EXIT;
+  return retVal;
+}
+
+// Tell the previous process that we have taken over, so that it can exit.
+int handoff_ack(int sock)
+{
+  return handoff_write_all(sock,"K",1);
+}
+
+// Arbitrary bytes as a single word, so that they fit in a line of the state
+void handoff_put_hex(FILE *f, const char *data, int len)
+{
+  if (!len) fputc('-',f);
+  for(int i=0;i<len;i++) fprintf(f,"%02x",(unsigned char)data[i]);
+}
+
+// Returns the number of bytes decoded.
+int handoff_get_hex(const char *hex, char *out, int max_len)
+{
+  int len=0;
+  for(;len<max_len;len++) {
+    int byte=0;
+    for(int i=0;i<2;i++) {
+      char c=hex[len*2+i];
+      if (c>='0'&&c<='9') byte=(byte<<4)+c-'0';
+      else if (c>='a'&&c<='f') byte=(byte<<4)+c-'a'+10;
+      else return len;
+    }
+    out[len]=byte;
+  }
+  return len;
+}
@@ -0,0 +1,29 @@
+#ifndef __HANDOFF_H__
+#define __HANDOFF_H__
+
+#include <stdio.h>
+#include <sys/types.h>
+
+//
+// 'handoff.h/.c' start a new copy of the program, and pass it our open
+// inputs and a block of state over a unix socket, so that it can carry on
+// from exactly where we were, without missing or repeating any input.
+//
+
+#define HANDOFF_MAX_FDS 32
+// How long the new process has to say it has taken over
+#define HANDOFF_TIMEOUT_MS 10000
+
+// Socket to the process we are taking over from, or -1
+extern int handoff_fd;
+
+pid_t handoff_start(char **argv, int *sock);
+int handoff_send(int sock, const int *fds, int fd_count, const char *state, int state_len);
+int handoff_wait(int sock, int timeout_ms);
+int handoff_receive(int sock, int *fds, int max_fds, int *fd_count, char **state, int *state_len);
+int handoff_ack(int sock);
+
+void handoff_put_hex(FILE *f, const char *data, int len);
+int handoff_get_hex(const char *hex, char *out, int max_len);
+
+#endif
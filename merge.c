@@ -0,0 +1,277 @@
+/*
+
+  NX584 modem interface to SMS controller
+  (C) Copyright Paul Gardner-Stephen 2018-2019
+
+  Merging several nx584_server logs into panel time order.
+
+  The main loop reads a little from each input in turn, so when there is
+  more than one log, lines are acted on in whatever order the reads happen
+  to complete them, which need not be the order in which the panel
+  reported the events.  Instead, each timestamped line is held in a small
+  heap, ordered by its timestamp, and only let go once every other log has
+  got at least as far (as each log is itself in order, nothing earlier can
+  still turn up), or it has been held for merge_delay_ms.  Only logs that
+  have given us a line within the last merge_delay_ms are waited for: one
+  that has gone quiet, or ended, is unlikely to have anything earlier on
+  its way.  With a single log, nothing is ever held, and lines from inputs
+  that aren't logs (stdin, serial ports) are never held at all.
+
+  Lines without a timestamp of their own (e.g., tracebacks) keep their
+  place after the line before them from the same log.
+
+  As lines are let go, we note how long after the panel logged them we
+  got to act on them.  That is the delay that matters to anyone waiting
+  for an alarm SMS, whatever its cause (slow reads, stalls, the heap).
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "code_instrumentation.h"
+#include "clock.h"
+#include "pool.h"
+#include "merge.h"
+
+struct merge_line {
+  long long panel_ms;
+  int own_time;              // 0 if panel_ms was borrowed from the line before
+  unsigned long long sequence;
+  long long added_ms;
+  int input;
+  char *text;
+  struct pool *text_pool;
+};
+
+struct merge_input {
+  int log;                   // a log, whose lines are put in order
+  long long last_ms;         // the latest time it has reached
+  long long active_ms;       // when it last gave us a line
+};
+
+struct merge_line merge_heap[MERGE_MAX_LINES];
+int merge_count=0;
+struct merge_input merge_inputs[MERGE_MAX_INPUTS];
+unsigned long long merge_sequence=0;
+unsigned long long merge_last_released=0;
+
+// Most log lines are short, so only long ones take a big block
+struct pool merge_short_lines=POOL_INIT("short log lines",256,32);
+struct pool merge_long_lines=POOL_INIT("long log lines",MERGE_MAX_LINE,2);
+
+int merge_delay_ms=500;
+int merge_lag_warn_ms=30000;
+int merge_lag_warned=0;
+
+unsigned long long merge_reordered=0;  // acted on ahead of a line read before them
+unsigned long long merge_forced=0;     // let go before the other logs caught up
+long long merge_lag_last_ms=0;
+long long merge_lag_max_ms=0;
+long long merge_lag_total_ms=0;
+unsigned long long merge_lag_count=0;
+
+/*
+  The time at the start of a nx584_server log line, in milliseconds since
+  1970, or -1 if it doesn't have one.  The log is in local time.
+*/
+long long merge_timestamp(const char *line)
+{
+  int year,month,day,hour,min,sec,msec;
+  char separator;
+  if (sscanf(line,"%d-%d-%d %d:%d:%d%c%d",
+	     &year,&month,&day,&hour,&min,&sec,&separator,&msec)!=8) return -1;
+  if (separator!=','&&separator!='.') return -1;
+
+  // mktime() is slow, and the hour rarely changes from one line to the next
+  static int cached[4]={-1,-1,-1,-1};
+  static long long cached_ms=0;
+  if (year!=cached[0]||month!=cached[1]||day!=cached[2]||hour!=cached[3]) {
+    struct tm tm;
+    memset(&tm,0,sizeof(tm));
+    tm.tm_year=year-1900;
+    tm.tm_mon=month-1;
+    tm.tm_mday=day;
+    tm.tm_hour=hour;
+    tm.tm_isdst=-1;
+    time_t t=mktime(&tm);
+    if (t==-1) return -1;
+    cached[0]=year; cached[1]=month; cached[2]=day; cached[3]=hour;
+    cached_ms=t*1000LL;
+  }
+  return cached_ms+(min*60+sec)*1000LL+msec;
+}
+
+int merge_before(struct merge_line *a, struct merge_line *b)
+{
+  if (a->panel_ms!=b->panel_ms) return a->panel_ms<b->panel_ms;
+  return a->sequence<b->sequence;
+}
+
+void merge_swap(int a, int b)
+{
+  struct merge_line t=merge_heap[a];
+  merge_heap[a]=merge_heap[b];
+  merge_heap[b]=t;
+}
+
+// Tell us which inputs are logs, before they have given us any lines, so
+// that lines from the others wait for them from the start.
+void merge_expect(int input, long long now_ms)
+{
+  if (input<0||input>=MERGE_MAX_INPUTS||merge_inputs[input].log) return;
+  merge_inputs[input].log=1;
+  merge_inputs[input].last_ms=0;
+  merge_inputs[input].active_ms=now_ms;
+}
+
+// Stop waiting for a log that has ended.  Its lines already held still
+// go in order.
+void merge_forget(int input)
+{
+  if (input<0||input>=MERGE_MAX_INPUTS) return;
+  merge_inputs[input].log=0;
+}
+
+/*
+  Hold a line until it is its turn.  panel_ms is the line's timestamp, or -1
+  if it has none.  Returns 0 if the line has been queued, or -1 if the
+  caller should act on it straight away.
+*/
+int merge_add(int input, const char *line, long long panel_ms, long long now_ms)
+{
+  if (input<0||input>=MERGE_MAX_INPUTS) return -1;
+  struct merge_input *in=&merge_inputs[input];
+  if (!in->log) return -1;
+  int own_time=panel_ms>=0;
+  if (!own_time) panel_ms=in->last_ms;
+  if (merge_count>=MERGE_MAX_LINES) return -1;
+
+  struct merge_line *l=&merge_heap[merge_count];
+  l->text_pool=(strlen(line)<256)?&merge_short_lines:&merge_long_lines;
+  l->text=pool_strdup(l->text_pool,line);
+  if (!l->text) return -1;
+  l->panel_ms=panel_ms;
+  l->own_time=own_time;
+  l->sequence=merge_sequence++;
+  l->added_ms=now_ms;
+  l->input=input;
+
+  for(int i=merge_count++;i>0;) {
+    int parent=(i-1)/2;
+    if (!merge_before(&merge_heap[i],&merge_heap[parent])) break;
+    merge_swap(i,parent);
+    i=parent;
+  }
+
+  if (panel_ms>in->last_ms) in->last_ms=panel_ms;
+  in->active_ms=now_ms;
+  return 0;
+}
+
+// Remove the earliest line from the heap, into *l
+void merge_pop(struct merge_line *l)
+{
+  *l=merge_heap[0];
+  merge_heap[0]=merge_heap[--merge_count];
+  for(int i=0;;) {
+    int first=i;
+    for(int c=2*i+1;c<=2*i+2&&c<merge_count;c++)
+      if (merge_before(&merge_heap[c],&merge_heap[first])) first=c;
+    if (first==i) break;
+    merge_swap(i,first);
+    i=first;
+  }
+}
+
+void merge_deliver(struct merge_line *l, merge_line_handler handler)
+{
+  if (l->sequence<merge_last_released) merge_reordered++;
+  else merge_last_released=l->sequence;
+
+  if (l->own_time) {
+    long long lag=clock_time_ms()-l->panel_ms;
+    merge_lag_last_ms=lag;
+    if (lag>merge_lag_max_ms) merge_lag_max_ms=lag;
+    merge_lag_total_ms+=lag;
+    merge_lag_count++;
+    if (merge_lag_warn_ms&&lag>merge_lag_warn_ms&&!merge_lag_warned) {
+      LOG_WARN("Acting on panel events %lldms after they happened",lag);
+      merge_lag_warned=1;
+    } else if (merge_lag_warned&&lag<merge_lag_warn_ms/2) {
+      LOG_NOTE("Caught up with the panel (%lldms behind)",lag);
+      merge_lag_warned=0;
+    }
+  }
+
+  handler(l->input,l->text,l->own_time?l->panel_ms:-1);
+  pool_free(l->text_pool,l->text);
+}
+
+// Act on every line whose turn has come.  Returns how many there were.
+int merge_release(long long now_ms, merge_line_handler handler)
+{
+  int released=0;
+  while(merge_count) {
+    struct merge_line *next=&merge_heap[0];
+    int ready=1;
+    for(int i=0;i<MERGE_MAX_INPUTS;i++) {
+      struct merge_input *in=&merge_inputs[i];
+      if (i!=next->input&&in->log&&now_ms-in->active_ms<merge_delay_ms
+	  &&in->last_ms<next->panel_ms) {
+	ready=0;
+	break;
+      }
+    }
+    if (!ready) {
+      // Leave room for a line from each input before we are next called
+      if (now_ms-next->added_ms<merge_delay_ms
+	  &&merge_count<MERGE_MAX_LINES-MERGE_MAX_INPUTS) break;
+      merge_forced++;
+    }
+
+    struct merge_line l;
+    merge_pop(&l);
+    merge_deliver(&l,handler);
+    released++;
+  }
+  return released;
+}
+
+// Act on everything still held, e.g., before exiting.
+void merge_flush(merge_line_handler handler)
+{
+  while(merge_count) {
+    struct merge_line l;
+    merge_pop(&l);
+    merge_deliver(&l,handler);
+  }
+}
+
+int merge_pending(void)
+{
+  return merge_count;
+}
+
+// Bytes read from an input, but not yet acted on, counting the end of line
+long long merge_pending_bytes(int input)
+{
+  long long bytes=0;
+  for(int i=0;i<merge_count;i++)
+    if (merge_heap[i].input==input) bytes+=strlen(merge_heap[i].text)+1;
+  return bytes;
+}
@@ -0,0 +1,36 @@
+#ifndef __MERGE_H__
+#define __MERGE_H__
+
+//
+// 'merge.h/.c' put the lines read from several nx584_server logs back into
+// the order the panel reported them in, and measure how far behind the
+// panel we are by the time each one is acted on.
+//
+
+#define MERGE_MAX_LINES 256
+#define MERGE_MAX_INPUTS 16
+#define MERGE_MAX_LINE 8192
+
+// Called for each line, in panel time order.  panel_ms is -1 if the line
+// had no time of its own.
+typedef void (*merge_line_handler)(int input, char *line, long long panel_ms);
+
+extern int merge_delay_ms;
+extern int merge_lag_warn_ms;
+extern unsigned long long merge_reordered;
+extern unsigned long long merge_forced;
+extern long long merge_lag_last_ms;
+extern long long merge_lag_max_ms;
+extern long long merge_lag_total_ms;
+extern unsigned long long merge_lag_count;
+
+long long merge_timestamp(const char *line);
+void merge_expect(int input, long long now_ms);
+void merge_forget(int input);
+int merge_add(int input, const char *line, long long panel_ms, long long now_ms);
+int merge_release(long long now_ms, merge_line_handler handler);
+void merge_flush(merge_line_handler handler);
+int merge_pending(void);
+long long merge_pending_bytes(int input);
+
+#endif
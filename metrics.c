@@ -0,0 +1,236 @@
+/*
+
+  NX584 modem interface to SMS controller
+  (C) Copyright Paul Gardner-Stephen 2018-2019
+
+  Prometheus metrics export.
+
+  The metrics themselves are written by a generator function supplied by
+  the main program.  This file only deals with getting them to Prometheus:
+  either by writing them to a file every metrics_interval seconds, for
+  node_exporter's textfile collector (writing a temporary file, and renaming
+  it into place, so that the collector never sees a partial file), or by
+  serving them over HTTP on a port bound to localhost.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "code_instrumentation.h"
+#include "clock.h"
+#include "serial.h"
+#include "metrics.h"
+
+char metrics_file[1024]="";
+int metrics_interval=15;
+int metrics_port=0;
+
+metrics_generator metrics_generate=NULL;
+time_t metrics_last_write=0;
+int metrics_listen_fd=-1;
+
+int metrics_setup(metrics_generator generator)
+{
+  metrics_generate=generator;
+
+  if (!metrics_port) return 0;
+  // Handed to us by the process we took over from
+  if (metrics_listen_fd!=-1) return 0;
+
+  int fd=socket(AF_INET,SOCK_STREAM|SOCK_CLOEXEC,0);
+  if (fd==-1) {
+    perror("socket");
+    LOG_ERROR("Could not create metrics socket");
+    return -1;
+  }
+  int one=1;
+  setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one));
+
+  // Only reachable from this machine
+  struct sockaddr_in addr;
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family=AF_INET;
+  addr.sin_port=htons(metrics_port);
+  addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+  if (bind(fd,(struct sockaddr *)&addr,sizeof(addr))||listen(fd,4)) {
+    perror("bind/listen");
+    LOG_ERROR("Could not listen for metrics requests on port %d",metrics_port);
+    close(fd);
+    return -1;
+  }
+  set_nonblock(fd);
+  metrics_listen_fd=fd;
+  LOG_NOTE("Serving metrics on http://127.0.0.1:%d/metrics",metrics_port);
+  return 0;
+}
+
+int metrics_write_file(void)
+{
+  char tmp[1100];
+  snprintf(tmp,sizeof(tmp),"%s.tmp",metrics_file);
+  FILE *f=fopen(tmp,"w");
+  if (!f) {
+    LOG_WARN("Could not write metrics to '%s'",tmp);
+    return -1;
+  }
+  metrics_generate(f);
+  if (fclose(f)) {
+    unlink(tmp);
+    return -1;
+  }
+  if (rename(tmp,metrics_file)) {
+    perror("rename");
+    LOG_WARN("Could not replace metrics file '%s'",metrics_file);
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+// Connections waiting for us to read their request, or to finish sending
+// them the metrics.  Everything is non-blocking: requests are read a bit at
+// a time on each pass of the main loop, and the reply is queued for
+// outq_poll_flush() to send, so a slow client can't hold up the loop.
+#define METRICS_MAX_CLIENTS 4
+#define METRICS_CLIENT_TIMEOUT_MS 5000
+
+struct metrics_client {
+  int fd;
+  long long started_ms;
+  int replied;
+  int request_len;
+  char request[1024];
+};
+
+struct metrics_client metrics_clients[METRICS_MAX_CLIENTS];
+int metrics_client_count=0;
+
+long long metrics_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1000LL+ts.tv_nsec/1000000;
+}
+
+// Queue the reply to a request.  Returns -1 if it could not be queued.
+int metrics_reply(int fd)
+{
+  char *body=NULL;
+  size_t body_len=0;
+  FILE *f=open_memstream(&body,&body_len);
+  if (!f) return -1;
+  metrics_generate(f);
+  fclose(f);
+
+  char header[256];
+  snprintf(header,sizeof(header),
+	   "HTTP/1.0 200 OK\r\n"
+	   "Content-Type: text/plain; version=0.0.4\r\n"
+	   "Content-Length: %d\r\n"
+	   "\r\n",(int)body_len);
+  int retVal=0;
+  if (write_all(fd,header,strlen(header))==-1
+      ||write_all(fd,body,body_len)==-1) {
+    LOG_WARN("Could not send all metrics to client");
+    retVal=-1;
+  }
+  free(body);
+  return retVal;
+}
+
+// Read what has arrived of a client's request, and reply once the end of
+// the request headers has been seen.  Returns 1 once the client is done
+// with, either way.
+int metrics_client_poll(struct metrics_client *c)
+{
+  if (c->replied) return outq_pending(c->fd)==0;
+
+  ssize_t r=read(c->fd,&c->request[c->request_len],sizeof(c->request)-1-c->request_len);
+  // Closed before sending a whole request
+  if (r==0) return 1;
+  if (r==-1) return errno!=EAGAIN&&errno!=EWOULDBLOCK&&errno!=EINTR;
+  c->request_len+=r;
+  c->request[c->request_len]=0;
+
+  // Anything longer than our buffer isn't a request we need to look at
+  if (strstr(c->request,"\r\n\r\n")||strstr(c->request,"\n\n")
+      ||c->request_len==(int)sizeof(c->request)-1) {
+    if (metrics_reply(c->fd)) return 1;
+    c->replied=1;
+    return outq_pending(c->fd)==0;
+  }
+  return 0;
+}
+
+// Write the metrics file when it is due, and answer any waiting requests.
+int metrics_poll(void)
+{
+  if (!metrics_generate) return 0;
+
+  if (metrics_file[0]&&(clock_now()-metrics_last_write)>=metrics_interval) {
+    metrics_write_file();
+    metrics_last_write=clock_now();
+  }
+
+  if (metrics_listen_fd==-1) return 0;
+
+  while(metrics_client_count<METRICS_MAX_CLIENTS) {
+    int fd=accept4(metrics_listen_fd,NULL,NULL,SOCK_NONBLOCK|SOCK_CLOEXEC);
+    if (fd==-1) break;
+    struct metrics_client *c=&metrics_clients[metrics_client_count++];
+    c->fd=fd;
+    c->started_ms=metrics_ms();
+    c->replied=0;
+    c->request_len=0;
+  }
+
+  long long now=metrics_ms();
+  for(int i=0;i<metrics_client_count;) {
+    struct metrics_client *c=&metrics_clients[i];
+    if (metrics_client_poll(c)||now-c->started_ms>METRICS_CLIENT_TIMEOUT_MS) {
+      outq_close(c->fd);
+      metrics_clients[i]=metrics_clients[--metrics_client_count];
+    } else i++;
+  }
+  return 0;
+}
+
+void metrics_describe(FILE *f, const char *name, const char *type, const char *help)
+{
+  fprintf(f,"# HELP %s %s\n# TYPE %s %s\n",name,help,name,type);
+}
+
+// Write a label value, escaped as the text format requires
+void metrics_label_value(FILE *f, const char *value)
+{
+  fputc('"',f);
+  for(;*value;value++) {
+    if (*value=='\\'||*value=='"') fputc('\\',f);
+    if (*value=='\n') fputs("\\n",f);
+    else fputc(*value,f);
+  }
+  fputc('"',f);
+}
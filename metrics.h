@@ -0,0 +1,26 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdio.h>
+
+//
+// 'metrics.h/.c' export the daemon's counters and gauges in the Prometheus
+// text format, either by atomically rewriting a file for node_exporter's
+// textfile collector, or by answering HTTP requests on a localhost port.
+//
+
+// Writes all of the metrics to f.  Supplied by the main program.
+typedef void (*metrics_generator)(FILE *f);
+
+extern char metrics_file[1024];
+extern int metrics_interval;
+extern int metrics_port;
+extern int metrics_listen_fd;
+
+int metrics_setup(metrics_generator generator);
+int metrics_poll(void);
+
+void metrics_describe(FILE *f, const char *name, const char *type, const char *help);
+void metrics_label_value(FILE *f, const char *value);
+
+#endif
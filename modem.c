@@ -0,0 +1,286 @@
+/*
+
+  NX584 modem interface to SMS controller
+  (C) Copyright Paul Gardner-Stephen 2018-2019
+
+  Cellular modem pool.
+
+  A modem takes several seconds to send each SMS, so with many users an
+  alarm broadcast through a single modem can take minutes to reach the last
+  of them.  Several modems can therefore be used at once.  Each modem found
+  when probing the serial ports gets its own gammu config file, and gammu is
+  run in the background for each send, so that all of the modems can be
+  sending at the same time, while the main loop keeps reading the alarm.
+
+  Each modem only ever has one send in progress, as gammu needs the device
+  to itself.  Whenever a modem is free, it takes the next message from the
+  queue.  If several are free, the one that has been sending fastest goes
+  first, so slow or struggling modems end up with less of the work.
+
+  A modem that fails several sends in a row, or on which gammu hangs, is
+  left alone for a while, with the time doubling each time it fails again,
+  and its messages go through the others.  Received messages are collected
+  from every modem that is up, one modem per poll.
+
+  If no modems were found by probing, gammu's own default configuration is
+  used, as before, as though it were a single modem.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "code_instrumentation.h"
+#include "clock.h"
+#include "command.h"
+#include "modem.h"
+
+// Give up on a send that has taken this long
+#define MODEM_SEND_TIMEOUT_MS 120000
+// Failures in a row before a modem is taken out of use
+#define MODEM_MAX_FAILURES 3
+#define MODEM_MIN_BACKOFF 60
+#define MODEM_MAX_BACKOFF 900
+
+struct modem modems[MAX_MODEMS];
+int modems_added=0;
+// gammu connection type for modems we find
+char modem_connection[64]="at";
+
+int modem_next_poll=0;
+
+int modem_add(const char *device)
+{
+  if (modems_added>=MAX_MODEMS) {
+    LOG_ERROR("Too many modems, not using '%s'",device);
+    return -1;
+  }
+  int m=modems_added;
+  struct modem *md=&modems[m];
+  memset(md,0,sizeof(*md));
+  snprintf(md->device,sizeof(md->device),"%s",device);
+  md->pid=-1;
+
+  // A name nobody else can guess, created afresh (O_EXCL), so that nobody
+  // can have put a symlink or file of their own there first.
+  const char *tmpdir=getenv("TMPDIR");
+  if (!tmpdir||!tmpdir[0]) tmpdir="/tmp";
+  snprintf(md->config,sizeof(md->config),"%s/nx584-sms-modem%d.XXXXXX",tmpdir,m);
+  int fd=mkstemp(md->config);
+  FILE *f=fd==-1?NULL:fdopen(fd,"w");
+  if (!f) {
+    perror("mkstemp");
+    LOG_ERROR("Could not write gammu config file '%s'",md->config);
+    if (fd!=-1) { close(fd); unlink(md->config); }
+    md->config[0]=0;
+    return -1;
+  }
+  fprintf(f,"[gammu]\ndevice = %s\nconnection = %s\n",device,modem_connection);
+  if (fclose(f)) {
+    LOG_ERROR("Could not write gammu config file '%s'",md->config);
+    unlink(md->config);
+    md->config[0]=0;
+    return -1;
+  }
+
+  modems_added++;
+  LOG_NOTE("Using '%s' as modem #%d",device,m);
+  return m;
+}
+
+// Remove the gammu config files we made, when exiting.  Sends still in
+// progress already have theirs open.
+void modem_cleanup(void)
+{
+  for(int i=0;i<modems_added;i++)
+    if (modems[i].config[0]) unlink(modems[i].config);
+}
+
+// Without any modems of our own, gammu's default configuration is modem #0
+void modem_default(void)
+{
+  if (modems_added) return;
+  memset(&modems[0],0,sizeof(modems[0]));
+  modems[0].pid=-1;
+  modems_added=1;
+}
+
+int modem_count(void)
+{
+  modem_default();
+  return modems_added;
+}
+
+int modem_is_up(struct modem *md)
+{
+  return md->down_until<=clock_now();
+}
+
+int modem_up_count(void)
+{
+  int count=0;
+  for(int i=0;i<modem_count();i++) if (modem_is_up(&modems[i])) count++;
+  return count;
+}
+
+int modem_busy_count(void)
+{
+  int count=0;
+  for(int i=0;i<modems_added;i++) if (modems[i].pid!=-1) count++;
+  return count;
+}
+
+// The fastest modem that is free to send, or -1 if none are.
+int modem_pick(void)
+{
+  int best=-1;
+  for(int i=0;i<modem_count();i++) {
+    if (modems[i].pid!=-1||!modem_is_up(&modems[i])) continue;
+    if (best==-1||modems[i].avg_send_ms<modems[best].avg_send_ms) best=i;
+  }
+  return best;
+}
+
+// The gammu command line for a modem, to which the gammu arguments are added
+void modem_gammu(int m, char *out, int max_len)
+{
+  modem_default();
+  if (modems[m].config[0])
+    snprintf(out,max_len,"LANG=C gammu -c %s",modems[m].config);
+  else
+    snprintf(out,max_len,"LANG=C gammu");
+}
+
+// Start gammu with the given arguments on a modem, without waiting for it.
+int modem_start(int m, const char *args, int job)
+{
+  struct modem *md=&modems[m];
+  char cmd[8192];
+  modem_gammu(m,cmd,sizeof(cmd));
+  int len=strlen(cmd);
+  snprintf(&cmd[len],sizeof(cmd)-len," %s",args);
+
+  pid_t pid=fork();
+  if (pid==-1) {
+    perror("fork");
+    return -1;
+  }
+  if (!pid) {
+    // Its own process group, so that a hung send can be killed outright
+    setpgid(0,0);
+    execl("/bin/sh","sh","-c",cmd,(char *)NULL);
+    _exit(127);
+  }
+  md->pid=pid;
+  md->job=job;
+  md->started_ms=command_ms();
+  command_spawns++;
+  return 0;
+}
+
+void modem_failed(int m)
+{
+  struct modem *md=&modems[m];
+  md->failed++;
+  md->consecutive_failures++;
+  if (md->consecutive_failures<MODEM_MAX_FAILURES) return;
+
+  if (md->down_backoff<MODEM_MIN_BACKOFF) md->down_backoff=MODEM_MIN_BACKOFF;
+  md->down_until=clock_now()+md->down_backoff;
+  LOG_ERROR("Modem #%d (%s) has failed %d times in a row, not using it for %d seconds",
+	    m,md->device[0]?md->device:"default",md->consecutive_failures,md->down_backoff);
+  md->down_backoff*=2;
+  if (md->down_backoff>MODEM_MAX_BACKOFF) md->down_backoff=MODEM_MAX_BACKOFF;
+  md->consecutive_failures=0;
+}
+
+/*
+  Check for a finished send.  Returns the modem it was on, and sets *job
+  and *status (0 for success, as for system()), or returns -1 if nothing
+  has finished.
+*/
+int modem_reap(int *job, int *status)
+{
+  long long now=command_ms();
+  for(int m=0;m<modem_count();m++) {
+    struct modem *md=&modems[m];
+    if (md->pid==-1) continue;
+
+    int wstatus;
+    pid_t r=waitpid(md->pid,&wstatus,WNOHANG);
+    if (r==0) {
+      if (now-md->started_ms<MODEM_SEND_TIMEOUT_MS) continue;
+      LOG_ERROR("gammu on modem #%d has not finished after %lld seconds, killing it",
+		m,(now-md->started_ms)/1000);
+      kill(-md->pid,SIGKILL);
+      waitpid(md->pid,&wstatus,0);
+      wstatus=-1;
+    } else if (r==-1) {
+      perror("waitpid");
+      wstatus=-1;
+    }
+
+    long long elapsed=now-md->started_ms;
+    command_total_ms+=elapsed;
+    if (elapsed>command_max_ms) command_max_ms=elapsed;
+    md->pid=-1;
+    *job=md->job;
+    if (wstatus!=-1&&WIFEXITED(wstatus)&&!WEXITSTATUS(wstatus)) {
+      *status=0;
+      md->sent++;
+      md->consecutive_failures=0;
+      md->down_backoff=0;
+      md->avg_send_ms=md->avg_send_ms?md->avg_send_ms*0.8+elapsed*0.2:elapsed;
+    } else {
+      *status=(wstatus==-1)?-1:wstatus;
+      modem_failed(m);
+    }
+    return m;
+  }
+  return -1;
+}
+
+// Which modem to check for received messages next, or -1 if none are free.
+int modem_poll_next(void)
+{
+  for(int i=0;i<modem_count();i++) {
+    int m=(modem_next_poll+i)%modem_count();
+    if (modems[m].pid!=-1||!modem_is_up(&modems[m])) continue;
+    modem_next_poll=(m+1)%modem_count();
+    return m;
+  }
+  return -1;
+}
+
+void modem_report(char *out, int max_len)
+{
+  int len=0;
+  out[0]=0;
+  for(int m=0;m<modem_count()&&len<max_len;m++) {
+    struct modem *md=&modems[m];
+    snprintf(&out[len],max_len-len,"Modem #%d %s: %s, %llu sent, %llu failed, %.0fms per SMS.\n",
+	     m,md->device[0]?md->device:"(default)",
+	     !modem_is_up(md)?"down":(md->pid!=-1?"sending":"idle"),
+	     md->sent,md->failed,md->avg_send_ms);
+    len=strlen(out);
+  }
+}
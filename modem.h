@@ -0,0 +1,44 @@
+#ifndef __MODEM_H__
+#define __MODEM_H__
+
+#include <sys/types.h>
+#include <time.h>
+
+//
+// 'modem.h/.c' keep track of the cellular modems we send and receive SMS
+// through, run gammu against each of them without waiting for it to
+// finish, and stop using any that stop working.
+//
+
+#define MAX_MODEMS 8
+
+struct modem {
+  char device[1024];     // empty for gammu's own default configuration
+  char config[1100];     // gammu config file pointing at the device
+  pid_t pid;             // gammu sending through this modem, or -1
+  int job;               // what the caller asked us to send
+  long long started_ms;
+  unsigned long long sent;
+  unsigned long long failed;
+  int consecutive_failures;
+  double avg_send_ms;    // moving average of how long a send takes
+  time_t down_until;     // not used until then, after repeated failures
+  int down_backoff;
+};
+
+extern struct modem modems[MAX_MODEMS];
+extern char modem_connection[64];
+
+int modem_add(const char *device);
+void modem_cleanup(void);
+int modem_count(void);
+int modem_up_count(void);
+int modem_busy_count(void);
+int modem_pick(void);
+int modem_start(int m, const char *args, int job);
+int modem_reap(int *job, int *status);
+int modem_poll_next(void);
+void modem_gammu(int m, char *out, int max_len);
+void modem_report(char *out, int max_len);
+
+#endif
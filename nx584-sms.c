@@ -31,17 +31,33 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
 #include <strings.h>
 #include <stdlib.h>
 #include <time.h>
+#include <ctype.h>
+#include <signal.h>
 #include "code_instrumentation.h"
-
-
-int set_nonblock(int fd);
-int write_all(int fd,char *s,int len);
+#include "clock.h"
+#include "serial.h"
+#include "probe.h"
+#include "supervisor.h"
+#include "gsm7.h"
+#include "smsq.h"
+#include "command.h"
+#include "pool.h"
+#include "metrics.h"
+#include "checkpoint.h"
+#include "confwatch.h"
+#include "watchdog.h"
+#include "modem.h"
+#include "rules.h"
+#include "handoff.h"
+#include "merge.h"
+#include "transport.h"
 
 char master_pin[1024]="9999";
 char nx584_client[1024]="../pynx584/nx584_client";
@@ -58,11 +74,18 @@ int inputs[MAX_INPUTS];
 #define IT_TEXTCOMMANDS 3
 int input_types[MAX_INPUTS];
 int input_count=0;
-// Buffers for lines of input being read
+// Buffers for lines of input being read.  These start small, and grow as
+// needed, up to BUFFER_SIZE.
 #define BUFFER_SIZE 8192
-char buffers[MAX_INPUTS][BUFFER_SIZE];
+#define BUFFER_INITIAL_SIZE 256
+char *buffers[MAX_INPUTS];
+int buffer_sizes[MAX_INPUTS];
 int buffer_lens[MAX_INPUTS];
 
+// Replies to commands, and other messages we generate, are never longer
+// than this.
+#define REPLY_SIZE SMSQ_MAX_TEXT
+
 int siren=-1;
 int armedP=-1;
 #define MAX_ZONES 64
@@ -72,7 +95,85 @@ int armedP=-1;
 int zoneStates[MAX_ZONES];
 
 time_t siren_on_time=0;
+// When the panel logged the line being acted on, or 0 if not known
+time_t line_panel_time=0;
 int significant_event=0;
+// Arm state of each partition, -1 if not known, for spotting changes
+int partition_armed[RULE_KEYS];
+
+// Activity counters, reported by the stats command
+time_t start_time=0;
+unsigned long long lines_by_type[4];
+unsigned long long sms_polls=0;
+unsigned long long sms_received=0;
+unsigned long long inbound_accepted=0;   // commands that got past the rate limit
+unsigned long long inbound_throttled=0;  // dropped for coming too fast
+unsigned long long inbound_coalesced=0;  // answered along with an identical one
+unsigned long long alarm_broadcasts=0;
+unsigned long long lines_by_input[MAX_INPUTS];
+time_t last_line_time[MAX_INPUTS];
+
+// Main loop timing, excluding time spent idle waiting for input
+unsigned long long loop_iterations=0;
+long long loop_busy_us_total=0;
+long long loop_busy_us_max=0;
+
+long long monotonic_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1000000LL+ts.tv_nsec/1000;
+}
+
+// Serial port profile to apply to the next character device input
+struct serial_profile port_profile;
+
+// Serial ports waiting to be probed, and what we learn from probing them
+struct probe_device probe_list[MAX_PROBE_DEVICES];
+int probe_count=0;
+int probe_timeout=500;
+char probe_cache[1024]="/var/cache/nx584-sms.devices";
+char nx584_serial_port[sizeof(probe_list[0].path)]="";
+
+// Input slot used for the output of nx584_server, when we run it ourselves
+int supervisor_input=-1;
+
+// Where we save the alarm state, and how far through each log it reflects,
+// so that a restart only has to replay what was logged since.
+char checkpoint_file[1024]="/var/lib/nx584-sms.state";
+// How much of the end of a log to replay when there is no usable checkpoint
+long long replay_max=256*1024;
+// Save soon after the state changes, and now and then regardless, so that
+// the log offsets don't fall too far behind.
+#define CHECKPOINT_MIN_INTERVAL 5
+#define CHECKPOINT_MAX_INTERVAL 300
+int checkpoint_dirty=0;
+int checkpoint_failed=0;
+time_t checkpoint_time=0;
+// Set while replaying old log lines, which must not be acted upon
+int replaying=0;
+// Set while replaying the part of a log written since the checkpoint, whose
+// zone and partition changes were missed, and still need to be routed
+int replaying_missed=0;
+
+// Zone and partition changes found while replaying, routed once the replay
+// has brought the rest of the state up to date
+#define MISSED_EVENTS_MAX 64
+struct missed_event {
+  int event;
+  int key;
+  time_t when;
+  char what[160];
+};
+struct missed_event missed_events[MISSED_EVENTS_MAX];
+int missed_event_count=0;
+int missed_events_dropped=0;
+
+volatile sig_atomic_t exit_requested=0;
+// Set by SIGUSR2, to hand over to a new copy of ourselves (see handoff.c)
+volatile sig_atomic_t restart_requested=0;
+int handed_over=0;
+char **main_argv;
 
 int open_input(char *in)
 {
@@ -96,10 +197,11 @@ int open_input(char *in)
       retVal=-1;
       break;
     }
-    if (st.st_mode&S_IFREG) {
+    if (S_ISREG(st.st_mode)) {
       LOG_NOTE("'%s' is a regular file",in);
-      // Probably a log file, open for input, and seek to the end
-      int fd=open(in,O_NONBLOCK,O_RDONLY);
+      // Probably a log file, open for input, and seek to the end.
+      // recover_state() later replays whatever we missed while not running.
+      int fd=open(in,O_RDONLY|O_NONBLOCK|O_CLOEXEC);
       if (fd==-1) {
 	perror("open");
 	LOG_ERROR("Could not open '%s' for read",in);
@@ -117,23 +219,8 @@ int open_input(char *in)
 	LOG_NOTE("Seeked to offset %lld of '%s'",(long long)r,in);
       retVal=fd;
       break;
-    } else if (st.st_mode&S_IFCHR) {
-      LOG_NOTE("'%s' is a character device",in);
-      int fd=open(in,O_NONBLOCK,O_RDWR);
-      if (fd==-1) {
-	perror("open");
-	LOG_ERROR("Could not open '%s' for read and write",in);
-	retVal=-1;
-	break;
-      }
-      // We think it is a serial port, so send ATI to see if it is a cellular modem
-      // (we will read the response later)
-      write(fd,"ATI\r\n",5);
-      
-      retVal=fd;
-      break;
     } else {
-      LOG_ERROR("Input file '%s' is neither regular file nor character device.",in);
+      LOG_ERROR("Input file '%s' is not a regular file.",in);
       retVal=-1;
       break;
     }
@@ -144,11 +231,21 @@ int open_input(char *in)
 }
 
 #define MAX_USERS 256
+// Phone numbers are at most 15 digits (E.164), plus the leading +
+#define USER_NUMBER_SIZE 32
+struct pool user_pool=POOL_INIT("users",USER_NUMBER_SIZE,32);
 char *users[MAX_USERS];
 int is_admin[MAX_USERS];
+// Escalation tier for alarm notifications: tier 1 is told straight away,
+// tier 2 only if nobody in tier 1 acknowledges, and so on.
+#define MIN_TIER 1
+#define MAX_TIER 9
+int user_tier[MAX_USERS];
 int user_count=0;
 
 char config_file[1024]="/usr/local/etc/nx584-sms.conf";
+unsigned int config_watch=0;
+unsigned int rules_watch=0;
 
 int save_user_list(void)
 {
@@ -160,10 +257,9 @@ int save_user_list(void)
   }
 
   for(int i=0;i<user_count;i++) {
-    if (is_admin[i])
-      fprintf(f,"admin %s\n",users[i]);
-    else
-      fprintf(f,"user %s\n",users[i]);
+    fprintf(f,"%s %s",is_admin[i]?"admin":"user",users[i]);
+    if (user_tier[i]!=MIN_TIER) fprintf(f," %d",user_tier[i]);
+    fprintf(f,"\n");
   }
   
   fclose(f);
@@ -171,25 +267,54 @@ int save_user_list(void)
   return 0;
 }
 
-int load_user_list(void)
+// The config file is read into here first, and only replaces the live user
+// list once it has been read completely.
+struct user_list {
+  char numbers[MAX_USERS][USER_NUMBER_SIZE];
+  int is_admin[MAX_USERS];
+  int tier[MAX_USERS];
+  int count;
+};
+struct user_list user_list_staging;
+
+int config_loaded=0;
+unsigned long long config_reloads=0;
+long long config_reload_us_last=0;
+long long config_reload_us_max=0;
+
+int read_user_list(struct user_list *l)
 {
   FILE *f=fopen(config_file,"r");
   if (!f) return -1;
 
-  for(int i=0;i<user_count;i++) if (users[i]) free(users[i]);
-  user_count=0;
+  l->count=0;
   
   char line[1024];
   char user[1024];
 
   line[0]=0; fgets(line,1024,f);
   while (line[0]) {
-    if (sscanf(line,"user %s",user)==1) {
-      users[user_count]=strdup(user);
-      is_admin[user_count++]=0;
-    } else if (sscanf(line,"admin %s",user)==1) {
-      users[user_count]=strdup(user);
-      is_admin[user_count++]=1;
+    int admin=-1;
+    int tier=MIN_TIER;
+    if (sscanf(line,"user %1023s %d",user,&tier)>=1) admin=0;
+    else if (sscanf(line,"admin %1023s %d",user,&tier)>=1) admin=1;
+    if (admin!=-1&&(tier<MIN_TIER||tier>MAX_TIER)) {
+      LOG_ERROR("Invalid escalation tier %d for '%s' in config file, using %d",tier,user,MIN_TIER);
+      tier=MIN_TIER;
+    }
+    int duplicate=0;
+    if (admin!=-1)
+      for(int i=0;i<l->count;i++) if (!strcmp(l->numbers[i],user)) duplicate=1;
+    if (admin!=-1&&l->count>=MAX_USERS)
+      LOG_ERROR("Too many users in config file, ignoring '%s'",user);
+    else if (admin!=-1&&strlen(user)>=USER_NUMBER_SIZE)
+      LOG_ERROR("Ignoring invalid phone number '%s' in config file",user);
+    else if (duplicate)
+      LOG_ERROR("Ignoring duplicate entry for '%s' in config file",user);
+    else if (admin!=-1) {
+      memcpy(l->numbers[l->count],user,strlen(user)+1);
+      l->tier[l->count]=tier;
+      l->is_admin[l->count++]=admin;
     } else
       LOG_ERROR("Unrecognised line in config file: '%s'",line);
     line[0]=0; fgets(line,1024,f);
@@ -199,6 +324,72 @@ int load_user_list(void)
   return 0;
 }
 
+/*
+  (Re)load the user list.  The new list is compared with the one we have,
+  so that users who are still there keep their existing entries, and only
+  added users need memory allocating.  The new list is built to one side,
+  and copied over the live one in a single step, so nothing ever sees a
+  partly updated list, and if anything goes wrong part way, the old list
+  stays as it was.
+*/
+int load_user_list(void)
+{
+  long long start=monotonic_us();
+  struct user_list *l=&user_list_staging;
+  if (read_user_list(l)) return -1;
+
+  char *new_users[MAX_USERS];
+  int kept[MAX_USERS];
+  int added=0,removed=0,changed=0;
+  for(int i=0;i<user_count;i++) kept[i]=0;
+  for(int j=0;j<l->count;j++) {
+    int i;
+    for(i=0;i<user_count;i++)
+      if ((!kept[i])&&!strcmp(users[i],l->numbers[j])) break;
+    if (i<user_count) {
+      kept[i]=1;
+      new_users[j]=users[i];
+      if (is_admin[i]!=l->is_admin[j]||user_tier[i]!=l->tier[j]) changed++;
+    } else {
+      new_users[j]=pool_strdup(&user_pool,l->numbers[j]);
+      if (!new_users[j]) {
+	LOG_ERROR("Out of memory reloading '%s', keeping the old user list",config_file);
+	for(int k=0;k<j;k++) {
+	  int reused=0;
+	  for(i=0;i<user_count;i++) if (new_users[k]==users[i]) reused=1;
+	  if (!reused) pool_free(&user_pool,new_users[k]);
+	}
+	return -1;
+      }
+      added++;
+    }
+  }
+
+  for(int i=0;i<user_count;i++)
+    if (!kept[i]) {
+      pool_free(&user_pool,users[i]);
+      removed++;
+    }
+  memcpy(users,new_users,l->count*sizeof(char *));
+  memcpy(is_admin,l->is_admin,l->count*sizeof(int));
+  memcpy(user_tier,l->tier,l->count*sizeof(int));
+  user_count=l->count;
+
+  long long elapsed=monotonic_us()-start;
+  if (config_loaded) {
+    config_reloads++;
+    config_reload_us_last=elapsed;
+    if (elapsed>config_reload_us_max) config_reload_us_max=elapsed;
+    // Saving the list ourselves also triggers a reload, which changes nothing
+    if (added||removed||changed)
+      LOG_NOTE("Reloaded '%s' in %lldus: %d added, %d removed, %d changed, %d users.",
+	       config_file,elapsed,added,removed,changed,user_count);
+  }
+  config_loaded=1;
+  
+  return 0;
+}
+
 int is_admin_or_local(char *phone_number_or_null)
 {
   if (!phone_number_or_null) return 1;
@@ -219,7 +410,6 @@ int is_authorised(char *phone_number_or_null)
   return 0;
 }
 
-
 int add_user(char *phone_number,char *out)
 {
   if (phone_number[0]!='+') {
@@ -235,16 +425,18 @@ int add_user(char *phone_number,char *out)
     snprintf(out,1024,"Too many users. Delete one or more and try again.");
     return -1;
   }
-  users[user_count]=strdup(phone_number);
+  users[user_count]=pool_strdup(&user_pool,phone_number);
+  if (!users[user_count]) {
+    snprintf(out,1024,"%s is not a valid telephone number.",phone_number);
+    return -1;
+  }
+  user_tier[user_count]=MIN_TIER;
   is_admin[user_count++]=0;
   save_user_list();
   snprintf(out,1024,"Added %s to list of authorised users.",phone_number);
 
   // Send SMS to added user telling them that they have been added
-  char cmd[8192];
-  snprintf(cmd,8192,"LANG=C gammu sendsms TEXT %s -text \"You are now authorised to remotely control the alarm.  Reply HELP for more information.\"",phone_number);
-  printf("[%s]\n",cmd);
-  system(cmd);  
+  smsq_send(phone_number,"You are now authorised to remotely control the alarm.  Reply HELP for more information.",SMSQ_INFO);
   
   return 0;
 }
@@ -263,15 +455,17 @@ int add_admin(char *phone_number,char *out)
     snprintf(out,1024,"Too many users. Delete one or more and try again.");
     return -1;
   }
-  users[user_count]=strdup(phone_number);
+  users[user_count]=pool_strdup(&user_pool,phone_number);
+  if (!users[user_count]) {
+    snprintf(out,1024,"%s is not a valid telephone number.",phone_number);
+    return -1;
+  }
+  user_tier[user_count]=MIN_TIER;
   is_admin[user_count++]=1;
   save_user_list();
   snprintf(out,1024,"Added %s to list of administrators.",phone_number);
 
-  char cmd[8192];
-  snprintf(cmd,8192,"LANG=C gammu sendsms TEXT %s -text \"You are now authorised to remotely control and administer the alarm.  With great power comes great responsibility. Reply HELP for more information.\"",phone_number);
-  printf("[%s]\n",cmd);
-  system(cmd);  
+  smsq_send(phone_number,"You are now authorised to remotely control and administer the alarm.  With great power comes great responsibility. Reply HELP for more information.",SMSQ_INFO);
   
   return 0;
 }
@@ -282,7 +476,7 @@ int del_user(char *phone_number,char *out,char *phone_number_or_null)
     snprintf(out,1024,"%s was not authorised. Nothing to do.",phone_number);
     return -1;
   }
-  if (!strcmp(phone_number,phone_number_or_null)) {
+  if (phone_number_or_null&&!strcmp(phone_number,phone_number_or_null)) {
     snprintf(out,1024,"You can't remove yourself as admin user via SMS");
     return -1;
   }
@@ -300,11 +494,14 @@ int del_user(char *phone_number,char *out,char *phone_number_or_null)
   int index=-1;
   for(index=0;index<user_count;index++)
     if (!strcmp(phone_number,users[index])) break;
-  free(users[index]); users[index]=NULL;
+  pool_free(&user_pool,users[index]); users[index]=NULL;
   for(int i=index;i<(user_count-1);i++) {
     users[i]=users[i+1];
     is_admin[i]=is_admin[i+1];
+    user_tier[i]=user_tier[i+1];
   }
+  user_count--;
+  save_user_list();
   snprintf(out,1024,"Removed %s",phone_number);
   return 0;
 }
@@ -347,14 +544,22 @@ void generate_status_message(char *out,int *out_len,int max_len)
     snprintf(&out[*out_len],max_len-*out_len,"Zone FAULT in zone #%d\n",faultZone);
     *out_len=strlen(out);	
   } else {
-    snprintf(&out[*out_len],max_len-*out_len,"The following zones have faults: ");
+    snprintf(&out[*out_len],max_len-*out_len,"The following zones have faults:");
     *out_len=strlen(out);
+    // List runs of consecutive zones as ranges, e.g., #3-7, to keep the
+    // message short.
     for(int i=0;i<MAX_ZONES;i++)
       {
 	if (zoneStates[i]==ZS_FAULT) {
+	  int last=i;
+	  while(last+1<MAX_ZONES&&zoneStates[last+1]==ZS_FAULT) last++;
 	  // XXX - Allow providing names for zones
-	  snprintf(&out[*out_len],max_len-*out_len," #%d",i);
+	  if (last>i)
+	    snprintf(&out[*out_len],max_len-*out_len," #%d-%d",i,last);
+	  else
+	    snprintf(&out[*out_len],max_len-*out_len," #%d",i);
 	  *out_len=strlen(out);
+	  i=last;
 	}
 	
       }
@@ -363,117 +568,567 @@ void generate_status_message(char *out,int *out_len,int max_len)
   }      
 }
 
-int parse_textcommand(int fd,char *line,char *out, char *phone_number_or_local)
+// Read a figure (in kB) such as VmRSS from /proc/self/status
+long proc_status_kb(const char *field)
 {
-  int retVal=-1;
-  LOG_ENTRY;
-
-  do {
-
-    int out_len=0;
-    
-    if (!strcasecmp(line,"help")) {
-      snprintf(out,8192,"Valid commands:\n"
-	       "    arm - arm alarm\n"
-	       " disarm - disarm alarm\n"
-	       " status - report alarm status\n"
-	       " say <your message> - send a short message to all.\n"
-	       " help2 - more help.\n"
-	       );
-      retVal=0;
-      break;
-    }
-    if (!strcasecmp(line,"help2")) {
-      snprintf(out,8192,"Valid commands:\n"
-	       " add <number> - add number to list of users.\n"
-	       " admin <number> - add number to list of admins, who can add and delete others\n"
-	       " help3 - more help.\n"
-	       );
-      retVal=0;
-      break;
-    }
-    if (!strcasecmp(line,"help3")) {
-      snprintf(out,8192,"Valid commands:\n"
-	       " del <phone number> - delete user from authorised user list.\n"
-	       " list - list authorised numbers.\n"
-	       );
-      retVal=0;
-      break;
-    }
-    if (is_admin_or_local(phone_number_or_local)&&(!strncasecmp(line,"add ",4))) {
-      add_user(&line[4],out);
-      retVal=0;
-      break;
-    }    
-    if (is_admin_or_local(phone_number_or_local)&&(!strncasecmp(line,"admin ",6))) {
-      add_admin(&line[6],out);
-      retVal=0;
-      break;
-    }
-    if (is_admin_or_local(phone_number_or_local)&&(!strncasecmp(line,"del ",4))) {
-      del_user(&line[4],out,phone_number_or_local);
-      retVal=0;
+  FILE *f=fopen("/proc/self/status","r");
+  if (!f) return -1;
+  long kb=-1;
+  char line[256];
+  int field_len=strlen(field);
+  while(fgets(line,sizeof(line),f))
+    if ((!strncmp(line,field,field_len))&&line[field_len]==':') {
+      kb=atol(&line[field_len+1]);
       break;
     }
-    if (is_admin_or_local(phone_number_or_local)&&(!strncasecmp(line,"say ",4))) {
-      snprintf(out,8192,"%s says: %s",phone_number_or_local,&line[4]);
+  fclose(f);
+  return kb;
+}
 
-      // Double quotes cause trouble, so convert them to single quotes
-      for(int i=0;out[i];i++) if (out[i]=='\"') out[i]='\'';
+/*
+  Alarm notifications are escalated in stages, rather than sent to everyone
+  at once, as one keyholder responding is enough.  Tier 1 is texted straight
+  away, and each later tier only if nobody has replied "ack" within
+  escalate_interval seconds of the previous tier being texted.
+  escalate_interval=0 sends to all tiers at once.
+*/
+int escalate_interval=120;
+int incident_active=0;
+int incident_tier=0;         // highest tier texted so far
+time_t incident_escalate_time=0;
+char incident_message[REPLY_SIZE];
+int incident_users=0;        // users texted about this incident so far
+int incident_segments=0;     // SMS segments that cost
+
+unsigned long long incidents=0;
+unsigned long long incident_acks=0;
+unsigned long long incident_sms_saved=0;
+
+// The next tier above the given one that has anyone in it, or 0 if none.
+int next_tier(int tier)
+{
+  int next=0;
+  for(int i=0;i<user_count;i++)
+    if (user_tier[i]>tier&&((!next)||user_tier[i]<next)) next=user_tier[i];
+  return next;
+}
 
-      for(int i=0;i<user_count;i++) {
-	// Send SMS to added user telling them that they have been added
-	char cmd[10000];
-	snprintf(cmd,10000,"LANG=C gammu sendsms TEXT %s -text \"%s\"",users[i],out);
-	printf("[%s]\n",cmd);
-	system(cmd);  
-	
-      }
+// Text the current incident to everyone in tiers first to last, and (with
+// NOTIFY_CHANNELS) pass it on to the other channels.
+void notify_tiers(int first,int last,int channels)
+{
+  char *numbers[MAX_USERS];
+  int users_sent=0;
+  for(int i=0;i<user_count;i++)
+    if (user_tier[i]>=first&&user_tier[i]<=last) numbers[users_sent++]=users[i];
+  int segments=notify(incident_message,SMSQ_ALARM,numbers,users_sent,channels,NULL);
+  incident_users+=users_sent;
+  incident_segments+=segments;
+  LOG_NOTE("Alarm notification sent to %d users in tier(s) %d-%d using %d SMS segments",
+	   users_sent,first,last,segments);
+}
 
-      snprintf(out,8192,"Your message has been sent to all %d users.\n",user_count);
-      
-      retVal=0;
-      break;
-    }
-    if (is_admin_or_local(phone_number_or_local)&&(!strcasecmp(line,"list"))) {
-      out[0]=0;
-      snprintf(out,8192,"Administrators: ");
-      for(int i=0;i<user_count;i++)
-	if (is_admin[i]) snprintf(&out[strlen(out)],8192-strlen(out)," %s",users[i]);
-      snprintf(&out[strlen(out)],8192-strlen(out),".\n\nUsers: ");      
-      for(int i=0;i<user_count;i++)
-	if (!is_admin[i]) snprintf(&out[strlen(out)],8192-strlen(out)," %s",users[i]);
-      snprintf(&out[strlen(out)],8192-strlen(out),".\n");      
-      retVal=0;
-      break;
+void build_incident_message(void)
+{
+  int out_len=0;
+  char *out=incident_message;
+  sprintf(out,"UNEXPECTED ALARM ACTIVITY: ");
+  out_len=strlen(out);
+  generate_status_message(out,&out_len,REPLY_SIZE);
+
+  // Only include the full explanation if it doesn't cost an extra segment
+  int base_segments=gsm7_segments(out);
+  int base_len=out_len;
+  snprintf(&out[out_len],REPLY_SIZE-out_len,"Reply ack if you are dealing with this, so others aren't alerted. Reply with help for a reminder of commands.");
+  if (gsm7_segments(out)>base_segments) {
+    out[base_len]=0;
+    snprintf(&out[base_len],REPLY_SIZE-base_len,"Reply ack to stop escalation.");
+    if (gsm7_segments(out)>base_segments) out[base_len]=0;
+  }
+}
+
+void alarm_incident(void)
+{
+  build_incident_message();
+  alarm_broadcasts++;
+
+  // The other channels aren't tiered, so hear about everything straight
+  // away, whatever tier the SMS have got to.
+  if (incident_active) {
+    // Still unacknowledged: keep those already involved up to date, but
+    // don't escalate any sooner than we would have anyway.
+    notify_tiers(MIN_TIER,incident_tier,NOTIFY_CHANNELS);
+    return;
+  }
+
+  incidents++;
+  incident_active=1;
+  incident_users=0;
+  incident_segments=0;
+  incident_tier=escalate_interval?next_tier(0):MAX_TIER;
+  if (!incident_tier) {
+    LOG_WARN("No users to notify of alarm activity");
+    notify(incident_message,SMSQ_ALARM,NULL,0,NOTIFY_CHANNELS,NULL);
+    return;
+  }
+  notify_tiers(MIN_TIER,incident_tier,NOTIFY_CHANNELS);
+  incident_escalate_time=clock_now()+escalate_interval;
+}
+
+// Called from the main loop, to move on to the next tier when it is time.
+void alarm_escalate(void)
+{
+  if (!incident_active||clock_now()<incident_escalate_time) return;
+  int tier=next_tier(incident_tier);
+  // Everyone has been told, so there is nothing more to do until an ack
+  if (!tier) return;
+  LOG_NOTE("Alarm not acknowledged after %d seconds, escalating to tier %d",
+	   escalate_interval,tier);
+  incident_tier=tier;
+  notify_tiers(tier,tier,NOTIFY_SMS_ONLY);
+  incident_escalate_time=clock_now()+escalate_interval;
+}
+
+unsigned long long routed_events=0;
+
+/*
+  Tell whoever the routing rules say about an event.  Returns -1 if no rule
+  matched, 1 if a matching rule says everyone should be told (as an alarm
+  incident, through the escalation tiers), or 0 if the rules dealt with it.
+*/
+int route_event(int event,int key,const char *what)
+{
+  unsigned int groups;
+  int all;
+  time_t when=line_panel_time?line_panel_time:clock_now();
+  if (!rules_match(event,key,armedP,siren,when,&groups,&all)) return -1;
+  routed_events++;
+  if (!groups) return all;
+
+  char out[REPLY_SIZE];
+  snprintf(out,REPLY_SIZE,"ALARM: %s. Alarm is %s.",what,
+	   armedP==1?"armed":(armedP==0?"NOT armed":"in an unknown state"));
+  // Anyone in more than one group only gets one copy, as the queue drops
+  // identical messages
+  char *numbers[MAX_GROUPS*MAX_GROUP_MEMBERS];
+  int count=0;
+  for(int g=0;g<rules->group_count;g++) {
+    if (!(groups&(1U<<g))) continue;
+    struct rule_group *group=&rules->groups[g];
+    for(int i=0;i<group->member_count;i++) numbers[count++]=group->members[i];
+  }
+  int users_sent;
+  int segments=notify(out,SMSQ_ALARM,numbers,count,NOTIFY_CHANNELS,&users_sent);
+  LOG_NOTE("%s %s: routed to %d users using %d SMS segments",
+	   rules_event_name(event),what,users_sent,segments);
+  return all;
+}
+
+// Route a zone or partition change, or keep it for later if it was found
+// while replaying.
+void notify_event(int event,int key,const char *what)
+{
+  if (replaying) {
+    if (missed_event_count>=MISSED_EVENTS_MAX) {
+      missed_events_dropped++;
+      return;
     }
+    struct missed_event *m=&missed_events[missed_event_count++];
+    m->event=event;
+    m->key=key;
+    m->when=line_panel_time;
+    snprintf(m->what,sizeof(m->what),"%s",what);
+    return;
+  }
+  if (route_event(event,key,what)==1) alarm_incident();
+}
 
-    if (is_authorised(phone_number_or_local)&&(!strcasecmp(line,"disarm"))) {
-      char cmd[4000];
-      snprintf(cmd,4000,DISARM_COMMAND,nx584_client,master_pin);
-      LOG_NOTE("Executing '%s'",cmd);
-      int r=system(cmd);
-      if (!r) snprintf(out,8192,"Commanded alarm to DISARM.");
-      else snprintf(out,8192,"Error #%d requesting alarm to disarm",r);
-      retVal=0;
-      break;
+int missed_event_compare(const void *a,const void *b)
+{
+  const struct missed_event *x=a,*y=b;
+  return (x->when>y->when)-(x->when<y->when);
+}
+
+// Route the changes that were logged while we weren't running, oldest first
+// (they may have come from several logs), at the times they were logged.
+void route_missed_events(void)
+{
+  if (!missed_event_count) return;
+  LOG_NOTE("Routing %d zone and partition changes logged while not running",missed_event_count);
+  if (missed_events_dropped)
+    LOG_WARN("%d more changes logged while not running were not routed",missed_events_dropped);
+  qsort(missed_events,missed_event_count,sizeof(missed_events[0]),missed_event_compare);
+  for(int i=0;i<missed_event_count;i++) {
+    struct missed_event *m=&missed_events[i];
+    line_panel_time=m->when;
+    if (route_event(m->event,m->key,m->what)==1) alarm_incident();
+  }
+  line_panel_time=0;
+  missed_event_count=0;
+  missed_events_dropped=0;
+}
+
+int cmd_ack(char *arg,char *out,char *phone_number_or_local)
+{
+  if (!incident_active) {
+    snprintf(out,REPLY_SIZE,"There is no unacknowledged alarm activity.");
+    return 0;
+  }
+  // Work out what the tiers we no longer need to text would have cost
+  int saved_users=0;
+  for(int i=0;i<user_count;i++) if (user_tier[i]>incident_tier) saved_users++;
+  int saved=saved_users*gsm7_segments(incident_message);
+
+  incident_active=0;
+  incident_acks++;
+  incident_sms_saved+=saved;
+  LOG_NOTE("Alarm acknowledged by %s after texting %d users (%d segments), saving %d segments",
+	   phone_number_or_local?phone_number_or_local:"local user",
+	   incident_users,incident_segments,saved);
+  snprintf(out,REPLY_SIZE,"Thank you. Alarm acknowledged, %d other user(s) will not be alerted.",
+	   saved_users);
+  char note[128];
+  snprintf(note,sizeof(note),"Alarm acknowledged by %s.",
+	   phone_number_or_local?phone_number_or_local:"local user");
+  notify(note,SMSQ_INFO,NULL,0,NOTIFY_CHANNELS,NULL);
+  return 0;
+}
+
+int cmd_arm(char *arg,char *out,char *phone_number_or_local)
+{
+  char cmd[4000];
+  snprintf(cmd,4000,ARM_COMMAND,nx584_client,master_pin);
+  LOG_NOTE("Executing '%s'",cmd);
+  int r=run_command(cmd);
+  if (!r) snprintf(out,REPLY_SIZE,"Commanded alarm to ARM.");
+  else snprintf(out,REPLY_SIZE,"Error #%d requesting alarm to arm",r);
+  return 0;
+}
+
+int cmd_disarm(char *arg,char *out,char *phone_number_or_local)
+{
+  char cmd[4000];
+  snprintf(cmd,4000,DISARM_COMMAND,nx584_client,master_pin);
+  LOG_NOTE("Executing '%s'",cmd);
+  int r=run_command(cmd);
+  if (!r) snprintf(out,REPLY_SIZE,"Commanded alarm to DISARM.");
+  else snprintf(out,REPLY_SIZE,"Error #%d requesting alarm to disarm",r);
+  return 0;
+}
+
+int cmd_status(char *arg,char *out,char *phone_number_or_local)
+{
+  int out_len=0;
+  out[0]=0;
+  generate_status_message(out,&out_len,REPLY_SIZE);
+  return 0;
+}
+
+int cmd_say(char *arg,char *out,char *phone_number_or_local)
+{
+  snprintf(out,REPLY_SIZE,"%s says: %s",phone_number_or_local,arg);
+
+  int segments=0;
+  for(int i=0;i<user_count;i++) {
+    int r=smsq_send(users[i],out,SMSQ_INFO);
+    if (r>0) segments+=r;
+  }
+  LOG_NOTE("Message forwarded to %d users using %d SMS segments",user_count,segments);
+
+  snprintf(out,REPLY_SIZE,"Your message has been sent to all %d users.\n",user_count);
+  return 0;
+}
+
+int cmd_add(char *arg,char *out,char *phone_number_or_local)
+{
+  add_user(arg,out);
+  return 0;
+}
+
+int cmd_admin(char *arg,char *out,char *phone_number_or_local)
+{
+  add_admin(arg,out);
+  return 0;
+}
+
+int cmd_del(char *arg,char *out,char *phone_number_or_local)
+{
+  del_user(arg,out,phone_number_or_local);
+  return 0;
+}
+
+// Anyone not in the first escalation tier is listed with their tier, e.g., +614...(2)
+void list_user(char *out,int i)
+{
+  snprintf(&out[strlen(out)],REPLY_SIZE-strlen(out)," %s",users[i]);
+  if (user_tier[i]!=MIN_TIER)
+    snprintf(&out[strlen(out)],REPLY_SIZE-strlen(out),"(%d)",user_tier[i]);
+}
+
+int cmd_list(char *arg,char *out,char *phone_number_or_local)
+{
+  out[0]=0;
+  snprintf(out,REPLY_SIZE,"Administrators: ");
+  for(int i=0;i<user_count;i++)
+    if (is_admin[i]) list_user(out,i);
+  snprintf(&out[strlen(out)],REPLY_SIZE-strlen(out),".\n\nUsers: ");      
+  for(int i=0;i<user_count;i++)
+    if (!is_admin[i]) list_user(out,i);
+  snprintf(&out[strlen(out)],REPLY_SIZE-strlen(out),".\n");      
+  return 0;
+}
+
+int cmd_tier(char *arg,char *out,char *phone_number_or_local)
+{
+  char number[64];
+  int tier;
+  if (sscanf(arg,"%63s %d",number,&tier)!=2||tier<MIN_TIER||tier>MAX_TIER) {
+    snprintf(out,REPLY_SIZE,"Usage: tier <phone number> <%d-%d>",MIN_TIER,MAX_TIER);
+    return 0;
+  }
+  for(int i=0;i<user_count;i++)
+    if (!strcmp(users[i],number)) {
+      user_tier[i]=tier;
+      save_user_list();
+      snprintf(out,REPLY_SIZE,"%s will be alerted at escalation tier %d.",number,tier);
+      return 0;
     }
-    if (is_authorised(phone_number_or_local)&&(!strcasecmp(line,"arm"))) {
-      char cmd[4000];
-      snprintf(cmd,4000,ARM_COMMAND,nx584_client,master_pin);
-      LOG_NOTE("Executing '%s'",cmd);
-      int r=system(cmd);
-      if (!r) snprintf(out,8192,"Commanded alarm to ARM.");
-      else snprintf(out,8192,"Error #%d requesting alarm to arm",r);
-      retVal=0;
-      break;
+  snprintf(out,REPLY_SIZE,"%s is not an authorised user.",number);
+  return 0;
+}
+
+int cmd_queue(char *arg,char *out,char *phone_number_or_local)
+{
+  smsq_report(out,REPLY_SIZE);
+  int len=strlen(out);
+  transport_report(&out[len],REPLY_SIZE-len);
+  return 0;
+}
+
+int cmd_stats(char *arg,char *out,char *phone_number_or_local)
+{
+  unsigned long long events=lines_by_type[IT_NX584SERVERLOG];
+  snprintf(out,REPLY_SIZE,
+	   "Up %lld seconds.\n"
+	   "Lines: %llu log, %llu command, %llu unrecognised.\n"
+	   "SMS: %llu polls, %llu received, %llu alarm broadcasts, %llu throttled, %llu coalesced.\n"
+	   "Alarms: %llu incidents, %llu acknowledged, %llu SMS segments saved, %llu events routed by %d rules.\n"
+	   "Config: %llu reloads, %lldus last, %lldus max.\n"
+	   "Lag: %lldms last, %lldms avg, %lldms max behind the panel, %llu lines reordered.\n"
+	   "Processes: %llu run (%.2f per log line), %lldms avg, %lldms max.\n",
+	   (long long)(clock_now()-start_time),
+	   events,lines_by_type[IT_TEXTCOMMANDS],lines_by_type[IT_UNKNOWN],
+	   sms_polls,sms_received,alarm_broadcasts,inbound_throttled,inbound_coalesced,
+	   incidents,incident_acks,incident_sms_saved,routed_events,rules?rules->rule_count:0,
+	   config_reloads,config_reload_us_last,config_reload_us_max,
+	   merge_lag_last_ms,merge_lag_count?merge_lag_total_ms/(long long)merge_lag_count:0,
+	   merge_lag_max_ms,merge_reordered,
+	   command_spawns,events?(double)command_spawns/events:0.0,
+	   command_spawns?command_total_ms/(long long)command_spawns:0,command_max_ms);
+  int out_len=strlen(out);
+  long buffer_bytes=0;
+  for(int i=0;i<input_count;i++) buffer_bytes+=buffer_sizes[i];
+  // VmStk never shrinks, so is the most stack we have ever needed
+  snprintf(&out[out_len],REPLY_SIZE-out_len,
+	   "Memory: %ldKB resident (%ldKB peak), %ldKB stack, %ldKB line buffers, %ldKB SMS queue, %ldKB users.\n",
+	   proc_status_kb("VmRSS"),proc_status_kb("VmHWM"),proc_status_kb("VmStk"),
+	   buffer_bytes/1024,smsq_memory()/1024,pool_bytes(&user_pool)/1024);
+  out_len=strlen(out);
+  smsq_report(&out[out_len],REPLY_SIZE-out_len);
+  return 0;
+}
+
+int cmd_stalls(char *arg,char *out,char *phone_number_or_local)
+{
+  watchdog_report(out,REPLY_SIZE);
+  return 0;
+}
+
+// Move a simulated clock on, e.g., advance 90, advance 15m, advance 2h
+int cmd_advance(char *arg,char *out,char *phone_number_or_local)
+{
+  long long amount;
+  char unit='s';
+  int f=sscanf(arg,"%lld%c",&amount,&unit);
+  long long ms=amount*1000;
+  if (unit=='m') ms*=60;
+  else if (unit=='h') ms*=3600;
+  else if (unit=='d') ms*=86400;
+  else if (unit!='s') f=0;
+  if (f<1||clock_advance(ms)) {
+    snprintf(out,REPLY_SIZE,"Usage: advance <n>[s|m|h|d], with clock=sim");
+    return 0;
+  }
+  time_t now=clock_now();
+  snprintf(out,REPLY_SIZE,"Simulated time is now %s",ctime(&now));
+  out[strcspn(out,"\n")]=0;
+  return 0;
+}
+
+int cmd_help(char *arg,char *out,char *phone_number_or_local);
+
+/*
+  The commands we understand.  To add a command, write its handler, and add
+  it here: the lookup index and help pages are built from this table.
+*/
+#define ROLE_NONE 0
+#define ROLE_USER 1
+#define ROLE_ADMIN 2
+#define ROLE_LOCAL 3
+
+#define ARG_NONE 0
+#define ARG_TEXT 1   // the rest of the line, which must not be empty
+
+struct command {
+  const char *name;
+  int argument;
+  int role;        // least privileged role that may use the command
+  int shared;      // the reply only depends on the role of who asked, so
+                   // identical requests arriving together can share one
+  int (*handler)(char *arg,char *out,char *phone_number_or_local);
+  const char *help;
+};
+
+struct command commands[]={
+  {"arm",ARG_NONE,ROLE_USER,1,cmd_arm,"arm - arm alarm"},
+  {"disarm",ARG_NONE,ROLE_USER,1,cmd_disarm,"disarm - disarm alarm"},
+  {"status",ARG_NONE,ROLE_USER,1,cmd_status,"status - report alarm status"},
+  {"ack",ARG_NONE,ROLE_USER,0,cmd_ack,"ack - you are dealing with an alarm, don't alert others"},
+  {"say",ARG_TEXT,ROLE_ADMIN,0,cmd_say,"say <your message> - send a short message to all."},
+  {"add",ARG_TEXT,ROLE_ADMIN,0,cmd_add,"add <number> - add number to list of users."},
+  {"admin",ARG_TEXT,ROLE_ADMIN,0,cmd_admin,"admin <number> - add number to list of admins, who can add and delete others"},
+  {"del",ARG_TEXT,ROLE_ADMIN,0,cmd_del,"del <phone number> - delete user from authorised user list."},
+  {"list",ARG_NONE,ROLE_ADMIN,1,cmd_list,"list - list authorised numbers."},
+  {"tier",ARG_TEXT,ROLE_ADMIN,0,cmd_tier,"tier <number> <1-9> - set when a user is alerted."},
+  {"queue",ARG_NONE,ROLE_ADMIN,1,cmd_queue,"queue - show outgoing SMS queue."},
+  {"stats",ARG_NONE,ROLE_ADMIN,1,cmd_stats,"stats - show activity counters."},
+  {"stalls",ARG_NONE,ROLE_ADMIN,1,cmd_stalls,"stalls - show what has held up alarm monitoring."},
+  {"advance",ARG_TEXT,ROLE_LOCAL,0,cmd_advance,"advance <time> - move a simulated clock on."},
+  {"help",ARG_NONE,ROLE_NONE,1,cmd_help,NULL},
+  {NULL,0,0,0,NULL,NULL}
+};
+
+// Case-insensitive hash index over the command names, so that finding a
+// command costs the same however many there are.
+#define COMMAND_INDEX_SIZE 64
+#define COMMAND_NAME_MAX 16
+struct command *command_index[COMMAND_INDEX_SIZE];
+int command_index_built=0;
+
+unsigned int command_hash(const char *name,int len)
+{
+  unsigned int h=2166136261u;
+  for(int i=0;i<len;i++) h=(h^(unsigned char)tolower(name[i]))*16777619u;
+  return h%COMMAND_INDEX_SIZE;
+}
+
+void command_index_build(void)
+{
+  for(int i=0;commands[i].name;i++) {
+    unsigned int h=command_hash(commands[i].name,strlen(commands[i].name));
+    while(command_index[h]) h=(h+1)%COMMAND_INDEX_SIZE;
+    command_index[h]=&commands[i];
+  }
+  command_index_built=1;
+}
+
+struct command *command_lookup(const char *name,int len)
+{
+  if (!command_index_built) command_index_build();
+  if (len<1||len>=COMMAND_NAME_MAX) return NULL;
+  unsigned int h=command_hash(name,len);
+  while(command_index[h]) {
+    if ((!strncasecmp(command_index[h]->name,name,len))&&!command_index[h]->name[len])
+      return command_index[h];
+    h=(h+1)%COMMAND_INDEX_SIZE;
+  }
+  return NULL;
+}
+
+// Work out who we are talking to, with a single scan of the user list.
+int user_role(char *phone_number_or_null)
+{
+  if (!phone_number_or_null) return ROLE_LOCAL;
+  for(int i=0;i<user_count;i++)
+    if (!strcmp(users[i],phone_number_or_null))
+      return is_admin[i]?ROLE_ADMIN:ROLE_USER;
+  return ROLE_NONE;
+}
+
+/*
+  Help is split into pages that each fit in a single SMS, listing only the
+  commands the person asking is allowed to use.  help shows the first page,
+  help2 the second, and so on.
+*/
+int help_page(int role,int page,char *out)
+{
+  const char *header="Valid commands:\n";
+  int len=snprintf(out,REPLY_SIZE,"%s",header);
+  int current=1;
+  for(int i=0;commands[i].name;i++) {
+    if (!commands[i].help||commands[i].role>role) continue;
+    char next_page[32];
+    snprintf(next_page,sizeof(next_page)," help%d - more help.\n",current+1);
+    int entry_len=strlen(commands[i].help)+2;
+    if (len>(int)strlen(header)
+	&&len+entry_len+(int)strlen(next_page)>GSM7_SINGLE_SEGMENT) {
+      if (current==page) {
+	snprintf(&out[len],REPLY_SIZE-len,"%s",next_page);
+	return 0;
+      }
+      current++;
+      len=snprintf(out,REPLY_SIZE,"%s",header);
     }
-    if (is_authorised(phone_number_or_local)&&(!strcasecmp(line,"status"))) {
-      generate_status_message(out,&out_len,8192);
-      
-      retVal=0;
-      break;
+    len+=snprintf(&out[len],REPLY_SIZE-len," %s\n",commands[i].help);
+  }
+  if (current!=page) return -1;
+  return 0;
+}
+
+int cmd_help(char *arg,char *out,char *phone_number_or_local)
+{
+  int page=1;
+  if (arg) page=atoi(arg);
+  if (help_page(user_role(phone_number_or_local),page,out))
+    snprintf(out,REPLY_SIZE,"There is no help page %d.",page);
+  return 0;
+}
+
+// Find the command a line asks for, if it is one the given role may use.
+// Sets *arg to its argument, or NULL if it has none.
+struct command *find_textcommand(char *line,char **arg,int role)
+{
+  int name_len=0;
+  while(line[name_len]&&line[name_len]!=' ') name_len++;
+  *arg=line[name_len]?&line[name_len+1]:NULL;
+
+  struct command *c=command_lookup(line,name_len);
+  if ((!c)&&name_len>4&&(!strncasecmp(line,"help",4))) {
+    // help2, help3 etc. are pages of the help command
+    int i=4;
+    while(i<name_len&&isdigit((unsigned char)line[i])) i++;
+    if (i==name_len&&!*arg) {
+      c=command_lookup("help",4);
+      *arg=&line[4];
     }
+  } else if (c&&c->argument==ARG_NONE&&*arg) c=NULL;
+  if (!c) return NULL;
+  if (c->argument==ARG_TEXT&&((!*arg)||(!(*arg)[0]))) return NULL;
+  if (role<c->role) return NULL;
+  return c;
+}
+
+int parse_textcommand(int fd,char *line,char *out, char *phone_number_or_local)
+{
+  int retVal=-1;
+  LOG_ENTRY;
+
+  do {
+    char *arg;
+    struct command *c=find_textcommand(line,&arg,user_role(phone_number_or_local));
+    if (!c) break;
+
+    retVal=c->handler(arg,out,phone_number_or_local);
   } while (0);
 
   LOG_EXIT;
@@ -486,26 +1141,30 @@ int parse_line(char *origin,int fd,char *line)
   LOG_ENTRY;
 
   int year,month,day,hour,min,sec,msec,zoneNum;
-  char zone_state[8192];
+  char zone_state[64];
+  char zone_name[64]="";
 
-  char out[8192];
+  char out[REPLY_SIZE];
     
   do {
 
     // Allow either , or . as decimal character, and also standard python format
-    int f=sscanf(line,"%d-%d-%d %d:%d:%d,%d controller INFO Zone %d (%*[^)]) state is %s",
-		 &year,&month,&day,&hour,&min,&sec,&msec,&zoneNum,zone_state);
-    if (f<9)
-      f=sscanf(line,"%d-%d-%d %d:%d:%d.%d controller INFO Zone %d (%*[^)]) state is %s",
-	       &year,&month,&day,&hour,&min,&sec,&msec,&zoneNum,zone_state);
-    if (f<9) {
-      f=sscanf(line,"INFO:controller:Zone %d (%*[^)]) state is %s",
-	       &zoneNum,zone_state);
-      if (f==2) f=9;
+    int f=sscanf(line,"%d-%d-%d %d:%d:%d,%d controller INFO Zone %d (%63[^)]) state is %63s",
+		 &year,&month,&day,&hour,&min,&sec,&msec,&zoneNum,zone_name,zone_state);
+    if (f<10)
+      f=sscanf(line,"%d-%d-%d %d:%d:%d.%d controller INFO Zone %d (%63[^)]) state is %63s",
+	       &year,&month,&day,&hour,&min,&sec,&msec,&zoneNum,zone_name,zone_state);
+    if (f<10) {
+      f=sscanf(line,"INFO:controller:Zone %d (%63[^)]) state is %63s",
+	       &zoneNum,zone_name,zone_state);
+      if (f==3) f=10;
     }      
-    if (f==9) {
-      LOG_NOTE("Saw controller state message: Zone %d is now '%s'",zoneNum,zone_state);
+    if (f==10) {
+      if (!replaying)
+	LOG_NOTE("Saw controller state message: Zone %d is now '%s'",zoneNum,zone_state);
       if (zoneNum>=0&&zoneNum<MAX_ZONES) {
+	int previous=zoneStates[zoneNum];
+	checkpoint_dirty=1;
 	if (!strcmp("FAULT",zone_state)) {
 	  zoneStates[zoneNum]=ZS_FAULT;
 	} else if (!strcmp("NORMAL",zone_state)) {
@@ -514,32 +1173,57 @@ int parse_line(char *origin,int fd,char *line)
 	  LOG_NOTE("I don't recognise zone state '%s'",zone_state);
 	  zoneStates[zoneNum]=ZS_UNKNOWN;
 	}
+	// Faults matter even if we didn't know the zone's state before, but a
+	// zone being normal is only news if it was faulted.
+	if ((!replaying||replaying_missed)
+	    &&((zoneStates[zoneNum]==ZS_FAULT&&previous!=ZS_FAULT)
+	       ||(zoneStates[zoneNum]==ZS_NORMAL&&previous==ZS_FAULT))) {
+	  char what[160];
+	  snprintf(what,sizeof(what),"Zone %d (%s) %s",zoneNum,zone_name,zone_state);
+	  notify_event(zoneStates[zoneNum]==ZS_FAULT?RULE_ZONE_FAULT:RULE_ZONE_NORMAL,
+		       zoneNum,what);
+	}
       }
       retVal=IT_NX584SERVERLOG;
       break;
     }
 
     int partNum=0;
-    char part_state[1024];
+    char part_state[64];
     
-    f=sscanf(line,"%d-%d-%d %d:%d:%d.%d controller INFO Partition %d%*[ ]%[^\n\r]",
+    f=sscanf(line,"%d-%d-%d %d:%d:%d.%d controller INFO Partition %d%*[ ]%63[^\n\r]",
 	     &year,&month,&day,&hour,&min,&sec,&msec,&partNum,part_state);
-    if (f<9) f=sscanf(line,"%d-%d-%d %d:%d:%d,%d controller INFO Partition %d%*[ ]%[^\n\r]",
+    if (f<9) f=sscanf(line,"%d-%d-%d %d:%d:%d,%d controller INFO Partition %d%*[ ]%63[^\n\r]",
 		      &year,&month,&day,&hour,&min,&sec,&msec,&partNum,part_state);
     if (f<9) {
-      f=sscanf(line,"INFO:controller:Partition %d%*[ ]%[^\n\r]",
+      f=sscanf(line,"INFO:controller:Partition %d%*[ ]%63[^\n\r]",
 	       &partNum,part_state);
       if (f==2) f=9;
     }
     if (f==9) {
-      if (partNum==1&&(!strcmp(part_state,"armed"))) {
+      int part_armed=-1;
+      if (!strcmp(part_state,"armed")) part_armed=1;
+      else if (!strcmp(part_state,"not armed")) part_armed=0;
+      if (partNum==1&&part_armed==1) {
 	armedP=1;
-	LOG_NOTE("System is armed");
-      } else if (partNum==1&&(!strcmp(part_state,"not armed"))) {
+	checkpoint_dirty=1;
+	if (!replaying) LOG_NOTE("System is armed");
+      } else if (partNum==1&&part_armed==0) {
 	armedP=0; 
-	LOG_NOTE("System is not armed");
-      } else
+	checkpoint_dirty=1;
+	if (!replaying) LOG_NOTE("System is not armed");
+      } else if (part_armed==-1&&!replaying)
 	LOG_NOTE("Couldn't work out the partition state message");
+      if (part_armed!=-1&&partNum>=0&&partNum<RULE_KEYS) {
+	int previous=partition_armed[partNum];
+	partition_armed[partNum]=part_armed;
+	// nx584_server reports every partition when it starts, which isn't news
+	if (previous!=-1&&previous!=part_armed&&(!replaying||replaying_missed)) {
+	  char what[64];
+	  snprintf(what,sizeof(what),"Partition %d %s",partNum,part_armed?"ARMED":"DISARMED");
+	  notify_event(part_armed?RULE_ARM:RULE_DISARM,partNum,what);
+	}
+      }
       retVal=IT_NX584SERVERLOG;
       break;
     }
@@ -550,14 +1234,16 @@ int parse_line(char *origin,int fd,char *line)
 	if (!siren_on_time) significant_event++;
 	siren=0;
 	siren_on_time=0;
+	checkpoint_dirty=1;
 	retVal=IT_NX584SERVERLOG;
 	break;
       }
     if ((strstr(line,"controller INFO System asserts Global Siren on"))
 	||(strstr(line,"INFO:controller:System asserts Global Siren on")))
       {
-	siren_on_time=time(0);
+	siren_on_time=clock_now();
 	siren=1;
+	checkpoint_dirty=1;
 	retVal=IT_NX584SERVERLOG;
 	break;
       }
@@ -568,6 +1254,9 @@ int parse_line(char *origin,int fd,char *line)
       retVal=IT_NX584SERVERLOG;
       break;
     }
+
+    // Commands in old log lines were dealt with at the time
+    if (replaying) break;
     
     // Check if it is a recognised command typed directly in as input
     // (e.g., from stdin).  If so, treat this input as text command interface,
@@ -586,11 +1275,7 @@ int parse_line(char *origin,int fd,char *line)
 
       if (origin&&strcmp(origin,"-")) {
 	// Send reply back by SMS
-	char cmd[10000];
-	snprintf(cmd,10000,"LANG=C gammu sendsms TEXT %s -text \"%s\"",
-		 origin,out);
-	printf("[%s]\n",cmd);
-	system(cmd);
+	smsq_send(origin,out,SMSQ_REPLY);
       }
       
       retVal=IT_TEXTCOMMANDS;
@@ -607,7 +1292,665 @@ int parse_line(char *origin,int fd,char *line)
   return retVal;
 }
 
+void save_checkpoint(void)
+{
+  if (!checkpoint_file[0]) return;
+
+  struct checkpoint c;
+  c.armed=armedP;
+  c.siren=siren;
+  for(int i=0;i<MAX_ZONES&&i<CHECKPOINT_MAX_ZONES;i++) c.zones[i]=zoneStates[i];
+  c.log_count=0;
+  for(int i=0;i<input_count&&c.log_count<CHECKPOINT_MAX_LOGS;i++) {
+    struct stat st;
+    if (inputs[i]<0||fstat(inputs[i],&st)||!S_ISREG(st.st_mode)) continue;
+    struct checkpoint_log *l=&c.logs[c.log_count++];
+    snprintf(l->path,sizeof(l->path),"%s",input_files[i]);
+    l->dev=st.st_dev;
+    l->ino=st.st_ino;
+    // Anything sitting in the line buffer, or waiting its turn, hasn't been
+    // acted on yet
+    l->offset=lseek(inputs[i],0,SEEK_CUR)-buffer_lens[i]-merge_pending_bytes(i);
+  }
+
+  if (checkpoint_save(checkpoint_file,&c)) {
+    if (!checkpoint_failed)
+      LOG_WARN("Could not write checkpoint file '%s'.  State will have to be rebuilt from the logs after a restart.",
+	       checkpoint_file);
+    checkpoint_failed=1;
+  } else
+    checkpoint_failed=0;
+  checkpoint_dirty=0;
+  checkpoint_time=clock_now();
+}
+
+void replay_line(char *line)
+{
+  // Only state changes matter, so don't bother parsing anything else
+  if (strstr(line,"Zone ")||strstr(line,"Partition ")||strstr(line,"Global Siren")) {
+    // Rules with a time of day go by when the change was logged
+    long long panel_ms=replaying_missed?merge_timestamp(line):-1;
+    line_panel_time=panel_ms>=0?panel_ms/1000:0;
+    parse_line(NULL,-1,line);
+    line_panel_time=0;
+  }
+}
+
+/*
+  Work out the current alarm state before we start reading the logs live.
+  Start from the saved checkpoint, and replay whatever each log gained since
+  it was written.  If a log has no checkpoint, or has been rotated or
+  truncated since, rebuild what we can from the last replay_max bytes of it.
+*/
+void recover_state(void)
+{
+  LOG_ENTRY;
+
+  do {
+    long long start=monotonic_us();
+    struct checkpoint c;
+    int have_checkpoint=checkpoint_file[0]&&!checkpoint_load(checkpoint_file,&c);
+    if (have_checkpoint) {
+      armedP=c.armed;
+      siren=c.siren;
+      for(int i=0;i<MAX_ZONES&&i<CHECKPOINT_MAX_ZONES;i++)
+	if (c.zones[i]>=ZS_UNKNOWN&&c.zones[i]<=ZS_FAULT) zoneStates[i]=c.zones[i];
+      // So that the first change of arm state replayed counts as a change
+      if (armedP!=-1) partition_armed[1]=armedP;
+      LOG_NOTE("Loaded checkpoint from '%s'",checkpoint_file);
+    }
+
+    int guessed=0;
+    long long total_lines=0,total_bytes=0;
+    for(int i=0;i<input_count;i++) {
+      struct stat st;
+      if (inputs[i]<0||fstat(inputs[i],&st)||!S_ISREG(st.st_mode)) continue;
+
+      struct checkpoint_log *l=have_checkpoint?checkpoint_find_log(&c,input_files[i]):NULL;
+      long long from;
+      int tail=0;
+      if (l&&l->dev==st.st_dev&&l->ino==st.st_ino&&l->offset<=st.st_size) {
+	from=l->offset;
+      } else {
+	if (l) LOG_NOTE("'%s' has been rotated or truncated since the checkpoint",input_files[i]);
+	from=st.st_size>replay_max?st.st_size-replay_max:0;
+	tail=1;
+	guessed=1;
+      }
+
+      long long lines;
+      replaying=1;
+      replaying_missed=!tail;
+      long long end=checkpoint_replay(inputs[i],from,st.st_size,tail&&from>0,replay_line,&lines);
+      replaying=0;
+      replaying_missed=0;
+      if (end<0) end=st.st_size;
+      if (lseek(inputs[i],end,SEEK_SET)==-1) {
+	perror("lseek()");
+	LOG_ERROR("Failed to seek to offset %lld of '%s'",end,input_files[i]);
+      }
+      LOG_NOTE("Replayed %lld lines (%lld bytes) of '%s'%s",
+	       lines,end-from,input_files[i],tail?" from the end of the log":" since the checkpoint");
+      total_lines+=lines;
+      total_bytes+=end-from;
+    }
+
+    // Events we only know about from the tail of a log may well have been
+    // reported before the restart, so don't broadcast them again.  Events
+    // logged since the checkpoint, though, were missed, and still need to go.
+    if (guessed||!have_checkpoint) {
+      siren_on_time=0;
+      significant_event=0;
+    }
+    route_missed_events();
+
+    LOG_NOTE("Recovered state in %lldms, replaying %lld lines (%lld bytes).",
+	     (monotonic_us()-start)/1000,total_lines,total_bytes);
+    save_checkpoint();
+  } while(0);
+
+  LOG_EXIT;
+}
+
+void request_exit(int sig)
+{
+  exit_requested=1;
+}
+
+void request_restart(int sig)
+{
+  restart_requested=1;
+}
+
+/*
+  Everything the process taking over from us needs, other than what it
+  reads for itself from the config and rules files: the alarm state, the
+  inputs (whose file descriptors go alongside, in the same order as the
+  lines that describe them), partly-read lines, and the SMS still waiting
+  to go.
+*/
+void write_handoff_state(FILE *f,int *fds,int *fd_count)
+{
+  fprintf(f,"armed %d\nsiren %d\nsiren_on_time %lld\nsignificant_event %d\n",
+	  armedP,siren,(long long)siren_on_time,significant_event);
+  fprintf(f,"zones");
+  for(int i=0;i<MAX_ZONES;i++) fprintf(f," %d",zoneStates[i]);
+  fprintf(f,"\npartitions");
+  for(int i=0;i<RULE_KEYS;i++) fprintf(f," %d",partition_armed[i]);
+  fprintf(f,"\nincident %d %d %lld %d %d ",incident_active,incident_tier,
+	  (long long)incident_escalate_time,incident_users,incident_segments);
+  handoff_put_hex(f,incident_message,strlen(incident_message));
+  fprintf(f,"\n");
+
+  *fd_count=0;
+  for(int i=0;i<input_count&&*fd_count<HANDOFF_MAX_FDS-1;i++) {
+    if (inputs[i]<0) continue;
+    fds[(*fd_count)++]=inputs[i];
+    fprintf(f,"input %d %lld ",input_types[i],(long long)lseek(inputs[i],0,SEEK_CUR));
+    handoff_put_hex(f,buffers[i],buffer_lens[i]);
+    fprintf(f," %s\n",input_files[i]);
+  }
+  if (metrics_listen_fd!=-1) {
+    fds[(*fd_count)++]=metrics_listen_fd;
+    fprintf(f,"metrics_listen\n");
+  }
+
+  for(int i=0;i<modem_count();i++)
+    if (modems[i].device[0]) fprintf(f,"modem %s\n",modems[i].device);
+  smsq_save(f);
+  transport_save(f);
+}
+
+/*
+  Start a new copy of ourselves (usually after the binary has been
+  upgraded), and hand everything over to it.  Returns 0 if it has taken
+  over, and so we should exit, or -1 if we should carry on.
+*/
+int hand_over(void)
+{
+  int retVal=-1;
+  LOG_ENTRY;
+
+  do {
+    long long start=monotonic_us();
+    int sock;
+    pid_t pid=handoff_start(main_argv,&sock);
+    if (pid<0) break;
+
+    // Our nx584_server would die with us, so the new process will start its
+    // own.  It can still read whatever this one said last, though.
+    if (supervisor_input>=0&&inputs[supervisor_input]>=0) supervisor_stop();
+
+    char *state=NULL;
+    size_t state_len=0;
+    int fds[HANDOFF_MAX_FDS];
+    int fd_count=0;
+    FILE *f=open_memstream(&state,&state_len);
+    if (!f) {
+      LOG_ERROR("Could not allocate memory for the hand over");
+    } else {
+      write_handoff_state(f,fds,&fd_count);
+      fclose(f);
+    }
+    int r=f?handoff_send(sock,fds,fd_count,state,state_len):-1;
+    free(state);
+    if (!r) r=handoff_wait(sock,HANDOFF_TIMEOUT_MS);
+    close(sock);
+    if (r) {
+      LOG_ERROR("Hand over to pid %d failed, carrying on",(int)pid);
+      kill(pid,SIGKILL);
+      waitpid(pid,NULL,0);
+      if (supervisor_input>=0&&inputs[supervisor_input]>=0&&supervisor_enabled()) {
+	// supervisor_poll() will start the server again, with a new pipe
+	outq_close(inputs[supervisor_input]);
+	inputs[supervisor_input]=-1;
+      }
+      break;
+    }
+    LOG_NOTE("Handed over to pid %d in %lldms (%d inputs, %d bytes of state)",
+	     (int)pid,(monotonic_us()-start)/1000,fd_count,(int)state_len);
+    retVal=0;
+  } while(0);
+
+  LOG_EXIT;
+  return retVal;
+}
+
+// Take over from the process that started us, instead of opening the
+// inputs and working out the alarm state for ourselves.
+int take_over(void)
+{
+  int retVal=-1;
+  LOG_ENTRY;
+
+  do {
+    int fds[HANDOFF_MAX_FDS];
+    int fd_count=0;
+    char *state;
+    int state_len;
+    if (handoff_receive(handoff_fd,fds,HANDOFF_MAX_FDS,&fd_count,&state,&state_len)) break;
+
+    FILE *f=fmemopen(state,state_len,"r");
+    if (!f) {
+      LOG_ERROR("Could not read the state handed over to us");
+      free(state);
+      break;
+    }
+    int next_fd=0;
+    char *line=NULL;
+    size_t line_size=0;
+    retVal=0;
+    while(getline(&line,&line_size,f)>0) {
+      int len=strlen(line);
+      if (len&&line[len-1]=='\n') line[--len]=0;
+
+      long long t;
+      int n,fields[5];
+      if (sscanf(line,"armed %d",&armedP)==1) continue;
+      if (sscanf(line,"siren %d",&siren)==1) continue;
+      if (sscanf(line,"siren_on_time %lld",&t)==1) { siren_on_time=t; continue; }
+      if (sscanf(line,"significant_event %d",&significant_event)==1) continue;
+      if (!strncmp(line,"zones",5)||!strncmp(line,"partitions",10)) {
+	int *values=line[0]=='z'?zoneStates:partition_armed;
+	int count=line[0]=='z'?MAX_ZONES:RULE_KEYS;
+	char *p=strchr(line,' ');
+	for(int i=0;p&&i<count;i++) {
+	  values[i]=strtol(p,&p,10);
+	  if (*p!=' ') p=NULL;
+	}
+	continue;
+      }
+      if (sscanf(line,"incident %d %d %lld %d %d %n",&fields[0],&fields[1],&t,
+		 &fields[2],&fields[3],&n)==5) {
+	incident_active=fields[0];
+	incident_tier=fields[1];
+	incident_escalate_time=t;
+	incident_users=fields[2];
+	incident_segments=fields[3];
+	int l=handoff_get_hex(&line[n],incident_message,REPLY_SIZE-1);
+	incident_message[l]=0;
+	continue;
+      }
+      int type,hex_start,path_start;
+      if (sscanf(line,"input %d %lld %n%*s %n",&type,&t,&hex_start,&path_start)==2
+	  &&path_start>hex_start) {
+	if (next_fd>=fd_count||input_count>=MAX_INPUTS) {
+	  LOG_ERROR("More inputs were handed over than we can use");
+	  retVal=-1;
+	  break;
+	}
+	int i=input_count++;
+	inputs[i]=fds[next_fd++];
+	input_types[i]=type;
+	input_files[i]=strdup(&line[path_start]);
+	// The offset is shared with the previous process, so should already
+	// be right, but make sure.
+	if (t>=0&&lseek(inputs[i],0,SEEK_CUR)!=t) lseek(inputs[i],t,SEEK_SET);
+	int used=(path_start-hex_start-1)/2;
+	if (used>0) {
+	  int size=BUFFER_INITIAL_SIZE;
+	  while(size<=used&&size<BUFFER_SIZE) size*=2;
+	  buffers[i]=malloc(size);
+	  if (buffers[i]) {
+	    buffer_sizes[i]=size;
+	    buffer_lens[i]=handoff_get_hex(&line[hex_start],buffers[i],size-1);
+	  }
+	}
+	LOG_NOTE("Took over '%s'%s",input_files[i],buffer_lens[i]?", with a partial line":"");
+	continue;
+      }
+      if (!strcmp(line,"metrics_listen")&&next_fd<fd_count) {
+	metrics_listen_fd=fds[next_fd++];
+	continue;
+      }
+      if (!strncmp(line,"modem ",6)) {
+	if (modem_add(&line[6])<0) { retVal=-1; break; }
+	continue;
+      }
+      int transport;
+      if (sscanf(line,"notification %d %n",&transport,&n)==1) {
+	char text[TRANSPORT_MAX_TEXT];
+	int l=handoff_get_hex(&line[n],text,sizeof(text)-1);
+	text[l]=0;
+	transport_queue(transport,text);
+	continue;
+      }
+      int priority;
+      char number[64];
+      if (sscanf(line,"sms %d %63s %n",&priority,number,&n)==2) {
+	char text[SMSQ_MAX_TEXT];
+	int l=handoff_get_hex(&line[n],text,sizeof(text)-1);
+	text[l]=0;
+	smsq_send(number,text,priority);
+	continue;
+      }
+      LOG_WARN("Ignoring unexpected line in hand over: '%s'",line);
+    }
+    free(line);
+    fclose(f);
+    free(state);
+    // Anything we did not understand is no use to us
+    while(next_fd<fd_count) outq_close(fds[next_fd++]);
+    if (!retVal) LOG_NOTE("Took over %d inputs from the previous process",input_count);
+  } while(0);
+
+  LOG_EXIT;
+  return retVal;
+}
+
+const char *input_type_name(int type)
+{
+  switch(type) {
+  case IT_CELLMODEM: return "modem";
+  case IT_NX584SERVERLOG: return "log";
+  case IT_TEXTCOMMANDS: return "command";
+  default: return "unknown";
+  }
+}
+
+void write_metrics(FILE *f)
+{
+  metrics_describe(f,"nx584_sms_start_time_seconds","gauge","When the daemon started.");
+  fprintf(f,"nx584_sms_start_time_seconds %lld\n",(long long)start_time);
+
+  metrics_describe(f,"nx584_sms_input_lines_total","counter","Lines read from each input.");
+  for(int i=0;i<input_count;i++) {
+    fprintf(f,"nx584_sms_input_lines_total{input=");
+    metrics_label_value(f,input_files[i]);
+    fprintf(f,"} %llu\n",lines_by_input[i]);
+  }
+  metrics_describe(f,"nx584_sms_input_last_line_timestamp_seconds","gauge",
+		   "When each input last produced a line.");
+  for(int i=0;i<input_count;i++) {
+    fprintf(f,"nx584_sms_input_last_line_timestamp_seconds{input=");
+    metrics_label_value(f,input_files[i]);
+    fprintf(f,"} %lld\n",(long long)last_line_time[i]);
+  }
+  metrics_describe(f,"nx584_sms_lines_total","counter","Lines processed, by what they turned out to be.");
+  for(int t=IT_UNKNOWN;t<=IT_TEXTCOMMANDS;t++)
+    fprintf(f,"nx584_sms_lines_total{type=\"%s\"} %llu\n",input_type_name(t),lines_by_type[t]);
+  metrics_describe(f,"nx584_sms_unrecognised_lines_total","counter","Lines that could not be parsed.");
+  fprintf(f,"nx584_sms_unrecognised_lines_total %llu\n",lines_by_type[IT_UNKNOWN]);
+
+  metrics_describe(f,"nx584_sms_sms_polls_total","counter","Times gammu was asked for received SMS.");
+  fprintf(f,"nx584_sms_sms_polls_total %llu\n",sms_polls);
+  metrics_describe(f,"nx584_sms_sms_received_total","counter","SMS received.");
+  fprintf(f,"nx584_sms_sms_received_total %llu\n",sms_received);
+  metrics_describe(f,"nx584_sms_inbound_throttled_total","counter","Received commands ignored because the sender was sending too many.");
+  fprintf(f,"nx584_sms_inbound_throttled_total %llu\n",inbound_throttled);
+  metrics_describe(f,"nx584_sms_inbound_coalesced_total","counter","Received commands answered along with an identical one.");
+  fprintf(f,"nx584_sms_inbound_coalesced_total %llu\n",inbound_coalesced);
+  metrics_describe(f,"nx584_sms_alarm_broadcasts_total","counter","Alarm notifications, including updates on an unacknowledged incident.");
+  fprintf(f,"nx584_sms_alarm_broadcasts_total %llu\n",alarm_broadcasts);
+  metrics_describe(f,"nx584_sms_alarm_incidents_total","counter","Alarm incidents, each escalated until acknowledged.");
+  fprintf(f,"nx584_sms_alarm_incidents_total %llu\n",incidents);
+  metrics_describe(f,"nx584_sms_alarm_acks_total","counter","Alarm incidents acknowledged.");
+  fprintf(f,"nx584_sms_alarm_acks_total %llu\n",incident_acks);
+  metrics_describe(f,"nx584_sms_alarm_sms_saved_total","counter","Alarm SMS segments not sent because an earlier tier acknowledged.");
+  fprintf(f,"nx584_sms_alarm_sms_saved_total %llu\n",incident_sms_saved);
+  metrics_describe(f,"nx584_sms_routed_events_total","counter","Events that matched a routing rule.");
+  fprintf(f,"nx584_sms_routed_events_total %llu\n",routed_events);
+  metrics_describe(f,"nx584_sms_alarm_unacknowledged","gauge","1 if there is an alarm incident nobody has acknowledged.");
+  fprintf(f,"nx584_sms_alarm_unacknowledged %d\n",incident_active);
+
+  metrics_describe(f,"nx584_sms_sms_sent_total","counter","SMS sent, by priority class.");
+  for(int c=0;c<SMSQ_CLASSES;c++)
+    fprintf(f,"nx584_sms_sms_sent_total{class=\"%s\"} %llu\n",smsq_class_name(c),smsq_counters[c].sent);
+  metrics_describe(f,"nx584_sms_sms_segments_total","counter","SMS segments sent, by priority class.");
+  for(int c=0;c<SMSQ_CLASSES;c++)
+    fprintf(f,"nx584_sms_sms_segments_total{class=\"%s\"} %llu\n",smsq_class_name(c),smsq_counters[c].segments);
+  metrics_describe(f,"nx584_sms_sms_retries_total","counter","SMS send attempts that failed and will be retried.");
+  for(int c=0;c<SMSQ_CLASSES;c++)
+    fprintf(f,"nx584_sms_sms_retries_total{class=\"%s\"} %llu\n",smsq_class_name(c),smsq_counters[c].retries);
+  metrics_describe(f,"nx584_sms_sms_failed_total","counter","SMS that could not be sent.");
+  for(int c=0;c<SMSQ_CLASSES;c++)
+    fprintf(f,"nx584_sms_sms_failed_total{class=\"%s\"} %llu\n",smsq_class_name(c),smsq_counters[c].failed);
+  metrics_describe(f,"nx584_sms_sms_queued","gauge","SMS waiting to be sent.");
+  for(int c=0;c<SMSQ_CLASSES;c++)
+    fprintf(f,"nx584_sms_sms_queued{class=\"%s\"} %d\n",smsq_class_name(c),smsq_pending(c));
+
+  metrics_describe(f,"nx584_sms_modem_sent_total","counter","SMS sent through each modem.");
+  for(int m=0;m<modem_count();m++) {
+    fprintf(f,"nx584_sms_modem_sent_total{modem=");
+    metrics_label_value(f,modems[m].device[0]?modems[m].device:"default");
+    fprintf(f,"} %llu\n",modems[m].sent);
+  }
+  metrics_describe(f,"nx584_sms_modem_failed_total","counter","Failed send attempts on each modem.");
+  for(int m=0;m<modem_count();m++) {
+    fprintf(f,"nx584_sms_modem_failed_total{modem=");
+    metrics_label_value(f,modems[m].device[0]?modems[m].device:"default");
+    fprintf(f,"} %llu\n",modems[m].failed);
+  }
+  metrics_describe(f,"nx584_sms_modem_send_seconds","gauge","Recent average time each modem takes to send an SMS.");
+  for(int m=0;m<modem_count();m++) {
+    fprintf(f,"nx584_sms_modem_send_seconds{modem=");
+    metrics_label_value(f,modems[m].device[0]?modems[m].device:"default");
+    fprintf(f,"} %.3f\n",modems[m].avg_send_ms/1000.0);
+  }
+  metrics_describe(f,"nx584_sms_process_spawns_total","counter","External programs run.");
+  fprintf(f,"nx584_sms_process_spawns_total %llu\n",command_spawns);
+  metrics_describe(f,"nx584_sms_process_seconds_total","counter","Time spent waiting for external programs.");
+  fprintf(f,"nx584_sms_process_seconds_total %.3f\n",command_total_ms/1000.0);
+
+  metrics_describe(f,"nx584_sms_output_dropped_bytes_total","counter","Bytes of output discarded because a device would not accept them.");
+  fprintf(f,"nx584_sms_output_dropped_bytes_total %llu\n",outq_bytes_dropped);
+
+  metrics_describe(f,"nx584_sms_users","gauge","Authorised users.");
+  fprintf(f,"nx584_sms_users %d\n",user_count);
+  metrics_describe(f,"nx584_sms_config_reloads_total","counter","Times the config file was reloaded after changing.");
+  fprintf(f,"nx584_sms_config_reloads_total %llu\n",config_reloads);
+  metrics_describe(f,"nx584_sms_config_reload_seconds_max","gauge","Longest config file reload.");
+  fprintf(f,"nx584_sms_config_reload_seconds_max %.6f\n",config_reload_us_max/1000000.0);
+  metrics_describe(f,"nx584_sms_panel_lag_seconds","gauge","How long after the panel logged the latest event we acted on it.");
+  fprintf(f,"nx584_sms_panel_lag_seconds %.3f\n",merge_lag_last_ms/1000.0);
+  metrics_describe(f,"nx584_sms_panel_lag_seconds_max","gauge","Longest delay between the panel logging an event and us acting on it.");
+  fprintf(f,"nx584_sms_panel_lag_seconds_max %.3f\n",merge_lag_max_ms/1000.0);
+  metrics_describe(f,"nx584_sms_log_lines_reordered_total","counter","Log lines acted on ahead of lines read before them, to keep panel time order.");
+  fprintf(f,"nx584_sms_log_lines_reordered_total %llu\n",merge_reordered);
+  metrics_describe(f,"nx584_sms_log_lines_unordered_total","counter","Log lines acted on before the other logs had caught up with them.");
+  fprintf(f,"nx584_sms_log_lines_unordered_total %llu\n",merge_forced);
+  metrics_describe(f,"nx584_sms_log_lines_waiting","gauge","Log lines waiting for the other logs to catch up.");
+  fprintf(f,"nx584_sms_log_lines_waiting %d\n",merge_pending());
+  int faults=0;
+  for(int i=0;i<MAX_ZONES;i++) if (zoneStates[i]==ZS_FAULT) faults++;
+  metrics_describe(f,"nx584_sms_zone_faults","gauge","Zones currently in fault.");
+  fprintf(f,"nx584_sms_zone_faults %d\n",faults);
+  metrics_describe(f,"nx584_sms_armed","gauge","1 if armed, 0 if not, -1 if unknown.");
+  fprintf(f,"nx584_sms_armed %d\n",armedP);
+  metrics_describe(f,"nx584_sms_siren","gauge","1 if the siren is sounding, 0 if not, -1 if unknown.");
+  fprintf(f,"nx584_sms_siren %d\n",siren);
+
+  metrics_describe(f,"nx584_sms_loop_stalls_total","counter","Main loop iterations that took longer than stall_ms.");
+  fprintf(f,"nx584_sms_loop_stalls_total %llu\n",watchdog_stalls);
+  metrics_describe(f,"nx584_sms_loop_stall_seconds_max","gauge","Longest main loop stall.");
+  fprintf(f,"nx584_sms_loop_stall_seconds_max %.3f\n",watchdog_worst.ms/1000.0);
+  metrics_describe(f,"nx584_sms_blocking_seconds_max","gauge","Longest time blocked in each blocking call.");
+  for(int i=0;i<watchdog_site_count;i++) {
+    char site[256];
+    snprintf(site,sizeof(site),"%s:%d",watchdog_sites[i].file,watchdog_sites[i].line);
+    fprintf(f,"nx584_sms_blocking_seconds_max{op=");
+    metrics_label_value(f,watchdog_sites[i].what);
+    fprintf(f,",site=");
+    metrics_label_value(f,site);
+    fprintf(f,"} %.3f\n",watchdog_sites[i].max_ms/1000.0);
+  }
+  metrics_describe(f,"nx584_sms_loop_iterations_total","counter","Main loop iterations.");
+  fprintf(f,"nx584_sms_loop_iterations_total %llu\n",loop_iterations);
+  metrics_describe(f,"nx584_sms_loop_busy_seconds_total","counter","Time spent in the main loop, other than waiting for input.");
+  fprintf(f,"nx584_sms_loop_busy_seconds_total %.6f\n",loop_busy_us_total/1000000.0);
+  metrics_describe(f,"nx584_sms_loop_busy_seconds_max","gauge","Longest main loop iteration, other than waiting for input.");
+  fprintf(f,"nx584_sms_loop_busy_seconds_max %.6f\n",loop_busy_us_max/1000000.0);
+  transport_write_metrics(f);
+}
+
+/*
+  Received SMS are not acted on one at a time as they are read.  Each
+  sender has a token bucket, refilled at inbound_rate commands per minute
+  and holding up to inbound_burst, and anything beyond that is dropped,
+  with a single notice to the sender until they slow down.  What is left is
+  collected for the whole poll, and then identical requests are merged:
+  the same command repeated by one sender is only run once, and commands
+  whose reply doesn't depend on who asked (e.g., status) are worked out
+  once, and the reply sent to everyone who asked.
+*/
+double inbound_rate=6;
+int inbound_burst=5;
+
+struct inbound_sender {
+  char number[64];
+  double tokens;
+  long long last_refill_ms;
+  int notified;      // has been told they are being throttled
+};
+struct inbound_sender inbound_senders[MAX_USERS];
+int inbound_sender_count=0;
+
+#define INBOUND_BATCH 64
+struct inbound_sms {
+  char sender[64];
+  char text[1024];
+  int done;
+};
+struct inbound_sms inbound_batch[INBOUND_BATCH];
+int inbound_count=0;
+
+// Returns 1 if the sender may have another command run now.
+int inbound_allow(char *sender)
+{
+  long long now=clock_ms();
+  struct inbound_sender *s=NULL;
+  for(int i=0;i<inbound_sender_count;i++)
+    if (!strcmp(inbound_senders[i].number,sender)) { s=&inbound_senders[i]; break; }
+  if (!s) {
+    // Reuse whoever has been quiet longest, if the table is full
+    if (inbound_sender_count<MAX_USERS) s=&inbound_senders[inbound_sender_count++];
+    else {
+      s=&inbound_senders[0];
+      for(int i=1;i<MAX_USERS;i++)
+	if (inbound_senders[i].last_refill_ms<s->last_refill_ms) s=&inbound_senders[i];
+    }
+    snprintf(s->number,sizeof(s->number),"%s",sender);
+    s->tokens=inbound_burst;
+    s->last_refill_ms=now;
+    s->notified=0;
+  }
+
+  s->tokens+=(now-s->last_refill_ms)*inbound_rate/60000.0;
+  if (s->tokens>inbound_burst) s->tokens=inbound_burst;
+  s->last_refill_ms=now;
+  if (s->tokens>=1) {
+    s->tokens-=1;
+    s->notified=0;
+    return 1;
+  }
+
+  inbound_throttled++;
+  LOG_WARN("Ignoring command from %s, who is sending too many",sender);
+  if (!s->notified) {
+    smsq_send(sender,"You are sending commands too quickly, so some have been ignored. Please wait a minute before trying again.",SMSQ_REPLY);
+    s->notified=1;
+  }
+  return 0;
+}
+
+void inbound_flush(void)
+{
+  char out[REPLY_SIZE];
+  for(int i=0;i<inbound_count;i++) {
+    struct inbound_sms *m=&inbound_batch[i];
+    if (m->done) continue;
+    m->done=1;
+
+    int role=user_role(m->sender);
+    char *arg;
+    struct command *c=find_textcommand(m->text,&arg,role);
+    int shared=c&&c->shared;
+
+    // Merge the identical requests that follow
+    for(int j=i+1;j<inbound_count;j++) {
+      struct inbound_sms *o=&inbound_batch[j];
+      if (o->done||strcasecmp(o->text,m->text)) continue;
+      if (!strcmp(o->sender,m->sender)) {
+	o->done=1;
+	inbound_coalesced++;
+      }
+    }
+    if (!shared) {
+      parse_line(m->sender,-1,m->text);
+      continue;
+    }
+
+    LOG_NOTE("Running '%s' once for everyone who asked",m->text);
+    if (parse_textcommand(-1,m->text,out,m->sender)) continue;
+    lines_by_type[IT_TEXTCOMMANDS]++;
+    smsq_send(m->sender,out,SMSQ_REPLY);
+    for(int j=i+1;j<inbound_count;j++) {
+      struct inbound_sms *o=&inbound_batch[j];
+      if (o->done||strcasecmp(o->text,m->text)) continue;
+      // Only if they have the same role, as the answer may depend on it
+      // (e.g., help only lists the commands the asker may use)
+      if (user_role(o->sender)!=role) continue;
+      o->done=1;
+      inbound_coalesced++;
+      smsq_send(o->sender,out,SMSQ_REPLY);
+    }
+  }
+  inbound_count=0;
+}
+
+void inbound_add(char *sender,char *text)
+{
+  if (!inbound_allow(sender)) return;
+  inbound_accepted++;
+  if (inbound_count>=INBOUND_BATCH) inbound_flush();
+  struct inbound_sms *m=&inbound_batch[inbound_count++];
+  snprintf(m->sender,sizeof(m->sender),"%s",sender);
+  snprintf(m->text,sizeof(m->text),"%s",text);
+  m->done=0;
+}
+
 time_t last_sms_check_time=0;
+// Where gammu getallsms output is collected
+char sms_file[1024]="/tmp/nx584-sms.txt";
+
+// Act on a complete line from an input.  panel_ms is when the panel logged
+// it, or -1 if we don't know.
+void handle_line(int i,char *line,long long panel_ms)
+{
+  line_panel_time=panel_ms>=0?panel_ms/1000:0;
+  input_types[i]=parse_line(input_files[i],inputs[i],line);
+  line_panel_time=0;
+  if (input_types[i]>=IT_UNKNOWN&&input_types[i]<=IT_TEXTCOMMANDS)
+    lines_by_type[input_types[i]]++;
+  lines_by_input[i]++;
+  last_line_time[i]=clock_now();
+}
+
+// Whether an input is a pipe (or socket), which, unlike a log file, has
+// nothing more to give once read() returns 0.
+int input_is_stream(int i)
+{
+  struct stat st;
+  return !fstat(inputs[i],&st)&&(S_ISFIFO(st.st_mode)||S_ISSOCK(st.st_mode));
+}
+
+// Stop reading an input that has come to an end, e.g., the output of the
+// nx584_server run by the process we took over from, so that it isn't
+// handed over again, using up an input each time.  A last line without a
+// line ending is still acted on.
+void close_input(int i)
+{
+  LOG_NOTE("'%s' has ended",input_files[i]);
+  if (buffer_lens[i]) {
+    buffers[i][buffer_lens[i]]=0;
+    if (merge_add(i,buffers[i],merge_timestamp(buffers[i]),clock_ms()))
+      handle_line(i,buffers[i],-1);
+    buffer_lens[i]=0;
+  }
+  outq_close(inputs[i]);
+  inputs[i]=-1;
+  merge_forget(i);
+}
 
 int main(int argc,char **argv)
 {
@@ -630,6 +1973,9 @@ int main(int argc,char **argv)
   do {
 
     for(int i=0;i<MAX_ZONES;i++) zoneStates[i]=ZS_UNKNOWN;
+    for(int i=0;i<RULE_KEYS;i++) partition_armed[i]=-1;
+    main_argv=argv;
+    serial_find_profile("default",&port_profile);
   
     for(int i=1;i<argc;i++) {
       if (input_count>=MAX_INPUTS) {
@@ -639,12 +1985,103 @@ int main(int argc,char **argv)
       }
 
       // Allow nx584_client and master pins to be configured
-      int f=sscanf(argv[i],"nx584_client=%s",nx584_client);
+      int f=sscanf(argv[i],"handoff=%d",&handoff_fd);
+      if (f==1) continue;
+      f=sscanf(argv[i],"nx584_client=%s",nx584_client);
       if (f==1) continue;
       f=sscanf(argv[i],"master=%s",master_pin);
       if (f==1) continue;            
       f=sscanf(argv[i],"conf=%s",config_file);
       if (f==1) continue;            
+      if (!strncmp(argv[i],"profile=",8)) {
+	if (serial_parse_profile(&argv[i][8],&port_profile)) {
+	  LOG_ERROR("Invalid serial port profile '%s'",&argv[i][8]);
+	  retVal=-1;
+	  break;
+	}
+	continue;
+      }
+      f=sscanf(argv[i],"nx584_server=%s",supervisor_program);
+      if (f==1) continue;
+      f=sscanf(argv[i],"nx584_serial=%s",supervisor_serial_port);
+      if (f==1) continue;
+      f=sscanf(argv[i],"tee=%s",supervisor_tee_file);
+      if (f==1) continue;
+      f=sscanf(argv[i],"tee_max=%lld",&supervisor_tee_max);
+      if (f==1) continue;
+      f=sscanf(argv[i],"metrics=%s",metrics_file);
+      if (f==1) continue;
+      f=sscanf(argv[i],"metrics_interval=%d",&metrics_interval);
+      if (f==1) continue;
+      f=sscanf(argv[i],"metrics_port=%d",&metrics_port);
+      if (f==1) continue;
+      f=sscanf(argv[i],"stall_ms=%d",&watchdog_threshold_ms);
+      if (f==1) continue;
+      f=sscanf(argv[i],"escalate=%d",&escalate_interval);
+      if (f==1) continue;
+      if (!strncmp(argv[i],"clock=",6)) {
+	if (clock_parse(&argv[i][6])) {
+	  LOG_ERROR("Invalid clock '%s', expected real, sim or sim@<seconds since 1970>",&argv[i][6]);
+	  retVal=-1;
+	  break;
+	}
+	continue;
+      }
+      f=sscanf(argv[i],"rules=%s",rules_file);
+      if (f==1) continue;
+      f=sscanf(argv[i],"modem_connection=%63s",modem_connection);
+      if (f==1) continue;
+      if (!strncmp(argv[i],"notify=",7)) {
+	if (transport_add(&argv[i][7])<0) {
+	  retVal=-1;
+	  break;
+	}
+	continue;
+      }
+      f=sscanf(argv[i],"merge_ms=%d",&merge_delay_ms);
+      if (f==1) continue;
+      f=sscanf(argv[i],"lag_warn_ms=%d",&merge_lag_warn_ms);
+      if (f==1) continue;
+      f=sscanf(argv[i],"inbound_rate=%lf",&inbound_rate);
+      if (f==1) continue;
+      f=sscanf(argv[i],"inbound_burst=%d",&inbound_burst);
+      if (f==1) continue;
+      f=sscanf(argv[i],"smsfile=%s",sms_file);
+      if (f==1) continue;
+      f=sscanf(argv[i],"smsrate=%lf",&smsq_rate);
+      if (f==1) continue;
+      f=sscanf(argv[i],"smsburst=%d",&smsq_burst);
+      if (f==1) continue;
+      f=sscanf(argv[i],"probe_timeout=%d",&probe_timeout);
+      if (f==1) continue;
+      if (!strncmp(argv[i],"checkpoint=",11)) {
+	snprintf(checkpoint_file,sizeof(checkpoint_file),"%s",&argv[i][11]);
+	continue;
+      }
+      f=sscanf(argv[i],"replay_max=%lld",&replay_max);
+      if (f==1) continue;
+      if (!strncmp(argv[i],"probecache=",11)) {
+	snprintf(probe_cache,sizeof(probe_cache),"%s",&argv[i][11]);
+	continue;
+      }
+
+      // The previous process passes us its inputs, already open
+      if (handoff_fd>=0) continue;
+
+      // Serial ports are probed all together once we have the full list,
+      // rather than one at a time here.
+      struct stat st;
+      if ((!stat(argv[i],&st))&&S_ISCHR(st.st_mode)) {
+	if (probe_count>=MAX_PROBE_DEVICES) {
+	  LOG_ERROR("Too many serial devices specified");
+	  retVal=-1;
+	  break;
+	}
+	snprintf(probe_list[probe_count].path,sizeof(probe_list[probe_count].path),
+		 "%s",argv[i]);
+	probe_list[probe_count++].profile=port_profile;
+	continue;
+      }
       
       int fd=open_input(argv[i]);
       if (fd==-1) {
@@ -657,11 +2094,100 @@ int main(int argc,char **argv)
       inputs[input_count++]=fd;
     }
     if (retVal) break;
+    start_time=clock_now();
+    if (handoff_fd>=0&&take_over()) {
+      retVal=-1;
+      break;
+    }
+
+    if (probe_count) {
+      if (probe_devices(probe_list,probe_count,probe_timeout,probe_cache)<0) {
+	LOG_ERROR("Could not setup serial devices");
+	retVal=-1;
+	break;
+      }
+      for(int i=0;i<probe_count;i++) {
+	if (probe_list[i].class==PROBE_NX584) {
+	  // The NX584 itself is nx584_server's business, not ours.
+	  LOG_NOTE("'%s' is the NX584 serial interface",probe_list[i].path);
+	  if (!nx584_serial_port[0])
+	    strcpy(nx584_serial_port,probe_list[i].path);
+	  outq_close(probe_list[i].fd);
+	  continue;
+	}
+	if (probe_list[i].class==PROBE_MODEM) {
+	  // gammu needs the modem to itself, so we must not read from it too
+	  outq_close(probe_list[i].fd);
+	  if (modem_add(probe_list[i].path)<0) {
+	    retVal=-1;
+	    break;
+	  }
+	  continue;
+	}
+	if (input_count>=MAX_INPUTS) {
+	  LOG_ERROR("Too many input devices specified");
+	  retVal=-1;
+	  break;
+	}
+	input_files[input_count]=probe_list[i].path;
+	input_types[input_count]=IT_UNKNOWN;
+	inputs[input_count++]=probe_list[i].fd;
+      }
+      if (retVal) break;
+    }
+
+    if (supervisor_enabled()) {
+      // The server's output arrives through a pipe, which is only opened
+      // once the server is started from the main loop.
+      if (!supervisor_serial_port[0])
+	snprintf(supervisor_serial_port,sizeof(supervisor_serial_port),"%s",nx584_serial_port);
+      if (input_count>=MAX_INPUTS) {
+	LOG_ERROR("Too many input devices specified");
+	retVal=-1;
+	break;
+      }
+      supervisor_input=input_count;
+      input_files[input_count]="nx584_server";
+      input_types[input_count]=IT_NX584SERVERLOG;
+      inputs[input_count++]=-1;
+    }
 
     LOG_NOTE("%d input streams setup.",input_count);
+    for(int i=0;i<input_count;i++) {
+      struct stat st;
+      // Log files, and nx584_server's output, whether or not it is running yet
+      if (input_types[i]==IT_NX584SERVERLOG
+	  ||(inputs[i]>=0&&!fstat(inputs[i],&st)&&S_ISREG(st.st_mode)))
+	merge_expect(i,clock_ms());
+    }
 
     load_user_list();
     LOG_NOTE("%d users registered.",user_count);
+    // Pick up changes made to the config and rules while we are running
+    config_watch=confwatch_setup(config_file);
+    rules_load();
+    rules_watch=confwatch_setup(rules_file);
+
+    if (handoff_fd<0) {
+      recover_state();
+      if (armedP!=-1) partition_armed[1]=armedP;
+    } else
+      save_checkpoint();
+    watchdog_setup();
+    signal(SIGTERM,request_exit);
+    signal(SIGINT,request_exit);
+    signal(SIGUSR2,request_restart);
+
+    if (metrics_setup(write_metrics)) {
+      retVal=-1;
+      break;
+    }
+    if (handoff_fd>=0) {
+      // The previous process can go now
+      handoff_ack(handoff_fd);
+      close(handoff_fd);
+      handoff_fd=-1;
+    }
     
     fprintf(stderr,
 	    "NX584 SMS gateway running.\n"
@@ -669,61 +2195,103 @@ int main(int argc,char **argv)
 	    "If you specified stdin on the command line, you can type commands interactively.\n"
 	    );
     
-    while (1) {
+    while (!exit_requested) {
+      long long loop_start=monotonic_us();
+      long long loop_idle=0;
+
       // Read from each input type in turn
       int events=0;
       for (int i=0;i<input_count;i++) {
 	int r=0;
-	if (buffer_lens[i]<(BUFFER_SIZE-1))
+	if (inputs[i]<0) continue;
+	if (buffer_lens[i]>=(buffer_sizes[i]-1)&&buffer_sizes[i]<BUFFER_SIZE) {
+	  int size=buffer_sizes[i]?buffer_sizes[i]*2:BUFFER_INITIAL_SIZE;
+	  char *b=realloc(buffers[i],size);
+	  if (b) { buffers[i]=b; buffer_sizes[i]=size; }
+	}
+	if (buffer_lens[i]<(buffer_sizes[i]-1)) {
 	  r=read(inputs[i],&buffers[i][buffer_lens[i]],1);
+	  // Our own nx584_server's pipe is the supervisor's to close and reopen
+	  if (r==0&&i!=supervisor_input&&input_is_stream(i)) {
+	    close_input(i);
+	    continue;
+	  }
+	}
 	if (r>0) {
 	  events++;
 	  if ((buffers[i][buffer_lens[i]]=='\n')||(buffers[i][buffer_lens[i]]=='\r')) {
 	    buffers[i][buffer_lens[i]]=0;
 	    LOG_NOTE("Have line of input from '%s': %s",input_files[i],buffers[i]);
-	    input_types[i]=parse_line(input_files[i],inputs[i],buffers[i]);
+	    if (i==supervisor_input) supervisor_tee(buffers[i]);
+	    // Log lines wait their turn, in case another log has earlier ones
+	    if (merge_add(i,buffers[i],merge_timestamp(buffers[i]),clock_ms()))
+	      handle_line(i,buffers[i],-1);
 	    buffers[i][0]=0;
 	    buffer_lens[i]=0;
 	  } else	  
 	    buffer_lens[i]+=r;
 	}
        }
-      if (!events) usleep(10000);
+      merge_release(clock_ms(),handle_line);
+      unsigned int changed=confwatch_poll();
+      if (changed&config_watch) {
+	long long op_start=command_ms();
+	load_user_list();
+	watchdog_op(__FILE__,__LINE__,"config reload",command_ms()-op_start);
+      }
+      if (changed&rules_watch) {
+	long long op_start=command_ms();
+	rules_load();
+	watchdog_op(__FILE__,__LINE__,"rules reload",command_ms()-op_start);
+      }
+
+      // (Re)start nx584_server if we are running it, and it isn't running
+      int supervisor_fd;
+      if (supervisor_poll(&supervisor_fd)) {
+	inputs[supervisor_input]=supervisor_fd;
+	buffer_lens[supervisor_input]=0;
+      }
+
+      // Flush any queued output to slow devices, and if there was nothing
+      // to read, wait a little while for something to happen.
+      long long idle_start=monotonic_us();
+      outq_poll_flush(events?0:10);
+      loop_idle=monotonic_us()-idle_start;
 
       // Trigger a significant event if the siren has been on more than 10 seconds
       // (this is to avoid triggering a broadcast alert when the siren briefly sounds
       //  during remote arming/disarming).
-      if (siren_on_time&&((time(0)-siren_on_time)>=10)) {
+      if (siren_on_time&&((clock_now()-siren_on_time)>=10)) {
 	significant_event=1;
 	siren_on_time=0;
       }
       if (significant_event) {
 	significant_event=0;
-
-	int out_len=0;
-	char out[8192];
-	sprintf(out,"UNEXPECTED ALARM ACTIVITY: ");
-	out_len=strlen(out);
-	generate_status_message(out,&out_len,8192);
-	
-	for(int i=0;i<user_count;i++) {
-	  // Send SMS to added user telling them that they have been added
-	  char cmd[10000];
-	  snprintf(cmd,10000,"LANG=C gammu sendsms TEXT %s -text \"%s. You and %d other(s) have been sent this message. Reply with help for a reminder of commands.\"",users[i],out,user_count-1);
-	printf("[%s]\n",cmd);
-	system(cmd);  
-	
-	}
+	if (route_event(RULE_SIREN,0,"Siren sounding")!=0) alarm_incident();
       }
+      alarm_escalate();
       
-      // Check for new messages
-      if (last_sms_check_time<time(0)) {
-
-	printf("Getting SMS...\n");
-	unlink("/tmp/nx584-sms.txt");
-	system("LANG=C gammu getallsms >/tmp/nx584-sms.txt");
-
-	FILE *f=fopen("/tmp/nx584-sms.txt","r");
+      // Send queued SMS on whichever modems are free, and notifications
+      // on the other channels
+      smsq_run();
+      transport_run();
+
+      // Check for new messages, on each modem in turn, skipping any that
+      // are busy sending.
+      int poll_modem=-1;
+      if (last_sms_check_time<clock_now()) poll_modem=modem_poll_next();
+      if (poll_modem>=0) {
+
+	printf("Getting SMS from modem #%d...\n",poll_modem);
+	unlink(sms_file);
+	char gammu[1200];
+	modem_gammu(poll_modem,gammu,sizeof(gammu));
+	char cmd[2400];
+	snprintf(cmd,sizeof(cmd),"%s getallsms >%s",gammu,sms_file);
+	run_command(cmd);
+	sms_polls++;
+
+	FILE *f=fopen(sms_file,"r");
 	if (f) {
 	  char sender[1024];
 	  char location[1024]="";
@@ -737,18 +2305,19 @@ int main(int argc,char **argv)
 	      printf("SMS message #%s from '%s' is '%s'\n",location,sender,line);
 
 	      // Run instruction
+	      sms_received++;
 	      if (is_authorised(sender)) {
 		while(line[0]&&line[strlen(line)-1]=='\n') line[strlen(line)-1]=0;
 		if (line[0])
-		  parse_line(sender,-1,line);
+		  inbound_add(sender,line);
 	      } else {
 		printf("'%s' is not authorised to use this service.\n",sender);
 	      }
 	      
 	      // Delete SMS message
-	      char cmd[8192];
-	      snprintf(cmd,8192,"LANG=C gammu deletesms 0 %s",location);
-	      system(cmd);	      
+	      char cmd[2400];
+	      snprintf(cmd,sizeof(cmd),"%s deletesms 0 %s",gammu,location);
+	      run_command(cmd);
 	      
 	      isSMS=0; gotSender=0; location[0]=0;
 	    } else {
@@ -763,11 +2332,56 @@ int main(int argc,char **argv)
 	  }
 	  
 	  fclose(f);
+	  inbound_flush();
 	}
 	
-	last_sms_check_time=time(0);
+	last_sms_check_time=clock_now();
       }
-      
+
+      metrics_poll();
+
+      if ((checkpoint_dirty&&clock_now()-checkpoint_time>=CHECKPOINT_MIN_INTERVAL)
+	  ||clock_now()-checkpoint_time>=CHECKPOINT_MAX_INTERVAL) {
+	long long op_start=command_ms();
+	save_checkpoint();
+	watchdog_op(__FILE__,__LINE__,"checkpoint save",command_ms()-op_start);
+      }
+
+      if (restart_requested) {
+	// Let any messages being sent finish first, so that we know how
+	// they went, and likewise output still queued for slow devices.
+	smsq_hold=1;
+	transport_hold=1;
+	size_t output_pending=0;
+	for(int i=0;i<input_count;i++) if (inputs[i]>=0) output_pending+=outq_pending(inputs[i]);
+	if (!modem_busy_count()&&!transport_busy_count()&&!output_pending) {
+	  restart_requested=0;
+	  smsq_hold=0;
+	  transport_hold=0;
+	  // Lines still waiting their turn would otherwise be lost
+	  merge_flush(handle_line);
+	  if (!hand_over()) {
+	    handed_over=1;
+	    break;
+	  }
+	}
+      }
+
+      long long loop_busy=monotonic_us()-loop_start-loop_idle;
+      loop_iterations++;
+      loop_busy_us_total+=loop_busy;
+      if (loop_busy>loop_busy_us_max) loop_busy_us_max=loop_busy;
+      watchdog_loop_end(loop_busy/1000);
+    }
+
+    merge_flush(handle_line);
+    modem_cleanup();
+    if (handed_over)
+      // The checkpoint is the new process's to keep up to date now
+      LOG_NOTE("Exiting, having handed over");
+    else {
+      LOG_NOTE("Exiting on request");
+      save_checkpoint();
     }
     
   } while(0);
@@ -0,0 +1,61 @@
+#include "code_instrumentation.h"
+#include "pool.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Blocks are laid out back to back in a slab, so their size is rounded up
+// to keep every block (and the free list pointer kept in it) aligned.
+static int pool_block_size(struct pool *p)
+{
+  int align=_Alignof(max_align_t);
+  int size=p->block_size>0?p->block_size:1;
+  return (size+align-1)/align*align;
+}
+
+void *pool_alloc(struct pool *p)
+{
+  if (!p->free_list) {
+    int size=pool_block_size(p);
+    char *slab=malloc((size_t)size*p->blocks_per_slab);
+    if (!slab) {
+      LOG_ERROR("Could not grow pool '%s'",p->name);
+      return NULL;
+    }
+    for(int i=p->blocks_per_slab-1;i>=0;i--) {
+      void **block=(void **)&slab[i*size];
+      *block=p->free_list;
+      p->free_list=block;
+    }
+    p->slabs++;
+  }
+
+  void **block=p->free_list;
+  p->free_list=*block;
+  p->in_use++;
+  if (p->in_use>p->peak) p->peak=p->in_use;
+  return block;
+}
+
+void pool_free(struct pool *p, void *block)
+{
+  if (!block) return;
+  *(void **)block=p->free_list;
+  p->free_list=block;
+  p->in_use--;
+}
+
+// Copy a string into a block, or return NULL if it won't fit.
+char *pool_strdup(struct pool *p, const char *s)
+{
+  if ((int)strlen(s)>=p->block_size) return NULL;
+  char *block=pool_alloc(p);
+  if (block) strcpy(block,s);
+  return block;
+}
+
+long pool_bytes(struct pool *p)
+{
+  return (long)p->slabs*p->blocks_per_slab*pool_block_size(p);
+}
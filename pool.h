@@ -0,0 +1,29 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+//
+// 'pool.h/.c' provide a simple fixed-size block allocator.  Blocks are
+// carved from slabs that are allocated only as the pool grows, so memory
+// use follows what is actually needed, without the per-allocation overhead
+// and fragmentation of many small malloc()s in a long-running process.
+//
+
+struct pool {
+  const char *name;
+  int block_size;
+  int blocks_per_slab;
+  void *free_list;
+  int slabs;
+  int in_use;
+  int peak;
+};
+
+#define POOL_INIT(name, block_size, blocks_per_slab) \
+  { name, block_size, blocks_per_slab, 0, 0, 0, 0 }
+
+void *pool_alloc(struct pool *p);
+void pool_free(struct pool *p, void *block);
+char *pool_strdup(struct pool *p, const char *s);
+long pool_bytes(struct pool *p);
+
+#endif
@@ -0,0 +1,361 @@
+/*
+
+  NX584 modem interface to SMS controller
+  (C) Copyright Paul Gardner-Stephen 2018-2019
+
+  Parallel serial device auto-detection.
+
+  USB serial adapters do not reliably come up with the same device name, so
+  we are given a list of candidate ports and work out for ourselves which is
+  the cellular modem, and which is the NX584.  Each port is sent both an AT
+  command and an NX584 interface configuration request, all at once, and is
+  then classified by whichever kind of answer comes back before the deadline.
+  The NX584 only listens at its own speed, so ports that have not answered
+  by then are asked again, at that speed.
+
+  Probing is only needed once for each adapter, so the result is cached
+  against the adapter's /dev/serial/by-id name, and restarts skip straight
+  to using the cached classification.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <dirent.h>
+#include "code_instrumentation.h"
+#include "serial.h"
+#include "probe.h"
+
+#define SERIAL_BY_ID "/dev/serial/by-id"
+
+// NX584 ASCII protocol Interface Configuration Request (message type 0x21):
+// '\n', then hex length, type and Fletcher checksum, then '\r'
+#define NX584_PROBE "\n01212223\r"
+#define AT_PROBE "ATI\r"
+
+const char *probe_class_name(int class)
+{
+  switch(class) {
+  case PROBE_MODEM: return "modem";
+  case PROBE_NX584: return "nx584";
+  default: return "unknown";
+  }
+}
+
+int probe_class_from_name(const char *name)
+{
+  if (!strcmp(name,"modem")) return PROBE_MODEM;
+  if (!strcmp(name,"nx584")) return PROBE_NX584;
+  return PROBE_UNKNOWN;
+}
+
+long long probe_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec*1000LL+ts.tv_nsec/1000000;
+}
+
+// Find the /dev/serial/by-id name for a device, so that we can recognise
+// the same adapter again, regardless of which ttyUSBn it appears as.
+void probe_find_id(struct probe_device *d)
+{
+  d->id[0]=0;
+  char real[PATH_MAX];
+  if (!realpath(d->path,real)) return;
+
+  DIR *dir=opendir(SERIAL_BY_ID);
+  if (!dir) return;
+  struct dirent *de;
+  while((de=readdir(dir))!=NULL) {
+    if (de->d_name[0]=='.') continue;
+    char link[PATH_MAX];
+    char target[PATH_MAX];
+    snprintf(link,sizeof(link),"%s/%s",SERIAL_BY_ID,de->d_name);
+    if (!realpath(link,target)) continue;
+    if (!strcmp(target,real)) {
+      snprintf(d->id,sizeof(d->id),"%s",de->d_name);
+      break;
+    }
+  }
+  closedir(dir);
+}
+
+int probe_cache_lookup(const char *cache_file,const char *id)
+{
+  if (!cache_file||!cache_file[0]||!id[0]) return PROBE_UNKNOWN;
+  FILE *f=fopen(cache_file,"r");
+  if (!f) return PROBE_UNKNOWN;
+
+  int class=PROBE_UNKNOWN;
+  char line[1024];
+  char key[1024];
+  char name[1024];
+  line[0]=0; fgets(line,1024,f);
+  while(line[0]) {
+    if (sscanf(line,"%s %s",key,name)==2)
+      if (!strcmp(key,id)) class=probe_class_from_name(name);
+    line[0]=0; fgets(line,1024,f);
+  }
+  fclose(f);
+  return class;
+}
+
+// Rewrite the cache with the entries for the devices we have just probed,
+// keeping any entries for adapters that are not currently attached.
+int probe_cache_save(const char *cache_file,struct probe_device *devs,int count)
+{
+  if (!cache_file||!cache_file[0]) return 0;
+
+  char tmp[1024];
+  snprintf(tmp,sizeof(tmp),"%s.tmp",cache_file);
+  FILE *out=fopen(tmp,"w");
+  if (!out) {
+    LOG_WARN("Could not write device cache '%s'",tmp);
+    return -1;
+  }
+
+  FILE *in=fopen(cache_file,"r");
+  if (in) {
+    char line[1024];
+    char key[1024];
+    line[0]=0; fgets(line,1024,in);
+    while(line[0]) {
+      int replaced=0;
+      if (sscanf(line,"%s",key)==1)
+	for(int i=0;i<count;i++)
+	  if (devs[i].id[0]&&!strcmp(key,devs[i].id)) replaced=1;
+      if (!replaced) fputs(line,out);
+      line[0]=0; fgets(line,1024,in);
+    }
+    fclose(in);
+  }
+  for(int i=0;i<count;i++)
+    if (devs[i].id[0]&&devs[i].class!=PROBE_UNKNOWN)
+      fprintf(out,"%s %s\n",devs[i].id,probe_class_name(devs[i].class));
+  fclose(out);
+
+  if (rename(tmp,cache_file)) {
+    perror("rename");
+    LOG_WARN("Could not replace device cache '%s'",cache_file);
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+  Check that hex digits between a '\n' and a '\r' are a whole NX584 message:
+  a length, that many bytes of type and data, and a Fletcher checksum.  A
+  modem with echo on sends our own request back to us, which is a valid
+  message too, so that doesn't count.
+*/
+int probe_nx584_message(const char *hex, int digits)
+{
+  unsigned char bytes[128];
+  if (digits<8||(digits&1)||digits/2>(int)sizeof(bytes)) return 0;
+  for(int i=0;i<digits/2;i++) {
+    unsigned int b;
+    if (sscanf(&hex[i*2],"%2x",&b)!=1) return 0;
+    bytes[i]=b;
+  }
+  int len=bytes[0];
+  if (len+3!=digits/2) return 0;
+  unsigned int sum1=0,sum2=0;
+  for(int i=0;i<=len;i++) {
+    sum1=(sum1+bytes[i])%255;
+    sum2=(sum2+sum1)%255;
+  }
+  if (bytes[len+1]!=sum1||bytes[len+2]!=sum2) return 0;
+  // Our Interface Configuration Request, rather than an answer to it
+  if ((bytes[1]&0x3f)==0x21) return 0;
+  return 1;
+}
+
+// Look at what a device has sent back so far, and decide what it is.
+int probe_classify(struct probe_device *d)
+{
+  if (strstr(d->reply,"OK")||strstr(d->reply,"ERROR")) return PROBE_MODEM;
+
+  // NX584 replies in ASCII mode are '\n', an even number of hex digits, '\r'.
+  // In binary mode they start with 0x7e.
+  for(int i=0;i<d->reply_len;i++) {
+    if ((unsigned char)d->reply[i]==0x7e) return PROBE_NX584;
+    if (d->reply[i]!='\n') continue;
+    int j=i+1;
+    while(j<d->reply_len&&isxdigit((unsigned char)d->reply[j])) j++;
+    if (j<d->reply_len&&d->reply[j]=='\r'&&probe_nx584_message(&d->reply[i+1],j-i-1))
+      return PROBE_NX584;
+  }
+  return PROBE_UNKNOWN;
+}
+
+// Clear out anything stale, and send a probe.
+void probe_send(struct probe_device *d, const char *probe)
+{
+  tcflush(d->fd,TCIOFLUSH);
+  d->reply_len=0;
+  d->reply[0]=0;
+  write_all(d->fd,probe,strlen(probe));
+}
+
+/*
+  Wait up to timeout_ms for the devices we are still probing to answer, all
+  at once.  start is when probing began, for the log.
+*/
+void probe_wait(struct probe_device *devs, int count, int timeout_ms, long long start)
+{
+  long long round_start=probe_ms();
+  while(1) {
+    int remaining=timeout_ms-(int)(probe_ms()-round_start);
+    if (remaining<=0) break;
+
+    struct pollfd fds[MAX_PROBE_DEVICES];
+    int map[MAX_PROBE_DEVICES];
+    int nfds=0;
+    for(int i=0;i<count&&nfds<MAX_PROBE_DEVICES;i++)
+      if (!devs[i].cached&&devs[i].class==PROBE_UNKNOWN) {
+	fds[nfds].fd=devs[i].fd;
+	fds[nfds].events=POLLIN;
+	fds[nfds].revents=0;
+	map[nfds++]=i;
+      }
+    if (!nfds) break;
+    outq_poll_flush(0);
+    if (poll(fds,nfds,remaining<10?remaining:10)<1) continue;
+
+    for(int n=0;n<nfds;n++) {
+      if (!(fds[n].revents&POLLIN)) continue;
+      struct probe_device *d=&devs[map[n]];
+      int space=sizeof(d->reply)-1-d->reply_len;
+      if (space<1) continue;
+      ssize_t r=read_nonblock(d->fd,&d->reply[d->reply_len],space);
+      if (r<1) continue;
+      d->reply_len+=r;
+      d->reply[d->reply_len]=0;
+      d->class=probe_classify(d);
+      if (d->class!=PROBE_UNKNOWN)
+	LOG_NOTE("'%s' is a %s (answered after %lldms)",
+		 d->path,probe_class_name(d->class),probe_ms()-start);
+    }
+  }
+}
+
+/*
+  Open, configure and classify all of the devices.  Devices are left open
+  (with fd set) if they could be opened, even if we could not work out what
+  they are.  Returns the number of devices classified, or -1 on error, in
+  which case none are left open.
+*/
+int probe_devices(struct probe_device *devs, int count, int timeout_ms,
+		  const char *cache_file)
+{
+  int retVal=0;
+  LOG_ENTRY;
+
+  do {
+    long long start=probe_ms();
+    int probed=0;
+
+    for(int i=0;i<count;i++) devs[i].fd=-1;
+    for(int i=0;i<count;i++) {
+      struct probe_device *d=&devs[i];
+      d->class=PROBE_UNKNOWN;
+      d->cached=0;
+      d->reply_len=0;
+      d->reply[0]=0;
+
+      d->fd=open(d->path,O_RDWR|O_NONBLOCK|O_NOCTTY|O_CLOEXEC);
+      if (d->fd==-1) {
+	perror("open");
+	LOG_ERROR("Could not open '%s' for read and write",d->path);
+	retVal=-1;
+	break;
+      }
+      if (serial_setup_port(d->fd,&d->profile)) {
+	LOG_ERROR("Could not configure '%s' using serial port profile '%s'",
+		  d->path,d->profile.name);
+	retVal=-1;
+	break;
+      }
+
+      probe_find_id(d);
+      d->class=probe_cache_lookup(cache_file,d->id);
+      if (d->class!=PROBE_UNKNOWN) {
+	d->cached=1;
+	LOG_NOTE("'%s' (%s) is a %s, according to the device cache",
+		 d->path,d->id,probe_class_name(d->class));
+	continue;
+      }
+
+      // Send both probes.  A modem answers the NX584 probe with ERROR, and
+      // the NX584 ignores the AT command, so sending both does no harm.
+      probe_send(d,NX584_PROBE);
+      write_all(d->fd,AT_PROBE,strlen(AT_PROBE));
+      probed++;
+    }
+    if (retVal) {
+      for(int i=0;i<count;i++) {
+	outq_close(devs[i].fd);
+	devs[i].fd=-1;
+      }
+      break;
+    }
+    probe_wait(devs,count,timeout_ms,start);
+
+    // The NX584 only understands its own speed, which need not be the
+    // speed of the profile we were given for the port, so ask again at
+    // that speed on any port that hasn't answered yet.
+    struct serial_profile nx584;
+    serial_find_profile("nx584",&nx584);
+    int again=0;
+    for(int i=0;i<count;i++) {
+      struct probe_device *d=&devs[i];
+      if (d->cached||d->class!=PROBE_UNKNOWN||d->profile.speed==nx584.speed) continue;
+      if (serial_setup_port(d->fd,&nx584)) continue;
+      probe_send(d,NX584_PROBE);
+      again++;
+    }
+    if (again) probe_wait(devs,count,timeout_ms,start);
+
+    for(int i=0;i<count;i++) {
+      struct probe_device *d=&devs[i];
+      if (d->class!=PROBE_UNKNOWN) {
+	retVal++;
+	continue;
+      }
+      LOG_WARN("'%s' did not answer either probe within %dms",d->path,timeout_ms);
+      // It will be read as an input, as it was set up to be
+      if (d->profile.speed!=nx584.speed) serial_setup_port(d->fd,&d->profile);
+    }
+
+    if (probed) probe_cache_save(cache_file,devs,count);
+
+    LOG_NOTE("Probed %d serial devices in %lldms",count,probe_ms()-start);
+  } while(0);
+
+  LOG_EXIT;
+  return retVal;
+}
@@ -0,0 +1,33 @@
+#ifndef __PROBE_H__
+#define __PROBE_H__
+
+#include "serial.h"
+
+//
+// 'probe.h/.c' work out what is attached to each serial port we are given,
+// by probing all of them at once, and remembering the answer for ports that
+// have a stable USB serial ID.
+//
+
+#define PROBE_UNKNOWN 0
+#define PROBE_MODEM 1
+#define PROBE_NX584 2
+
+#define MAX_PROBE_DEVICES 16
+
+struct probe_device {
+  char path[1024];
+  char id[256];       // name under /dev/serial/by-id, if there is one
+  struct serial_profile profile;
+  int fd;
+  int class;
+  int cached;         // class came from the cache rather than a probe
+  char reply[256];
+  int reply_len;
+};
+
+int probe_devices(struct probe_device *devs, int count, int timeout_ms,
+		  const char *cache_file);
+const char *probe_class_name(int class);
+
+#endif
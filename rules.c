@@ -0,0 +1,308 @@
+/*
+
+  NX584 modem interface to SMS controller
+  (C) Copyright Paul Gardner-Stephen 2018-2019
+
+  Notification routing rules.
+
+  Without rules, an alarm is texted to every user.  Rules allow particular
+  events to go to particular groups of people instead, e.g., a fault on the
+  server room zone while the alarm is armed, to just the IT people.  Rules
+  are read from rules_file, which looks like this:
+
+    group it +61400000001 +61400000002
+    group owners +61400000003
+    rule zone=12 event=fault armed=1 notify=it
+    rule zone=1-8 event=fault time=22:00-06:00 notify=it,owners
+    rule event=disarm partition=1 notify=owners
+    rule event=siren notify=all
+
+  Events are fault and normal (zone changes, which are keyed by zone=),
+  arm and disarm (keyed by partition=), and siren.  A rule can also require
+  armed=0|1, siren=0|1, and a time of day (which may wrap past midnight).
+  notify=all means everyone, through the usual escalation tiers.
+
+  When loaded, the rules are compiled into an index giving, for each event
+  and zone (or partition), a bit mask of the rules that could apply, so only
+  those rules need their other conditions checking.  The new rules are built
+  to one side, and then replace the old ones all at once, so events are
+  never checked against a half-loaded set.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include "code_instrumentation.h"
+#include "pool.h"
+#include "rules.h"
+
+char rules_file[1024]="/usr/local/etc/nx584-sms.rules";
+
+struct rule_set rule_sets[2];
+struct rule_set *rules=NULL;
+
+struct pool rules_member_pool=POOL_INIT("group members",32,32);
+
+const char *rule_event_names[RULE_EVENTS]={"fault","normal","arm","disarm","siren"};
+
+const char *rules_event_name(int event)
+{
+  if (event<0||event>=RULE_EVENTS) return "unknown";
+  return rule_event_names[event];
+}
+
+void rules_free(struct rule_set *set)
+{
+  for(int g=0;g<set->group_count;g++)
+    for(int i=0;i<set->groups[g].member_count;i++)
+      pool_free(&rules_member_pool,set->groups[g].members[i]);
+  memset(set,0,sizeof(*set));
+}
+
+int rules_find_group(struct rule_set *set, const char *name, int len)
+{
+  for(int g=0;g<set->group_count;g++)
+    if ((int)strlen(set->groups[g].name)==len&&!strncmp(set->groups[g].name,name,len))
+      return g;
+  return -1;
+}
+
+int rules_parse_group(struct rule_set *set, char *line, int line_number)
+{
+  char name[RULE_NAME_SIZE];
+  int offset;
+  if (sscanf(line,"group %31s%n",name,&offset)!=1) {
+    LOG_ERROR("%s:%d: group needs a name",rules_file,line_number);
+    return -1;
+  }
+  if (rules_find_group(set,name,strlen(name))!=-1) {
+    LOG_ERROR("%s:%d: group '%s' is defined twice",rules_file,line_number,name);
+    return -1;
+  }
+  if (set->group_count>=MAX_GROUPS) {
+    LOG_ERROR("%s:%d: too many groups",rules_file,line_number);
+    return -1;
+  }
+  struct rule_group *g=&set->groups[set->group_count++];
+  snprintf(g->name,sizeof(g->name),"%s",name);
+
+  char member[64];
+  int n;
+  char *p=&line[offset];
+  while(sscanf(p,"%63s%n",member,&n)==1) {
+    p+=n;
+    if (g->member_count>=MAX_GROUP_MEMBERS) {
+      LOG_ERROR("%s:%d: too many members in group '%s'",rules_file,line_number,name);
+      return -1;
+    }
+    char *m=pool_strdup(&rules_member_pool,member);
+    if (!m) {
+      LOG_ERROR("%s:%d: '%s' is not a valid phone number",rules_file,line_number,member);
+      return -1;
+    }
+    g->members[g->member_count++]=m;
+  }
+  return 0;
+}
+
+// Parse a range such as 3, or 1-8, into first and last
+int rules_parse_range(const char *s, int *first, int *last)
+{
+  int n;
+  if (sscanf(s,"%d-%d%n",first,last,&n)==2&&!s[n]) return 0;
+  if (sscanf(s,"%d%n",first,&n)==1&&!s[n]) { *last=*first; return 0; }
+  return -1;
+}
+
+int rules_parse_time(const char *s, int *from, int *to)
+{
+  int h1,m1,h2,m2,n;
+  if (sscanf(s,"%d:%d-%d:%d%n",&h1,&m1,&h2,&m2,&n)!=4||s[n]) return -1;
+  if (h1<0||h1>24||h2<0||h2>24||m1<0||m1>59||m2<0||m2>59) return -1;
+  *from=h1*60+m1;
+  *to=h2*60+m2;
+  return 0;
+}
+
+int rules_parse_rule(struct rule_set *set, char *line, int line_number)
+{
+  if (set->rule_count>=MAX_RULES) {
+    LOG_ERROR("%s:%d: too many rules",rules_file,line_number);
+    return -1;
+  }
+  int r=set->rule_count;
+  struct rule *rule=&set->rules[r];
+  rule->armed=-1;
+  rule->siren=-1;
+  rule->from_minute=-1;
+  rule->to_minute=-1;
+  rule->groups=0;
+  rule->all=0;
+
+  int event=-1;
+  int first=-1,last=-1;
+  int have_keys=0;
+  char word[256];
+  int n;
+  char *p=&line[4];
+  while(sscanf(p,"%255s%n",word,&n)==1) {
+    p+=n;
+    char *value=strchr(word,'=');
+    if (!value) {
+      LOG_ERROR("%s:%d: expected name=value, not '%s'",rules_file,line_number,word);
+      return -1;
+    }
+    *value++=0;
+    int bad=0;
+    if ((!strcmp(word,"zone"))||(!strcmp(word,"partition"))) {
+      bad=rules_parse_range(value,&first,&last)||first<0||last>=RULE_KEYS||first>last;
+      have_keys=1;
+    } else if (!strcmp(word,"event")) {
+      for(event=0;event<RULE_EVENTS;event++)
+	if (!strcasecmp(value,rule_event_names[event])) break;
+      bad=(event==RULE_EVENTS);
+    } else if (!strcmp(word,"armed")) {
+      bad=sscanf(value,"%d",&rule->armed)!=1||rule->armed<0||rule->armed>1;
+    } else if (!strcmp(word,"siren")) {
+      bad=sscanf(value,"%d",&rule->siren)!=1||rule->siren<0||rule->siren>1;
+    } else if (!strcmp(word,"time")) {
+      bad=rules_parse_time(value,&rule->from_minute,&rule->to_minute);
+    } else if (!strcmp(word,"notify")) {
+      for(char *g=value;*g;) {
+	int len=strcspn(g,",");
+	if (len==3&&!strncmp(g,"all",3)) rule->all=1;
+	else {
+	  int group=rules_find_group(set,g,len);
+	  if (group==-1) {
+	    LOG_ERROR("%s:%d: unknown group '%.*s'",rules_file,line_number,len,g);
+	    return -1;
+	  }
+	  rule->groups|=1U<<group;
+	}
+	g+=len;
+	if (*g==',') g++;
+      }
+    } else {
+      LOG_ERROR("%s:%d: unknown condition '%s'",rules_file,line_number,word);
+      return -1;
+    }
+    if (bad) {
+      LOG_ERROR("%s:%d: invalid %s '%s'",rules_file,line_number,word,value);
+      return -1;
+    }
+  }
+
+  // A rule for a zone, without an event, is about that zone faulting
+  if (event==-1&&have_keys) event=RULE_ZONE_FAULT;
+  if (event==-1) {
+    LOG_ERROR("%s:%d: rule needs an event",rules_file,line_number);
+    return -1;
+  }
+  if ((!rule->groups)&&!rule->all) {
+    LOG_ERROR("%s:%d: rule doesn't notify anyone",rules_file,line_number);
+    return -1;
+  }
+  if (!have_keys) {
+    first=0;
+    last=RULE_KEYS-1;
+  }
+  for(int k=first;k<=last;k++) set->index[event][k]|=1ULL<<r;
+  set->rule_count++;
+  return 0;
+}
+
+/*
+  (Re)load the rules.  If there is anything wrong with the file, the rules
+  we already have are kept.  A missing file just means no rules.
+*/
+int rules_load(void)
+{
+  struct rule_set *set=(rules==&rule_sets[0])?&rule_sets[1]:&rule_sets[0];
+  rules_free(set);
+
+  FILE *f=fopen(rules_file,"r");
+  if (f) {
+    char line[1024];
+    int line_number=0;
+    int errors=0;
+    while(fgets(line,sizeof(line),f)) {
+      line_number++;
+      line[strcspn(line,"#\r\n")]=0;
+      char *p=line;
+      while(*p==' '||*p=='\t') p++;
+      if (!*p) continue;
+      if (!strncmp(p,"group ",6)) errors+=rules_parse_group(set,p,line_number)?1:0;
+      else if (!strncmp(p,"rule ",5)) errors+=rules_parse_rule(set,p,line_number)?1:0;
+      else {
+	LOG_ERROR("%s:%d: unrecognised line '%s'",rules_file,line_number,p);
+	errors++;
+      }
+    }
+    fclose(f);
+    if (errors) {
+      LOG_ERROR("%d error(s) in '%s', %s",errors,rules_file,
+		rules?"keeping the previous rules":"not using any rules");
+      rules_free(set);
+      return -1;
+    }
+  }
+
+  struct rule_set *old=rules;
+  rules=set;
+  if (old) rules_free(old);
+  LOG_NOTE("Loaded %d rules and %d groups from '%s'",set->rule_count,set->group_count,rules_file);
+  return 0;
+}
+
+/*
+  Find the rules that match an event.  Sets *groups to the groups to notify,
+  and *all if everyone should be.  Returns the number of rules that matched.
+*/
+int rules_match(int event, int key, int armed, int siren, time_t when,
+		unsigned int *groups, int *all)
+{
+  *groups=0;
+  *all=0;
+  if (!rules||event<0||event>=RULE_EVENTS||key<0||key>=RULE_KEYS) return 0;
+
+  unsigned long long candidates=rules->index[event][key];
+  if (!candidates) return 0;
+
+  struct tm tm;
+  localtime_r(&when,&tm);
+  int minute=tm.tm_hour*60+tm.tm_min;
+
+  int matched=0;
+  while(candidates) {
+    int r=__builtin_ctzll(candidates);
+    candidates&=candidates-1;
+    struct rule *rule=&rules->rules[r];
+    if (rule->armed!=-1&&rule->armed!=armed) continue;
+    if (rule->siren!=-1&&rule->siren!=siren) continue;
+    if (rule->from_minute!=-1) {
+      int in_window=(rule->from_minute<=rule->to_minute)
+	?(minute>=rule->from_minute&&minute<rule->to_minute)
+	:(minute>=rule->from_minute||minute<rule->to_minute);
+      if (!in_window) continue;
+    }
+    *groups|=rule->groups;
+    *all|=rule->all;
+    matched++;
+  }
+  return matched;
+}
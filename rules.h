@@ -0,0 +1,59 @@
+#ifndef __RULES_H__
+#define __RULES_H__
+
+#include <time.h>
+
+//
+// 'rules.h/.c' decide who should be told about each alarm event, from
+// routing rules loaded from a file, compiled into an index so that finding
+// the rules for an event doesn't depend on how many rules there are.
+//
+
+// Kinds of event.  Zone events are keyed by zone number, arm and disarm
+// events by partition number.
+#define RULE_ZONE_FAULT 0
+#define RULE_ZONE_NORMAL 1
+#define RULE_ARM 2
+#define RULE_DISARM 3
+#define RULE_SIREN 4
+#define RULE_EVENTS 5
+
+#define RULE_KEYS 64      // zones (or partitions) that rules can refer to
+#define MAX_RULES 64      // each rule is a bit in the index
+#define MAX_GROUPS 32
+#define MAX_GROUP_MEMBERS 64
+#define RULE_NAME_SIZE 32
+
+struct rule {
+  int armed;              // -1 if it doesn't matter
+  int siren;              // -1 if it doesn't matter
+  int from_minute;        // time of day, -1 if it doesn't matter
+  int to_minute;
+  unsigned int groups;    // bit for each group to notify
+  int all;                // notify everyone, as if there were no rules
+};
+
+struct rule_group {
+  char name[RULE_NAME_SIZE];
+  char *members[MAX_GROUP_MEMBERS];
+  int member_count;
+};
+
+struct rule_set {
+  struct rule rules[MAX_RULES];
+  int rule_count;
+  struct rule_group groups[MAX_GROUPS];
+  int group_count;
+  // For each event and key, a bit for each rule that applies
+  unsigned long long index[RULE_EVENTS][RULE_KEYS];
+};
+
+extern char rules_file[1024];
+extern struct rule_set *rules;
+
+int rules_load(void);
+int rules_match(int event, int key, int armed, int siren, time_t when,
+		unsigned int *groups, int *all);
+const char *rules_event_name(int event);
+
+#endif
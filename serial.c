@@ -22,13 +22,21 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <fcntl.h>
 #include <sys/uio.h>
 #include <sys/socket.h>
+#include <poll.h>
 #include <time.h>
 #include <termios.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <strings.h>
+#include <ctype.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
 
 #include "code_instrumentation.h"
+#include "serial.h"
 
 int set_nonblock(int fd)
 {
@@ -86,66 +94,394 @@ ssize_t read_nonblock(int fd, void *buf, size_t len)
   return nread;
 }
 
-ssize_t write_all(int fd, const void *buf, size_t len)
+/*
+  Buffered non-blocking output.
+
+  All of our fds are non-blocking, so a single write() can accept only part
+  of what we hand it, or nothing at all (EAGAIN) when a slow serial terminal
+  or busy modem has a full transmit buffer.  Rather than truncate replies, we
+  keep a small queue of pending chunks per fd.  write_all() tries to write
+  immediately if nothing is already queued, and queues whatever is left.
+  outq_poll_flush() is called from the main loop, and uses poll() to find
+  which fds can take more data, and then coalesces the queued chunks for each
+  such fd into a single writev().
+
+  Each fd is limited to OUTQ_MAX_BYTES of queued data.  A write that would
+  exceed this is refused in its entirety (and counted as dropped), so that a
+  stuck device can neither consume unbounded memory, nor cause us to send
+  half a message.
+*/
+
+#define OUTQ_MAX_FDS 32
+#define OUTQ_MAX_BYTES 65536
+#define OUTQ_MAX_IOV 64
+
+struct outq_chunk {
+  struct outq_chunk *next;
+  size_t len;
+  size_t offset;
+  char data[];
+};
+
+struct outq {
+  int fd;
+  size_t pending;
+  struct outq_chunk *head;
+  struct outq_chunk *tail;
+};
+
+struct outq outqs[OUTQ_MAX_FDS];
+int outq_count=0;
+
+// Totals across all fds, for reporting
+unsigned long long outq_bytes_queued=0;
+unsigned long long outq_bytes_written=0;
+unsigned long long outq_bytes_dropped=0;
+
+struct outq *outq_find(int fd,int create)
 {
-  ssize_t written = write(fd, buf, len);
-  if (written == -1)
-    { perror("write_all(): written == -1");
-      fprintf(stderr,"(fd=%d)\n",fd);
-      return -1; }
+  for(int i=0;i<outq_count;i++)
+    if (outqs[i].fd==fd) return &outqs[i];
+  if (!create) return NULL;
+  if (outq_count>=OUTQ_MAX_FDS) return NULL;
+  outqs[outq_count].fd=fd;
+  outqs[outq_count].pending=0;
+  outqs[outq_count].head=NULL;
+  outqs[outq_count].tail=NULL;
+  return &outqs[outq_count++];
+}
 
-  if ((size_t)written != len)
-    { perror("write_all(): written != len"); return -1; }
+void outq_discard(int fd)
+{
+  struct outq *q=outq_find(fd,0);
+  if (!q) return;
+  while(q->head) {
+    struct outq_chunk *c=q->head;
+    q->head=c->next;
+    outq_bytes_dropped+=c->len-c->offset;
+    free(c);
+  }
+  q->tail=NULL;
+  q->pending=0;
+}
 
-  if (0) fprintf(stderr,"write_all(%d) sent %d bytes.\n",
-		 (int)len,(int)written);
-  
+// Close an fd, first forgetting anything still queued for it, so that it
+// can't be written to whatever is next opened with the same fd number.
+int outq_close(int fd)
+{
+  if (fd==-1) return 0;
+  outq_discard(fd);
+  struct outq *q=outq_find(fd,0);
+  if (q) *q=outqs[--outq_count];
+  return close(fd);
+}
+
+size_t outq_pending(int fd)
+{
+  struct outq *q=outq_find(fd,0);
+  if (!q) return 0;
+  return q->pending;
+}
+
+// Sockets are written with MSG_NOSIGNAL, so that a client that has hung up
+// (e.g., a metrics scraper) gets us EPIPE, rather than a SIGPIPE that would
+// end the program.
+ssize_t outq_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+  struct msghdr msg={.msg_iov=(struct iovec *)iov,.msg_iovlen=iovcnt};
+  ssize_t written=sendmsg(fd,&msg,MSG_NOSIGNAL);
+  if (written==-1&&errno==ENOTSOCK) written=writev(fd,iov,iovcnt);
   return written;
 }
 
-int serial_setup_port_with_speed(int fd,int speed)
+// Write as much of the queue for this fd as the fd will accept.
+// Returns the number of bytes still pending, or -1 on error.
+ssize_t outq_flush(int fd)
+{
+  struct outq *q=outq_find(fd,0);
+  if (!q) return 0;
+
+  while(q->head) {
+    struct iovec iov[OUTQ_MAX_IOV];
+    int iovcnt=0;
+    for(struct outq_chunk *c=q->head;c&&iovcnt<OUTQ_MAX_IOV;c=c->next) {
+      iov[iovcnt].iov_base=&c->data[c->offset];
+      iov[iovcnt].iov_len=c->len-c->offset;
+      iovcnt++;
+    }
+    ssize_t written=outq_writev(fd,iov,iovcnt);
+    if (written==-1) {
+      if (errno==EINTR) continue;
+      if (errno==EAGAIN
+#if defined(EWOULDBLOCK) && EWOULDBLOCK != EAGAIN
+	  ||errno==EWOULDBLOCK
+#endif
+	  ) break;
+      perror("writev");
+      LOG_ERROR("Discarding %d queued bytes for fd %d after write error",
+		(int)q->pending,fd);
+      outq_discard(fd);
+      return -1;
+    }
+    outq_bytes_written+=written;
+    q->pending-=written;
+    // Release the chunks that were completely written
+    while(written>0&&q->head) {
+      struct outq_chunk *c=q->head;
+      size_t left=c->len-c->offset;
+      if ((size_t)written<left) {
+	c->offset+=written;
+	written=0;
+      } else {
+	written-=left;
+	q->head=c->next;
+	if (!q->head) q->tail=NULL;
+	free(c);
+      }
+    }
+  }
+  return q->pending;
+}
+
+// Flush every fd that has queued output and is writable, waiting at most
+// timeout_ms for any of them to become writable.  With nothing queued, this
+// simply sleeps for timeout_ms, so it can replace the idle sleep of the main
+// loop.
+int outq_poll_flush(int timeout_ms)
+{
+  struct pollfd fds[OUTQ_MAX_FDS];
+  int nfds=0;
+  for(int i=0;i<outq_count;i++)
+    if (outqs[i].pending) {
+      fds[nfds].fd=outqs[i].fd;
+      fds[nfds].events=POLLOUT;
+      fds[nfds].revents=0;
+      nfds++;
+    }
+  int r=poll(fds,nfds,timeout_ms);
+  if (r<1) return 0;
+  for(int i=0;i<nfds;i++) {
+    if (fds[i].revents&(POLLERR|POLLHUP|POLLNVAL)) {
+      LOG_WARN("fd %d can no longer be written to, discarding queued output",fds[i].fd);
+      outq_discard(fds[i].fd);
+    } else if (fds[i].revents&POLLOUT)
+      outq_flush(fds[i].fd);
+  }
+  return r;
+}
+
+ssize_t write_all(int fd, const void *buf, size_t len)
+{
+  struct outq *q=outq_find(fd,1);
+  if (!q) {
+    LOG_ERROR("No output queue available for fd %d",fd);
+    outq_bytes_dropped+=len;
+    return -1;
+  }
+
+  size_t written=0;
+  if (!q->head) {
+    // Nothing queued ahead of us, so try to send it straight away
+    while(written<len) {
+      struct iovec iov={.iov_base=(char *)buf+written,.iov_len=len-written};
+      ssize_t w=outq_writev(fd,&iov,1);
+      if (w==-1) {
+	if (errno==EINTR) continue;
+	if (errno==EAGAIN
+#if defined(EWOULDBLOCK) && EWOULDBLOCK != EAGAIN
+	    ||errno==EWOULDBLOCK
+#endif
+	    ) break;
+	perror("write_all(): written == -1");
+	fprintf(stderr,"(fd=%d)\n",fd);
+	return -1;
+      }
+      written+=w;
+      outq_bytes_written+=w;
+    }
+    if (written==len) return len;
+  }
+
+  // Queue the remainder, unless that would take us over the limit
+  size_t left=len-written;
+  if (!written&&(q->pending+left)>OUTQ_MAX_BYTES) {
+    LOG_WARN("Output queue for fd %d is full (%d bytes pending), dropping %d bytes",
+	     fd,(int)q->pending,(int)left);
+    outq_bytes_dropped+=left;
+    return -1;
+  }
+  struct outq_chunk *c=malloc(sizeof(struct outq_chunk)+left);
+  if (!c) {
+    LOG_ERROR("Could not allocate output queue chunk of %d bytes",(int)left);
+    outq_bytes_dropped+=left;
+    return -1;
+  }
+  c->next=NULL;
+  c->len=left;
+  c->offset=0;
+  memcpy(c->data,(const char *)buf+written,left);
+  if (q->tail) q->tail->next=c; else q->head=c;
+  q->tail=c;
+  q->pending+=left;
+  outq_bytes_queued+=left;
+
+  return len;
+}
+
+/*
+  Serial port profiles.
+
+  The NX584 link wants each byte delivered as soon as it arrives, so that
+  events are seen with the least delay, while the cellular modem wants
+  hardware flow control and a higher speed.  Rather than hard-code one
+  compromise, each input can be given a profile.
+*/
+
+struct serial_profile serial_profiles[]={
+  // name      speed  bits parity stop rtscts vmin vtime low_latency
+  {"default",  57600, 8,   'N',   1,   0,     1,   0,    0},
+  {"nx584",    9600,  8,   'N',   1,   0,     1,   0,    1},
+  {"modem",    115200,8,   'N',   1,   1,     1,   0,    0},
+  {"fast",     115200,8,   'N',   1,   0,     1,   0,    1},
+  {"",0,0,0,0,0,0,0,0}
+};
+
+int serial_find_profile(const char *name, struct serial_profile *p)
+{
+  for(int i=0;serial_profiles[i].name[0];i++)
+    if (!strcasecmp(serial_profiles[i].name,name)) {
+      *p=serial_profiles[i];
+      return 0;
+    }
+  return -1;
+}
+
+// Parse <name>[,<option>=<value>...] where the options are:
+//   baud=<bps>|auto, framing=8N1 (etc), rtscts=0|1, vmin=<n>, vtime=<n>,
+//   lowlatency=0|1
+int serial_parse_profile(const char *spec, struct serial_profile *p)
+{
+  char buf[256];
+  if (strlen(spec)>=sizeof(buf)) return -1;
+  strcpy(buf,spec);
+
+  char *saveptr=NULL;
+  char *tok=strtok_r(buf,",",&saveptr);
+  if (!tok) return -1;
+  if (serial_find_profile(tok,p)) {
+    LOG_ERROR("Unknown serial port profile '%s'",tok);
+    return -1;
+  }
+  while((tok=strtok_r(NULL,",",&saveptr))!=NULL) {
+    int n;
+    char parity;
+    if (!strcasecmp(tok,"baud=auto")) p->speed=0;
+    else if (sscanf(tok,"baud=%d",&n)==1) {
+      speed_t rate;
+      if (serial_baud_rate(n,&rate)) {
+	LOG_ERROR("Unsupported serial port speed '%s'",tok);
+	return -1;
+      }
+      p->speed=n;
+    }
+    else if (sscanf(tok,"framing=%d%c%d",&p->data_bits,&parity,&p->stop_bits)==3)
+      p->parity=toupper(parity);
+    else if (sscanf(tok,"rtscts=%d",&n)==1) p->rtscts=n;
+    else if (sscanf(tok,"vmin=%d",&n)==1) p->vmin=n;
+    else if (sscanf(tok,"vtime=%d",&n)==1) p->vtime=n;
+    else if (sscanf(tok,"lowlatency=%d",&n)==1) p->low_latency=n;
+    else {
+      LOG_ERROR("Unknown serial port profile option '%s'",tok);
+      return -1;
+    }
+  }
+  if (p->data_bits<5||p->data_bits>8
+      ||(p->parity!='N'&&p->parity!='E'&&p->parity!='O')
+      ||(p->stop_bits!=1&&p->stop_bits!=2)
+      ||p->vmin<0||p->vmin>255||p->vtime<0||p->vtime>255) {
+    LOG_ERROR("Invalid serial port profile '%s'",spec);
+    return -1;
+  }
+  snprintf(p->name,sizeof(p->name),"%s",spec);
+  return 0;
+}
+
+// The termios rate for a speed in bits per second, or -1 if the speed
+// isn't one we can set.
+int serial_baud_rate(int speed, speed_t *rate)
+{
+  switch(speed){
+  case 50: *rate=B50; break;
+  case 75: *rate=B75; break;
+  case 110: *rate=B110; break;
+  case 134: *rate=B134; break;
+  case 150: *rate=B150; break;
+  case 200: *rate=B200; break;
+  case 300: *rate=B300; break;
+  case 600: *rate=B600; break;
+  case 1200: *rate=B1200; break;
+  case 1800: *rate=B1800; break;
+  case 2400: *rate=B2400; break;
+  case 4800: *rate=B4800; break;
+  case 9600: *rate=B9600; break;
+  case 19200: *rate=B19200; break;
+  case 38400: *rate=B38400; break;
+  case 57600: *rate=B57600; break;
+  case 115200: *rate=B115200; break;
+  case 230400: *rate=B230400; break;
+  default: return -1;
+  }
+  return 0;
+}
+
+int serial_set_low_latency(int fd,int enable)
+{
+#ifdef __linux__
+  struct serial_struct ss;
+  if (ioctl(fd,TIOCGSERIAL,&ss)) return -1;
+  if (enable) ss.flags|=ASYNC_LOW_LATENCY;
+  else ss.flags&=~ASYNC_LOW_LATENCY;
+  if (ioctl(fd,TIOCSSERIAL,&ss)) return -1;
+  return 0;
+#else
+  return enable?-1:0;
+#endif
+}
+
+int serial_setup_port(int fd, struct serial_profile *p)
 {
   struct termios t;
 
-  tcgetattr(fd, &t);
+  if (tcgetattr(fd, &t)) {
+    perror("tcgetattr");
+    LOG_ERROR("fd %d does not look like a serial port",fd);
+    return -1;
+  }
   fprintf(stderr,"Serial port settings before tcsetaddr: c=%08x, i=%08x, o=%08x, l=%08x\n",
 	  (unsigned int)t.c_cflag,(unsigned int)t.c_iflag,
 	  (unsigned int)t.c_oflag,(unsigned int)t.c_lflag);
-	  
+
+  // Auto-baud starts at the highest rate we commonly see
   speed_t baud_rate;
-  switch(speed){
-  case 0: baud_rate = B0; break;
-  case 50: baud_rate = B50; break;
-  case 75: baud_rate = B75; break;
-  case 110: baud_rate = B110; break;
-  case 134: baud_rate = B134; break;
-  case 150: baud_rate = B150; break;
-  case 200: baud_rate = B200; break;
-  case 300: baud_rate = B300; break;
-  case 600: baud_rate = B600; break;
-  case 1200: baud_rate = B1200; break;
-  case 1800: baud_rate = B1800; break;
-  case 2400: baud_rate = B2400; break;
-  case 4800: baud_rate = B4800; break;
-  case 9600: baud_rate = B9600; break;
-  case 19200: baud_rate = B19200; break;
-  case 38400: baud_rate = B38400; break;
-  default:
-  case 57600: baud_rate = B57600; break;
-  case 115200: baud_rate = B115200; break;
-  case 230400: baud_rate = B230400; break;
-  }
-
-  // XXX Speed and options should be configurable
-  if (cfsetospeed(&t, baud_rate)) return -1;    
+  if (serial_baud_rate(p->speed?p->speed:115200,&baud_rate)) {
+    LOG_ERROR("Unsupported serial port speed %d in profile '%s'",p->speed,p->name);
+    return -1;
+  }
+  if (cfsetospeed(&t, baud_rate)) return -1;
   if (cfsetispeed(&t, baud_rate)) return -1;
 
-  // 8N1
-  t.c_cflag &= ~PARENB;
-  t.c_cflag &= ~CSTOPB;
-  t.c_cflag &= ~CSIZE;
-  t.c_cflag |= CS8;
-  t.c_cflag |= CLOCAL;
+  // Framing
+  t.c_cflag &= ~(PARENB | PARODD | CSTOPB | CSIZE);
+  switch(p->data_bits) {
+  case 5: t.c_cflag |= CS5; break;
+  case 6: t.c_cflag |= CS6; break;
+  case 7: t.c_cflag |= CS7; break;
+  default: t.c_cflag |= CS8; break;
+  }
+  if (p->parity=='E') t.c_cflag |= PARENB;
+  if (p->parity=='O') t.c_cflag |= PARENB | PARODD;
+  if (p->stop_bits==2) t.c_cflag |= CSTOPB;
+  t.c_cflag |= CLOCAL | CREAD;
 
   t.c_lflag &= ~(ICANON | ISIG | IEXTEN | ECHO | ECHOE);
   /* Noncanonical mode, disable signals, extended
@@ -157,29 +493,109 @@ int serial_setup_port_with_speed(int fd,int speed)
    No 8th-bit stripping or parity error handling.
    Disable START/STOP output flow control. */
   
-  // Disable CTS/RTS flow control
+  // CTS/RTS flow control
 #ifndef CNEW_RTSCTS
-  t.c_cflag &= ~CRTSCTS;
+  if (p->rtscts) t.c_cflag |= CRTSCTS; else t.c_cflag &= ~CRTSCTS;
 #else
-  t.c_cflag &= ~CNEW_RTSCTS;
+  if (p->rtscts) t.c_cflag |= CNEW_RTSCTS; else t.c_cflag &= ~CNEW_RTSCTS;
 #endif
 
   // no output processing
   t.c_oflag &= ~OPOST;
 
+  // Only matter to blocking reads: ours are non-blocking, and return
+  // whatever has arrived, so these are left for whoever opens the port next.
+  t.c_cc[VMIN]=p->vmin;
+  t.c_cc[VTIME]=p->vtime;
+
   fprintf(stderr,"Serial port settings attempting ot be set: c=%08x, i=%08x, o=%08x, l=%08x\n",
 	  (unsigned int)t.c_cflag,(unsigned int)t.c_iflag,
 	  (unsigned int)t.c_oflag,(unsigned int)t.c_lflag);
   
-  tcsetattr(fd, TCSANOW, &t);
+  if (tcsetattr(fd, TCSANOW, &t)) {
+    perror("tcsetattr");
+    LOG_ERROR("Could not apply serial port profile '%s' to fd %d",p->name,fd);
+    return -1;
+  }
 
-  tcgetattr(fd, &t);
+  // tcsetattr() succeeds if any of the changes could be made, so check
+  // that the ones that matter actually were.
+  struct termios actual;
+  tcgetattr(fd, &actual);
   fprintf(stderr,"Serial port settings after tcsetaddr: c=%08x, i=%08x, o=%08x, l=%08x\n",
-	  (unsigned int)t.c_cflag,(unsigned int)t.c_iflag,
-	  (unsigned int)t.c_oflag,(unsigned int)t.c_lflag);
+	  (unsigned int)actual.c_cflag,(unsigned int)actual.c_iflag,
+	  (unsigned int)actual.c_oflag,(unsigned int)actual.c_lflag);
+  if (cfgetospeed(&actual)!=baud_rate
+      ||(actual.c_cflag&(CSIZE|PARENB|PARODD|CSTOPB))!=(t.c_cflag&(CSIZE|PARENB|PARODD|CSTOPB))) {
+    LOG_ERROR("Serial port on fd %d did not accept profile '%s'",fd,p->name);
+    return -1;
+  }
 
+  if (serial_set_low_latency(fd,p->low_latency))
+    if (p->low_latency)
+      LOG_WARN("Serial driver for fd %d does not support the low latency flag",fd);
   
   set_nonblock(fd);
+
+  if (!p->speed) {
+    int speed=serial_autobaud(fd,p,"AT\r","OK");
+    if (speed<1) {
+      LOG_ERROR("Could not auto-detect the speed of fd %d",fd);
+      return -1;
+    }
+  }
   
   return 0;
 }
+
+int serial_setup_port_with_speed(int fd,int speed)
+{
+  struct serial_profile p;
+  serial_find_profile("default",&p);
+  p.speed=speed;
+  return serial_setup_port(fd,&p);
+}
+
+/*
+  Try each of the common speeds in turn, sending the probe string and
+  waiting briefly for the expected response.  The port is left at the first
+  speed that works, and that speed is recorded in the profile and returned.
+*/
+int serial_autobaud(int fd, struct serial_profile *p,
+		    const char *probe, const char *expect)
+{
+  int speeds[]={115200,57600,38400,19200,9600,230400,0};
+
+  for(int i=0;speeds[i];i++) {
+    struct termios t;
+    if (tcgetattr(fd,&t)) return -1;
+    speed_t rate;
+    if (serial_baud_rate(speeds[i],&rate)) continue;
+    cfsetospeed(&t,rate);
+    cfsetispeed(&t,rate);
+    if (tcsetattr(fd,TCSANOW,&t)) continue;
+    tcflush(fd,TCIOFLUSH);
+
+    if (write(fd,probe,strlen(probe))!=(ssize_t)strlen(probe)) continue;
+
+    // Allow ~250ms for a response
+    char reply[256];
+    int reply_len=0;
+    for(int tries=0;tries<25;tries++) {
+      struct pollfd pfd={.fd=fd,.events=POLLIN};
+      if (poll(&pfd,1,10)<1) continue;
+      ssize_t r=read_nonblock(fd,&reply[reply_len],sizeof(reply)-1-reply_len);
+      if (r>0) {
+	reply_len+=r;
+	reply[reply_len]=0;
+	if (strstr(reply,expect)) {
+	  LOG_NOTE("fd %d responds at %d bps",fd,speeds[i]);
+	  p->speed=speeds[i];
+	  return speeds[i];
+	}
+	if (reply_len>=(int)sizeof(reply)-1) break;
+      }
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,49 @@
+#ifndef __SERIAL_H__
+#define __SERIAL_H__
+
+#include <sys/types.h>
+#include <termios.h>
+
+//
+// 'serial.h/.c' provide non-blocking fd helpers, buffered output, and
+// setup of serial ports according to named port profiles.
+//
+
+// A serial port profile describes how a port should be configured.
+// Profiles are selected per input on the command line with
+// profile=<name>[,<option>=<value>...], e.g., profile=modem,baud=auto
+struct serial_profile {
+  char name[32];
+  int speed;        // bits per second, or 0 to auto-detect
+  int data_bits;    // 5 - 8
+  char parity;      // 'N', 'E' or 'O'
+  int stop_bits;    // 1 or 2
+  int rtscts;       // hardware flow control
+  int vmin;         // minimum bytes before a blocking read completes
+  int vtime;        // inter-byte timeout, in tenths of a second (ditto)
+  int low_latency;  // ask the driver to skip its receive batching (Linux)
+};
+
+int set_nonblock(int fd);
+int set_block(int fd);
+ssize_t read_nonblock(int fd, void *buf, size_t len);
+
+ssize_t write_all(int fd, const void *buf, size_t len);
+ssize_t outq_flush(int fd);
+size_t outq_pending(int fd);
+void outq_discard(int fd);
+int outq_close(int fd);
+int outq_poll_flush(int timeout_ms);
+extern unsigned long long outq_bytes_queued;
+extern unsigned long long outq_bytes_written;
+extern unsigned long long outq_bytes_dropped;
+
+int serial_find_profile(const char *name, struct serial_profile *p);
+int serial_parse_profile(const char *spec, struct serial_profile *p);
+int serial_baud_rate(int speed, speed_t *rate);
+int serial_setup_port(int fd, struct serial_profile *p);
+int serial_setup_port_with_speed(int fd, int speed);
+int serial_autobaud(int fd, struct serial_profile *p,
+		    const char *probe, const char *expect);
+
+#endif
@@ -0,0 +1,313 @@
+/*
+
+  NX584 modem interface to SMS controller
+  (C) Copyright Paul Gardner-Stephen 2018-2019
+
+  Outbound SMS scheduling.
+
+  Messages are queued rather than sent on the spot, so that:
+
+  1. An alarm notification never waits behind a flood of "say" messages.
+     Each message has a priority class, and the most urgent class that has
+     something ready always goes first.
+
+  2. We never ask the modem to send faster than it really can.  A token
+     bucket, refilled at smsq_rate messages per minute, and holding up to
+     smsq_burst tokens, decides when the next message may go.
+
+  3. A failed send (gammu returning non-zero) is retried, with exponential
+     backoff, instead of being silently lost.
+
+     Sends are handed to the modem pool (see modem.c), which runs them in
+     the background, on as many modems as there are, and tells us later
+     how each went.  The rate limit applies to each modem.
+
+  4. Identical messages to the same number that are still waiting to go
+     are only sent once.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "code_instrumentation.h"
+#include "clock.h"
+#include "gsm7.h"
+#include "handoff.h"
+#include "pool.h"
+#include "modem.h"
+#include "smsq.h"
+
+#define SMSQ_MAX_ENTRIES 512
+#define SMSQ_MAX_ATTEMPTS 5
+#define SMSQ_RETRY_BASE 5     // seconds before the first retry
+#define SMSQ_RETRY_MAX 300    // longest gap between retries
+
+struct smsq_entry {
+  int used;
+  int priority;
+  char phone_number[64];
+  char *text;
+  struct pool *text_pool;
+  int segments;
+  int attempts;
+  int modem;          // modem it is being sent on, or -1 if waiting
+  long long queued_ms;
+  time_t next_attempt;
+  unsigned long long sequence;
+};
+
+struct smsq_entry smsq_entries[SMSQ_MAX_ENTRIES];
+unsigned long long smsq_sequence=0;
+
+struct smsq_counters smsq_counters[SMSQ_CLASSES];
+
+// Most messages fit in a single segment, so only long ones take a big block
+struct pool smsq_short_texts=POOL_INIT("short SMS",GSM7_SINGLE_SEGMENT+1,32);
+struct pool smsq_long_texts=POOL_INIT("long SMS",SMSQ_MAX_TEXT,4);
+
+// Messages per minute, and how many may go back-to-back
+double smsq_rate=20;
+int smsq_burst=3;
+
+// Set to stop new sends starting, e.g., while handing over to a new process
+int smsq_hold=0;
+
+double smsq_tokens=-1;
+long long smsq_last_refill=0;
+
+const char *smsq_class_name(int priority)
+{
+  switch(priority) {
+  case SMSQ_ALARM: return "alarm";
+  case SMSQ_REPLY: return "reply";
+  default: return "info";
+  }
+}
+
+/*
+  Queue a message.  The text is normalised to the GSM 7-bit alphabet here,
+  so that identical messages can be recognised.  Returns the number of SMS
+  segments the message will take, 0 if an identical message was already
+  waiting, or -1 if it could not be queued.
+*/
+int smsq_send(const char *phone_number, const char *message, int priority)
+{
+  if (priority<0||priority>=SMSQ_CLASSES) priority=SMSQ_INFO;
+
+  char text[SMSQ_MAX_TEXT];
+  gsm7_normalise(message,text,sizeof(text));
+
+  int free_slot=-1;
+  for(int i=0;i<SMSQ_MAX_ENTRIES;i++) {
+    if (!smsq_entries[i].used) {
+      if (free_slot==-1) free_slot=i;
+      continue;
+    }
+    if (!strcmp(smsq_entries[i].phone_number,phone_number)
+	&&!strcmp(smsq_entries[i].text,text)) {
+      // Already waiting to go.  Make sure it goes at the higher priority.
+      if (priority<smsq_entries[i].priority) smsq_entries[i].priority=priority;
+      smsq_counters[priority].suppressed++;
+      LOG_NOTE("Not queueing duplicate %s message to %s",
+	       smsq_class_name(priority),phone_number);
+      return 0;
+    }
+  }
+  if (free_slot==-1) {
+    LOG_ERROR("SMS queue is full, dropping %s message to %s",
+	      smsq_class_name(priority),phone_number);
+    smsq_counters[priority].failed++;
+    return -1;
+  }
+
+  struct smsq_entry *e=&smsq_entries[free_slot];
+  e->text_pool=(strlen(text)<=GSM7_SINGLE_SEGMENT)?&smsq_short_texts:&smsq_long_texts;
+  e->text=pool_strdup(e->text_pool,text);
+  if (!e->text) {
+    LOG_ERROR("Could not allocate memory for SMS to %s",phone_number);
+    smsq_counters[priority].failed++;
+    return -1;
+  }
+  e->used=1;
+  e->priority=priority;
+  snprintf(e->phone_number,sizeof(e->phone_number),"%s",phone_number);
+  e->segments=gsm7_segments(text);
+  e->attempts=0;
+  e->modem=-1;
+  e->queued_ms=clock_ms();
+  e->next_attempt=0;
+  e->sequence=smsq_sequence++;
+  smsq_counters[priority].queued++;
+
+  return e->segments;
+}
+
+int smsq_pending(int priority)
+{
+  int count=0;
+  for(int i=0;i<SMSQ_MAX_ENTRIES;i++)
+    if (smsq_entries[i].used&&smsq_entries[i].priority==priority) count++;
+  return count;
+}
+
+// Hand a message to gammu on a modem.  Returns 0 if it was started.
+int smsq_transmit(struct smsq_entry *e, int modem)
+{
+  // Quote the characters that are special inside double quotes to the shell
+  char quoted[SMSQ_MAX_TEXT*2];
+  int len=0;
+  for(int i=0;e->text[i];i++) {
+    if (strchr("\"\\$",e->text[i])) quoted[len++]='\\';
+    quoted[len++]=e->text[i];
+  }
+  quoted[len]=0;
+
+  char args[SMSQ_MAX_TEXT*2+256];
+  // Without -autolen, gammu would truncate anything longer than one segment
+  if (e->segments>1)
+    snprintf(args,sizeof(args),"sendsms TEXT %s -autolen %d -text \"%s\"",
+	     e->phone_number,(int)strlen(e->text),quoted);
+  else
+    snprintf(args,sizeof(args),"sendsms TEXT %s -text \"%s\"",
+	     e->phone_number,quoted);
+  printf("[modem #%d: %s]\n",modem,args);
+  LOG_NOTE("Sending %d character %s message in %d segment(s) to %s via modem #%d",
+	   (int)strlen(e->text),smsq_class_name(e->priority),e->segments,e->phone_number,modem);
+  return modem_start(modem,args,e-smsq_entries);
+}
+
+// Deal with the outcome of an attempt to send a message.
+void smsq_finished(struct smsq_entry *e, int r)
+{
+  time_t now=clock_now();
+  e->modem=-1;
+  if (!r) {
+    struct smsq_counters *c=&smsq_counters[e->priority];
+    long long latency=clock_ms()-e->queued_ms;
+    c->sent++;
+    c->segments+=e->segments;
+    c->latency_ms_total+=latency;
+    if (latency>c->latency_ms_max) c->latency_ms_max=latency;
+  } else if (e->attempts<SMSQ_MAX_ATTEMPTS) {
+    int delay=SMSQ_RETRY_BASE<<(e->attempts-1);
+    if (delay>SMSQ_RETRY_MAX) delay=SMSQ_RETRY_MAX;
+    LOG_WARN("Sending %s message to %s failed (status %d), retrying in %d seconds",
+	     smsq_class_name(e->priority),e->phone_number,r,delay);
+    e->next_attempt=now+delay;
+    smsq_counters[e->priority].retries++;
+    return;
+  } else {
+    LOG_ERROR("Giving up on %s message to %s after %d attempts",
+	      smsq_class_name(e->priority),e->phone_number,e->attempts);
+    smsq_counters[e->priority].failed++;
+  }
+
+  pool_free(e->text_pool,e->text);
+  e->text=NULL;
+  e->used=0;
+}
+
+/*
+  Collect the results of finished sends, and start sending the next
+  messages, on as many modems as are free, if the rate limit allows.
+  Returns the number of messages started.
+*/
+int smsq_run(void)
+{
+  int job,status;
+  while(modem_reap(&job,&status)>=0)
+    if (job>=0&&job<SMSQ_MAX_ENTRIES&&smsq_entries[job].used)
+      smsq_finished(&smsq_entries[job],status);
+  if (smsq_hold) return 0;
+
+  // Each modem gets its own allowance
+  int modems=modem_up_count();
+  if (modems<1) modems=1;
+  long long now_ms=clock_ms();
+  if (smsq_tokens<0) {
+    smsq_tokens=smsq_burst;
+    smsq_last_refill=now_ms;
+  }
+  smsq_tokens+=(now_ms-smsq_last_refill)*smsq_rate*modems/60000.0;
+  if (smsq_tokens>smsq_burst*modems) smsq_tokens=smsq_burst*modems;
+  smsq_last_refill=now_ms;
+
+  int started=0;
+  time_t now=clock_now();
+  while(smsq_tokens>=1) {
+    int modem=modem_pick();
+    if (modem<0) break;
+
+    // Most urgent class first, then oldest first
+    struct smsq_entry *next=NULL;
+    for(int i=0;i<SMSQ_MAX_ENTRIES;i++) {
+      struct smsq_entry *e=&smsq_entries[i];
+      if (!e->used||e->modem!=-1||e->next_attempt>now) continue;
+      if (!next||e->priority<next->priority
+	  ||(e->priority==next->priority&&e->sequence<next->sequence))
+	next=e;
+    }
+    if (!next) break;
+
+    smsq_tokens-=1;
+    next->attempts++;
+    next->modem=modem;
+    if (smsq_transmit(next,modem)) {
+      smsq_finished(next,-1);
+      break;
+    }
+    started++;
+  }
+  return started;
+}
+
+void smsq_report(char *out, int max_len)
+{
+  int len=0;
+  out[0]=0;
+  for(int c=0;c<SMSQ_CLASSES;c++) {
+    snprintf(&out[len],max_len-len,
+	     "%s: %d waiting, %llu sent (%llu segments, %lldms avg, %lldms max), %llu retried, %llu failed, %llu duplicates.\n",
+	     smsq_class_name(c),smsq_pending(c),
+	     smsq_counters[c].sent,smsq_counters[c].segments,
+	     smsq_counters[c].sent?smsq_counters[c].latency_ms_total/(long long)smsq_counters[c].sent:0,
+	     smsq_counters[c].latency_ms_max,smsq_counters[c].retries,
+	     smsq_counters[c].failed,smsq_counters[c].suppressed);
+    len=strlen(out);
+  }
+  modem_report(&out[len],max_len-len);
+}
+
+long smsq_memory(void)
+{
+  return sizeof(smsq_entries)+pool_bytes(&smsq_short_texts)+pool_bytes(&smsq_long_texts);
+}
+
+// Write out the messages still waiting, one per line, for smsq_send() to
+// queue again in the process we are handing over to.
+void smsq_save(FILE *f)
+{
+  for(int p=0;p<SMSQ_CLASSES;p++)
+    for(int i=0;i<SMSQ_MAX_ENTRIES;i++) {
+      struct smsq_entry *e=&smsq_entries[i];
+      if (!e->used||e->priority!=p) continue;
+      fprintf(f,"sms %d %s ",e->priority,e->phone_number);
+      handoff_put_hex(f,e->text,strlen(e->text));
+      fprintf(f,"\n");
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef __SMSQ_H__
+#define __SMSQ_H__
+
+#include <stdio.h>
+
+//
+// 'smsq.h/.c' queue outgoing SMS, and send them in priority order, no faster
+// than the modem can actually manage, retrying any that fail.
+//
+
+// Priority classes, most urgent first
+#define SMSQ_ALARM 0
+#define SMSQ_REPLY 1
+#define SMSQ_INFO 2
+#define SMSQ_CLASSES 3
+
+// Longest message we will queue (about 13 segments)
+#define SMSQ_MAX_TEXT 2048
+
+struct smsq_counters {
+  unsigned long long queued;
+  unsigned long long sent;
+  unsigned long long segments;
+  unsigned long long retries;
+  unsigned long long failed;
+  unsigned long long suppressed;
+  long long latency_ms_total;  // queue-to-sent, over all sent messages
+  long long latency_ms_max;
+};
+
+extern struct smsq_counters smsq_counters[SMSQ_CLASSES];
+extern double smsq_rate;
+extern int smsq_burst;
+extern int smsq_hold;
+
+int smsq_send(const char *phone_number, const char *message, int priority);
+int smsq_run(void);
+int smsq_pending(int priority);
+const char *smsq_class_name(int priority);
+void smsq_report(char *out, int max_len);
+long smsq_memory(void);
+void smsq_save(FILE *f);
+
+#endif
@@ -0,0 +1,234 @@
+/*
+
+  NX584 modem interface to SMS controller
+  (C) Copyright Paul Gardner-Stephen 2018-2019
+
+  nx584_server supervision.
+
+  Rather than having nx584_server write its log to a file (on an SD card,
+  typically), only for us to read it straight back again, we can run
+  nx584_server ourselves, and read its output directly from a pipe.  If it
+  exits, we restart it, backing off exponentially if it keeps failing.
+
+  A copy of the output can optionally be kept in a log file, which is
+  rotated once it reaches a set size, so that it cannot fill the card.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+#include "code_instrumentation.h"
+#include "clock.h"
+#include "serial.h"
+#include "supervisor.h"
+
+// Restart delays double from the minimum up to the maximum, and return to
+// the minimum once the server has stayed up for SUPERVISOR_STABLE_TIME.
+#define SUPERVISOR_MIN_BACKOFF 1
+#define SUPERVISOR_MAX_BACKOFF 60
+#define SUPERVISOR_STABLE_TIME 60
+
+char supervisor_program[1024]="";
+char supervisor_serial_port[1024]="";
+char supervisor_tee_file[1024]="";
+long long supervisor_tee_max=1024*1024;
+int supervisor_restarts=0;
+
+pid_t supervisor_pid=-1;
+int supervisor_fd=-1;
+time_t supervisor_started=0;
+time_t supervisor_next_start=0;
+int supervisor_backoff=SUPERVISOR_MIN_BACKOFF;
+
+int supervisor_tee_fd=-1;
+long long supervisor_tee_size=0;
+
+int supervisor_enabled(void)
+{
+  return supervisor_program[0]!=0;
+}
+
+// Start nx584_server, returning the fd from which its output can be read.
+int supervisor_start(void)
+{
+  int retVal=-1;
+  LOG_ENTRY;
+
+  do {
+    if (!supervisor_serial_port[0]) {
+      LOG_ERROR("Don't know which serial port the NX584 is on, so can't start '%s'",
+		supervisor_program);
+      break;
+    }
+
+    int fds[2];
+    if (pipe(fds)) {
+      perror("pipe");
+      LOG_ERROR("Could not create pipe for nx584_server output");
+      break;
+    }
+
+    pid_t pid=fork();
+    if (pid==-1) {
+      perror("fork");
+      LOG_ERROR("Could not fork to run '%s'",supervisor_program);
+      close(fds[0]); close(fds[1]);
+      break;
+    }
+    if (!pid) {
+      // Child: send stdout and stderr into the pipe, and drop everything
+      // else we have open, especially the serial ports.
+#ifdef __linux__
+      prctl(PR_SET_PDEATHSIG,SIGTERM);
+#endif
+      dup2(fds[1],1);
+      dup2(fds[1],2);
+      for(int fd=3;fd<1024;fd++) close(fd);
+      // Python would otherwise buffer its output when writing to a pipe
+      setenv("PYTHONUNBUFFERED","1",1);
+      execl(supervisor_program,supervisor_program,
+	    "--serial",supervisor_serial_port,(char *)NULL);
+      perror("execl");
+      _exit(127);
+    }
+
+    close(fds[1]);
+    set_nonblock(fds[0]);
+    // Not for gammu and the like to inherit
+    fcntl(fds[0],F_SETFD,FD_CLOEXEC);
+    supervisor_pid=pid;
+    supervisor_fd=fds[0];
+    supervisor_started=clock_now();
+    LOG_NOTE("Started '%s --serial %s' as pid %d",
+	     supervisor_program,supervisor_serial_port,(int)pid);
+    retVal=fds[0];
+  } while(0);
+
+  LOG_EXIT;
+  return retVal;
+}
+
+/*
+  Check on the child, and restart it when it is due.  Returns 1 if the fd
+  from which its output should be read has changed (setting *fd_out to the
+  new fd, or -1 while the server is not running), or 0 otherwise.
+*/
+int supervisor_poll(int *fd_out)
+{
+  if (!supervisor_enabled()) return 0;
+
+  if (supervisor_pid!=-1) {
+    int status;
+    pid_t r=waitpid(supervisor_pid,&status,WNOHANG);
+    if (r!=supervisor_pid) return 0;
+
+    if (WIFEXITED(status))
+      LOG_WARN("nx584_server exited with status %d",WEXITSTATUS(status));
+    else if (WIFSIGNALED(status))
+      LOG_WARN("nx584_server was killed by signal %d",WTERMSIG(status));
+
+    if ((clock_now()-supervisor_started)>=SUPERVISOR_STABLE_TIME)
+      supervisor_backoff=SUPERVISOR_MIN_BACKOFF;
+    supervisor_next_start=clock_now()+supervisor_backoff;
+    LOG_NOTE("Restarting nx584_server in %d seconds",supervisor_backoff);
+    supervisor_backoff*=2;
+    if (supervisor_backoff>SUPERVISOR_MAX_BACKOFF)
+      supervisor_backoff=SUPERVISOR_MAX_BACKOFF;
+    supervisor_pid=-1;
+    // The pipe stays open until the restart, so that we still read
+    // whatever the server wrote before it died.
+    return 0;
+  }
+
+  if (clock_now()<supervisor_next_start) return 0;
+
+  int changed=0;
+  if (supervisor_fd!=-1) {
+    outq_close(supervisor_fd);
+    supervisor_fd=-1;
+    changed=1;
+  }
+  int fd=supervisor_start();
+  if (fd==-1) {
+    supervisor_next_start=clock_now()+supervisor_backoff;
+    *fd_out=-1;
+    return changed;
+  }
+  if (supervisor_next_start) supervisor_restarts++;
+  *fd_out=fd;
+  return 1;
+}
+
+/*
+  Stop nx584_server, e.g., before handing over to a new process (it can't
+  outlive us, see PR_SET_PDEATHSIG above).  Returns the fd from which the
+  rest of its output can still be read, which is now the caller's to close.
+*/
+int supervisor_stop(void)
+{
+  if (supervisor_pid!=-1) {
+    LOG_NOTE("Stopping nx584_server (pid %d)",(int)supervisor_pid);
+    kill(supervisor_pid,SIGTERM);
+    waitpid(supervisor_pid,NULL,0);
+    supervisor_pid=-1;
+  }
+  int fd=supervisor_fd;
+  supervisor_fd=-1;
+  return fd;
+}
+
+// Keep a copy of a line of server output in the (size-capped) log file.
+void supervisor_tee(const char *line)
+{
+  if (!supervisor_tee_file[0]) return;
+
+  if (supervisor_tee_fd!=-1&&supervisor_tee_size>=supervisor_tee_max) {
+    char old[1100];
+    snprintf(old,sizeof(old),"%s.1",supervisor_tee_file);
+    close(supervisor_tee_fd);
+    supervisor_tee_fd=-1;
+    if (rename(supervisor_tee_file,old)) {
+      perror("rename");
+      LOG_WARN("Could not rotate '%s'",supervisor_tee_file);
+    }
+  }
+  if (supervisor_tee_fd==-1) {
+    supervisor_tee_fd=open(supervisor_tee_file,O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC,0644);
+    if (supervisor_tee_fd==-1) {
+      perror("open");
+      LOG_ERROR("Could not open '%s', so no longer logging nx584_server output",
+		supervisor_tee_file);
+      supervisor_tee_file[0]=0;
+      return;
+    }
+    supervisor_tee_size=lseek(supervisor_tee_fd,0,SEEK_END);
+  }
+
+  int len=strlen(line);
+  if (write(supervisor_tee_fd,line,len)==len&&write(supervisor_tee_fd,"\n",1)==1)
+    supervisor_tee_size+=len+1;
+}
@@ -0,0 +1,23 @@
+#ifndef __SUPERVISOR_H__
+#define __SUPERVISOR_H__
+
+#include <sys/types.h>
+
+//
+// 'supervisor.h/.c' run nx584_server as a child process, with its output
+// coming to us through a pipe, and restart it if it dies.
+//
+
+extern char supervisor_program[1024];
+extern char supervisor_serial_port[1024];
+extern char supervisor_tee_file[1024];
+extern long long supervisor_tee_max;
+extern int supervisor_restarts;
+
+int supervisor_enabled(void);
+int supervisor_start(void);
+int supervisor_poll(int *fd_out);
+int supervisor_stop(void);
+void supervisor_tee(const char *line);
+
+#endif
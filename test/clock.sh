@@ -0,0 +1,110 @@
+#!/bin/bash
+#
+# Run nx584-sms on a simulated clock through scripted scenarios, and check
+# that it sends what it should, when it should.
+#
+# Each scenario is test/clock/<name>.script, whose lines are typed at
+# nx584-sms one at a time (nx584_server log lines, and commands such as
+# advance 10), except for:
+#
+#   conf <line>          a line of the config file (before anything else)
+#   rules <line>         a line of the rules file (ditto)
+#   args <arguments>     more arguments for nx584-sms (ditto)
+#   sms <number> <text>  an SMS received from a user, picked up on the
+#                        next poll, which is once a simulated second
+#   fail <n>             make the next n sends fail
+#
+# What nx584-sms did, and when (in simulated seconds from the start, which
+# is 2026-10-18 09:00:00 UTC), is compared with test/clock/<name>.expected,
+# and any difference fails the test.  With UPDATE=1 in the environment,
+# the .expected files are written instead, to be checked by hand.
+#
+#   test/clock.sh [name ...]
+#
+
+set -u
+here=$(cd "$(dirname "$0")" && pwd)
+binary=${NX584_SMS:-$here/../nx584-sms}
+start=1792314000
+export TZ=UTC
+
+. "$here/lib.sh"
+
+# Wait until nx584-sms has dealt with everything typed at it so far, and
+# any gammu it started has finished and been reaped.
+settle()
+{
+    local n
+    for n in 1 2 3; do
+	wait_for 30 "[ -z \"\$(pgrep -P $daemon)\" ]" || fail "gammu did not finish"
+	stats
+    done
+}
+
+# The sends, retries, escalations and acknowledgements in the log, with
+# when they happened
+events()
+{
+    awk -v start_day=18 '
+	/^[A-Z][a-z][a-z] [A-Z][a-z][a-z] +[0-9]+ [0-9:]+ [0-9]+: / {
+	    split($4,t,":")
+	    when=($3-start_day)*86400+(t[1]-9)*3600+t[2]*60+t[3]
+	    next
+	}
+	/^  Sending [0-9]+ character .* message in / {
+	    print "+" when "s send " $4 " to " $10; next
+	}
+	/^  Sending .* failed \(status/ {
+	    print "+" when "s failed " $2 " to " $5 ", retry in " $(NF-1) "s"; next
+	}
+	/^  Giving up on / { print "+" when "s gave up on " $4 " to " $7; next }
+	/^  Alarm notification sent to / {
+	    print "+" when "s alarm to " $5 " users in tier(s) " $9; next
+	}
+	/^  Alarm not acknowledged after / { print "+" when "s escalate to tier " $NF; next }
+	/^  Alarm acknowledged by / { print "+" when "s acknowledged by " $4; next }
+	/^  Ignoring command from / { sub(/,$/,"",$4); print "+" when "s throttled " $4; next }
+    ' "$dir/daemon.log"
+}
+
+run_scenario()
+{
+    local name=$1 script=$here/clock/$1.script expected=$here/clock/$1.expected
+    local args=() line started=
+    test_setup "clock-$name"
+    : >"$dir/conf"
+    while IFS= read -r line; do
+	case "$line" in
+	''|'#'*) continue ;;
+	'conf '*) echo "${line#conf }" >>"$dir/conf"; continue ;;
+	'rules '*) echo "${line#rules }" >>"$dir/rules"; continue ;;
+	'args '*) read -r -a more <<<"${line#args }"; args+=("${more[@]}"); continue ;;
+	esac
+	if [ -z "$started" ]; then
+	    daemon_start clock=sim@$start "${args[@]}" -
+	    started=1
+	fi
+	case "$line" in
+	'sms '*) line=${line#sms }; sms_receive "${line%% *}" "${line#* }" ;;
+	'fail '*) echo "${line#fail }" >"$dir/gammu.fail" ;;
+	*) send_line "$line"; settle ;;
+	esac
+    done <"$script"
+    settle
+    if [ -n "${UPDATE:-}" ]; then
+	events >"$expected"
+    elif ! events | diff -u "$expected" - >"$dir/diff"; then
+	cat "$dir/diff"
+	fail "what was sent differs from $expected"
+    fi
+    test_pass
+}
+
+if [ $# -eq 0 ]; then
+    set -- $(cd "$here/clock" && ls *.script | sed 's/\.script$//')
+fi
+failed=0
+for name in "$@"; do
+    ( run_scenario "$name" ) || failed=1
+done
+exit $failed
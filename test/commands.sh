@@ -0,0 +1,37 @@
+#!/bin/bash
+#
+# Check that when users with different roles ask for the same page of help in the same
+# poll, each is only told about the commands they may use, rather than
+# everyone being sent the answer worked out for whoever asked first.
+#
+#   test/commands.sh
+#
+
+set -u
+here=$(cd "$(dirname "$0")" && pwd)
+binary=${NX584_SMS:-$here/../nx584-sms}
+
+. "$here/lib.sh"
+test_setup commands
+echo "user +61400000001" >>"$dir/conf"
+echo "user +61400000002" >>"$dir/conf"
+
+# The admin asks first, so that their answer would be the one shared.  The
+# first page is the same for everyone, but the second lists admin commands.
+sms_receive +61400000000 help2
+sms_receive +61400000001 help2
+sms_receive +61400000002 help2
+daemon_start "$log" -
+
+wait_for 10 "[ \$(grep -c ' sendsms .* Valid commands' '$dir/gammu.log') -ge 3 ]" \
+    || fail "not everyone was answered: $(cat "$dir/gammu.log")"
+grep -q ' sendsms +61400000000 Valid commands: .* say <' "$dir/gammu.log" \
+    || fail "the admin was not told about the admin commands"
+for user in +61400000001 +61400000002; do
+    grep -q " sendsms $user Valid commands: " "$dir/gammu.log" || fail "$user was not answered"
+    ! grep -q " sendsms $user .* say <" "$dir/gammu.log" || fail "$user was told about the admin commands"
+done
+stats
+echo "Help sent for each role, with $(stat_value ' \([0-9]*\) coalesced') answer(s) shared between users"
+[ "$(stat_value ' \([0-9]*\) coalesced')" -ge 1 ] || fail "the users did not share a reply"
+test_pass
@@ -0,0 +1,75 @@
+#!/bin/bash
+#
+# Check that restarting nx584-sms with SIGUSR2 loses nothing: a log is
+# written continuously while it is handed over several times, and every
+# line must be read exactly once, by one process or another.  Then the
+# same is done with nx584_server run by nx584-sms, which must not use up
+# an input each time.
+#
+#   test/handover.sh [restarts]
+#
+
+set -u
+here=$(cd "$(dirname "$0")" && pwd)
+binary=${NX584_SMS:-$here/../nx584-sms}
+restarts=${1:-5}
+
+. "$here/lib.sh"
+test_setup handover
+
+# Hand over from whichever process is running now, and wait for the new one
+hand_over()
+{
+    local before
+    before=$(grep -c "Handed over to pid" "$dir/daemon.log")
+    kill -USR2 "$current"
+    wait_for 15 "[ \$(grep -c 'Handed over to pid' '$dir/daemon.log') -gt $before ]" \
+	|| fail "nx584-sms did not hand over"
+    current=$(sed -n 's/.*Handed over to pid \([0-9]*\) in .*/\1/p' "$dir/daemon.log" | tail -n 1)
+}
+
+# The numbers of the lines read so far, in the order read
+lines_read()
+{
+    sed -n "s|.*Have line of input from '$1': .*#\([0-9]*\)).*|\1|p" "$dir/daemon.log"
+}
+
+daemon_start "$log"
+current=$daemon
+lines=3000
+"$here/fake_nx584_server" --numbered --events $lines --rate 1000 --output "$log" &
+writer=$!
+for n in $(seq 1 "$restarts"); do
+    sleep 0.3
+    hand_over
+done
+wait $writer
+wait_for 30 "[ \$(lines_read '$log' | wc -l) -ge $lines ]"
+sleep 0.5
+read_lines=$(lines_read "$log" | sort -n | uniq | wc -l)
+total=$(lines_read "$log" | wc -l)
+echo "$lines lines written during $restarts restarts: $read_lines read, $((total - read_lines)) read twice"
+[ "$read_lines" -eq "$lines" ] || fail "$((lines - read_lines)) lines were lost"
+[ "$total" -eq "$lines" ] || fail "$((total - lines)) lines were read twice"
+[ "$(lines_read "$log" | sort -n -c 2>&1 | wc -l)" -eq 0 ] || fail "lines were read out of order"
+kill "$current"
+
+# Now with nx584-sms running nx584_server, whose output pipe is handed over
+# each time, and ends when the old nx584_server is stopped
+: >"$dir/daemon.log"
+daemon_start nx584_server="$here/fake_nx584_server" nx584_serial=/dev/null
+current=$daemon
+for n in $(seq 1 $((restarts * 4))); do
+    # Once the new process has read the rest of what the old nx584_server
+    # wrote, it should let go of its pipe
+    wait_for 10 "[ \$(grep -c \"'nx584_server' has ended\" '$dir/daemon.log') -ge $((n - 1)) ]" \
+	|| fail "the old nx584_server's output was kept after it had ended"
+    hand_over
+done
+! grep -q "More inputs were handed over than we can use" "$dir/daemon.log" \
+    || fail "inputs were used up by handing over"
+inputs=$(sed -n 's/.*Took over \([0-9]*\) inputs.*/\1/p' "$dir/daemon.log" | sort -n | tail -n 1)
+echo "$((restarts * 4)) restarts with nx584_server: at most $inputs inputs taken over"
+[ "$inputs" -eq 1 ] || fail "$inputs inputs were taken over, as old nx584_server output is kept"
+kill "$current"
+test_pass
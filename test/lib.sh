@@ -0,0 +1,144 @@
+#
+# Shared by the test scripts: runs nx584-sms in a scratch directory, with
+# the stub gammu and nx584_client, and its stdin on a fifo, so that a test
+# can type commands at it and read back what it says.
+#
+
+# Set up a scratch directory for a test, in $dir, and a log in $log
+test_setup()
+{
+    test_name=$1
+    dir=$(mktemp -d "/tmp/nx584-$test_name.XXXXXX")
+    log=$dir/alarm.log
+    export NX584_TEST_DIR=$dir
+    export NX584_TEST_LOG=$log
+    export PATH=$here/bin:$PATH
+    mkdir -p "$dir/inbox"
+    : >"$log"
+    : >"$dir/gammu.log"
+    : >"$dir/rules"
+    echo "admin +61400000000" >"$dir/conf"
+    daemon=
+    trap test_cleanup EXIT
+}
+
+test_cleanup()
+{
+    exec 3>&- 2>/dev/null
+    if [ -n "$daemon" ]; then kill "$daemon" 2>/dev/null; wait "$daemon" 2>/dev/null; fi
+    if [ -z "${KEEP:-}" ]; then rm -rf "$dir"; else echo "Test files kept in $dir"; fi
+}
+
+fail()
+{
+    echo "FAIL: $test_name: $*"
+    echo "--- last lines of $dir/daemon.log:"
+    tail -n 20 "$dir/daemon.log" 2>/dev/null
+    exit 1
+}
+
+test_pass()
+{
+    echo "PASS: $test_name"
+    exit 0
+}
+
+now_ms()
+{
+    date +%s%3N
+}
+
+# wait_for <seconds> <shell condition>
+wait_for()
+{
+    local end=$(($(now_ms) + $1 * 1000))
+    while ! eval "$2"; do
+	[ "$(now_ms)" -lt "$end" ] || return 1
+	sleep 0.05
+    done
+    return 0
+}
+
+# Start nx584-sms with the scratch config and stubs, plus the given
+# arguments, and wait for it to be running.
+daemon_start()
+{
+    local started
+    started=$(grep -c 'NX584 SMS gateway running' "$dir/daemon.log" 2>/dev/null)
+    rm -f "$dir/stdin"
+    mkfifo "$dir/stdin"
+    "$binary" conf="$dir/conf" rules="$dir/rules" checkpoint="$dir/state" probecache= \
+	      smsfile="$dir/sms.txt" nx584_client="$here/bin/nx584_client" \
+	      "$@" <"$dir/stdin" >>"$dir/daemon.log" 2>&1 &
+    daemon=$!
+    exec 3>"$dir/stdin"
+    wait_for 10 "[ \$(grep -c 'NX584 SMS gateway running' '$dir/daemon.log') -gt ${started:-0} ]" \
+	|| fail "nx584-sms did not start"
+}
+
+# Stop nx584-sms the way an init system would, so that it saves its state
+daemon_stop()
+{
+    exec 3>&-
+    kill -TERM "$daemon"
+    wait "$daemon"
+    daemon=
+}
+
+# Type a line at nx584-sms
+send_line()
+{
+    echo "$*" >&3
+}
+
+# Have a user send an SMS, for the stub gammu to hand over on the next poll
+sms_number=0
+sms_receive()
+{
+    sms_number=$((sms_number + 1))
+    local name
+    name=$(printf '%08d' $sms_number)
+    echo "$1 $2" >"$dir/inbox/.$name"
+    mv "$dir/inbox/.$name" "$dir/inbox/$name.sms"
+}
+
+responses()
+{
+    grep -c "DEBUG: Responding with '$1" "$dir/daemon.log"
+}
+
+# Ask for the stats, and keep the answer in $dir/stats
+stats()
+{
+    local before
+    before=$(responses Up)
+    send_line stats
+    wait_for 10 "[ \$(responses Up) -gt $before ]" || fail "no answer to the stats command"
+    awk '/DEBUG: Responding with .Up / { n++; block=""; keep=1 }
+	 keep { block=block $0 "\n" }
+	 keep && /^'"'"'$/ { keep=0; last=block }
+	 END { printf "%s", last }' "$dir/daemon.log" >"$dir/stats"
+}
+
+# A number from the last stats, picked out with a sed pattern
+stat_value()
+{
+    sed -n "s/.*$1.*/\\1/p" "$dir/stats" | head -n 1
+}
+
+# Wait until nx584-sms has read the given number of log lines
+wait_for_log_lines()
+{
+    local end=$(($(now_ms) + $2 * 1000))
+    while true; do
+	stats
+	[ "$(stat_value 'Lines: \([0-9]*\) log')" -ge "$1" ] && return 0
+	[ "$(now_ms)" -lt "$end" ] || return 1
+	sleep 0.1
+    done
+}
+
+rss_kb()
+{
+    awk '/^VmRSS:/ { print $2 }' "/proc/$daemon/status"
+}
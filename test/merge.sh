@@ -0,0 +1,64 @@
+#!/bin/bash
+#
+# Check how lines from several logs are put in order: a line waits for
+# another log that is still being written, but not for one that has gone
+# quiet, and lines typed on stdin never wait for the logs, even on a
+# simulated clock.
+#
+#   test/merge.sh
+#
+
+set -u
+here=$(cd "$(dirname "$0")" && pwd)
+binary=${NX584_SMS:-$here/../nx584-sms}
+
+. "$here/lib.sh"
+test_setup merge
+other=$dir/other.log
+: >"$other"
+
+# The zones acted on, in order
+zones_seen()
+{
+    sed -n 's/.*Saw controller state message: Zone \([0-9]*\) .*/\1/p' "$dir/daemon.log" \
+	| awk '{ printf " %s", $0 } END { printf " " }'
+}
+
+# How long it takes for a zone change to be acted on
+time_zone()
+{
+    local start
+    start=$(now_ms)
+    echo "$(date '+%Y-%m-%d %H:%M:%S,000') controller INFO Zone $2 (Zone $2) state is FAULT" >>"$1"
+    wait_for 10 "zones_seen | grep -q ' $2 '" || fail "zone $2 was not acted on"
+    echo $(($(now_ms) - start))
+}
+
+daemon_start merge_ms=2000 "$log" "$other"
+
+# While the other log is being written, a later line from this one waits
+# for it to catch up
+now=$(date '+%Y-%m-%d %H:%M:%S')
+echo "$now,000 controller INFO Zone 1 (One) state is FAULT" >>"$other"
+sleep 0.2
+echo "$now,300 controller INFO Zone 3 (Three) state is FAULT" >>"$log"
+sleep 0.2
+echo "$now,200 controller INFO Zone 2 (Two) state is FAULT" >>"$other"
+echo "$now,400 controller INFO Zone 4 (Four) state is FAULT" >>"$other"
+wait_for 10 "[ \"\$(zones_seen)\" = ' 1 2 3 4 ' ]" || fail "zones were acted on in the order $(zones_seen)"
+
+# Once it has been quiet for merge_ms, lines don't wait for it
+sleep 2.5
+took=$(time_zone "$log" 5)
+echo "A line with the other log quiet was acted on after ${took}ms"
+[ "$took" -lt 1000 ] || fail "a line waited ${took}ms for a log that had gone quiet"
+daemon_stop
+
+# Lines typed on stdin don't wait for the log, although time stands still
+daemon_start clock=sim merge_ms=2000 "$log" -
+echo "2026-10-18 09:00:00,000 controller INFO Zone 9 (Nine) state is FAULT" >>"$log"
+start=$(now_ms)
+send_line "2026-10-18 09:00:01,000 controller INFO Zone 7 (Seven) state is FAULT"
+wait_for 10 "zones_seen | grep -q ' 7 '" || fail "a line typed on stdin was held"
+echo "A line typed on stdin with clock=sim was acted on after $(($(now_ms) - start))ms"
+test_pass
@@ -0,0 +1,51 @@
+#!/bin/bash
+#
+# Check that the metrics are served on metrics_port, and that scrapers that
+# send a request and go away without reading the answer are shrugged off,
+# rather than taking the program (and alarm monitoring) down with them.
+#
+#   test/metrics.sh
+#
+
+set -u
+here=$(cd "$(dirname "$0")" && pwd)
+binary=${NX584_SMS:-$here/../nx584-sms}
+
+. "$here/lib.sh"
+test_setup metrics
+
+port=$(python3 -c 'import socket; s=socket.socket(); s.bind(("127.0.0.1",0)); print(s.getsockname()[1])')
+daemon_start metrics_port="$port" "$log"
+
+# GET /metrics, and hang up at once
+python3 - "$port" <<'PY'
+import socket, sys, time
+for n in range(50):
+    try:
+        s = socket.create_connection(("127.0.0.1", int(sys.argv[1])))
+    except OSError:
+        break
+    s.sendall(b"GET /metrics HTTP/1.0\r\n\r\n")
+    s.close()
+    time.sleep(0.01)
+PY
+sleep 1
+kill -0 "$daemon" 2>/dev/null || { wait "$daemon"; fail "nx584-sms exited with status $? after scrapers hung up"; }
+
+# and it still answers a well-behaved scraper
+python3 - "$port" >"$dir/scrape" <<'PY' || fail "could not scrape the metrics"
+import socket, sys
+s = socket.create_connection(("127.0.0.1", int(sys.argv[1])), timeout=5)
+s.sendall(b"GET /metrics HTTP/1.0\r\n\r\n")
+reply = b""
+while True:
+    data = s.recv(65536)
+    if not data:
+        break
+    reply += data
+sys.stdout.write(reply.decode())
+PY
+grep -q '^HTTP/1.0 200 OK' "$dir/scrape" && grep -q '^nx584_' "$dir/scrape" \
+    || fail "the metrics were not served: $(head -n 3 "$dir/scrape")"
+echo "Served $(grep -c '^nx584_' "$dir/scrape") metrics after 50 scrapers hung up early"
+test_pass
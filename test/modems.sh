@@ -0,0 +1,84 @@
+#!/bin/bash
+#
+# Check that nx584-sms tells modems from the NX584 when probing its serial
+# ports, and that alarms are shared out between several modems, and go
+# around one that stops working.  The devices are ptys answered by
+# fake_modem, and gammu is the stub from test/bin, which takes a second
+# per send.
+#
+#   test/modems.sh
+#
+
+set -u
+here=$(cd "$(dirname "$0")" && pwd)
+binary=${NX584_SMS:-$here/../nx584-sms}
+
+. "$here/lib.sh"
+test_setup modems
+
+# The gammu config files go in the scratch directory, where we can see them
+export TMPDIR=$dir
+export NX584_TEST_GAMMU_DELAY=1
+
+for i in $(seq -w 0 11); do
+    if [ "$i" = 00 ]; then echo "admin +614000000$i"; else echo "user +614000000$i"; fi
+done >"$dir/conf"
+echo "rule zone=5 event=fault notify=all" >"$dir/rules"
+
+"$here/fake_modem" --modems 3 --echo --nx584 >"$dir/devices" &
+fake=$!
+trap 'kill $fake 2>/dev/null; test_cleanup' EXIT
+wait_for 10 "[ \$(wc -l <'$dir/devices') -eq 4 ]" || fail "fake_modem did not start"
+modems=$(awk '$1=="modem" { print $2 }' "$dir/devices")
+nx584=$(awk '$1=="nx584" { print $2 }' "$dir/devices")
+
+sent()
+{
+    grep -c " sendsms +614000000.. UNEXPECTED ALARM" "$dir/gammu.log"
+}
+
+# Queued sends shouldn't wait for the rate limit
+start_alarm_daemon()
+{
+    daemon_start "$log" escalate=0 smsrate=600 smsburst=100 probe_timeout=300 $modems $nx584 -
+}
+
+start_alarm_daemon
+grep -q "'$nx584' is the NX584 serial interface" "$dir/daemon.log" || fail "the NX584 was not found"
+for m in $modems; do
+    grep -q "Using '$m' as modem #" "$dir/daemon.log" || fail "$m was not found to be a modem"
+done
+configs=$(ls "$dir"/nx584-sms-modem* 2>/dev/null | wc -l)
+[ "$configs" -eq 3 ] || fail "$configs gammu config files were written, not 3"
+for c in "$dir"/nx584-sms-modem*; do
+    [ "$(stat -c %a "$c")" = 600 ] || fail "$c can be read by others"
+done
+
+# 12 sends of a second each, over three modems
+start=$(now_ms)
+echo "2026-10-18 09:00:00,000 controller INFO Zone 5 (Office) state is FAULT" >>"$log"
+wait_for 20 "[ \$(sent) -eq 12 ]" || fail "only $(sent) of 12 alarms were sent"
+took=$(($(now_ms) - start))
+echo "12 alarms sent through 3 modems in ${took}ms"
+[ "$took" -lt 8000 ] || fail "sending took ${took}ms, as though the modems weren't used at once"
+for m in $modems; do
+    [ "$(grep -c " $m sendsms " "$dir/gammu.log")" -ge 2 ] || fail "$m was hardly used"
+done
+
+daemon_stop
+configs=$(ls "$dir"/nx584-sms-modem* 2>/dev/null | wc -l)
+[ "$configs" -eq 0 ] || fail "$configs gammu config files were left behind"
+
+# The first modem stops working: it should be taken out of use, and the
+# others carry on
+: >"$dir/gammu.log"
+broken=$(echo "$modems" | head -n 1)
+touch "$dir/gammu.fail.$(basename "$broken")"
+start_alarm_daemon
+echo "2026-10-18 09:05:00,000 controller INFO Zone 5 (Office) state is NORMAL" >>"$log"
+echo "2026-10-18 09:05:01,000 controller INFO Zone 5 (Office) state is FAULT" >>"$log"
+wait_for 30 "[ \$(sent) -eq 12 ]" || fail "only $(sent) of 12 alarms were sent with one modem broken"
+grep -q "Modem #[0-9] ($broken) has failed 3 times in a row" "$dir/daemon.log" \
+    || fail "the broken modem was not taken out of use"
+[ "$(grep -c " $broken sendsms-failed " "$dir/gammu.log")" -eq 3 ] || fail "the broken modem was used after failing"
+test_pass
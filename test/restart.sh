@@ -0,0 +1,55 @@
+#!/bin/bash
+#
+# Check that zone and arm changes logged while nx584-sms was not running
+# are routed once it is started again, and that those from before it was
+# stopped are not routed a second time.
+#
+#   test/restart.sh
+#
+
+set -u
+here=$(cd "$(dirname "$0")" && pwd)
+binary=${NX584_SMS:-$here/../nx584-sms}
+
+. "$here/lib.sh"
+test_setup restart
+
+cat >"$dir/conf" <<END
+admin +61400000000
+user +61400000001
+END
+cat >"$dir/rules" <<END
+group it +61400000001
+rule zone=3 event=fault notify=it
+rule event=disarm partition=1 notify=it
+END
+
+sends()
+{
+    grep -c " sendsms +61400000001 ALARM: $1" "$dir/gammu.log"
+}
+
+daemon_start "$log" -
+echo "2026-10-18 09:00:00,000 controller INFO Partition 1 armed" >>"$log"
+echo "2026-10-18 09:00:01,000 controller INFO Zone 3 (Hall) state is FAULT" >>"$log"
+wait_for 10 "[ \$(sends 'Zone 3') -eq 1 ]" || fail "the zone fault was not routed"
+echo "2026-10-18 09:00:02,000 controller INFO Zone 3 (Hall) state is NORMAL" >>"$log"
+sleep 0.5
+daemon_stop
+
+# While it isn't running
+echo "2026-10-18 09:10:00,000 controller INFO Zone 3 (Hall) state is FAULT" >>"$log"
+echo "2026-10-18 09:10:05,000 controller INFO Partition 1 not armed" >>"$log"
+
+daemon_start "$log" -
+wait_for 10 "[ \$(sends 'Zone 3') -eq 2 ]" || fail "the zone fault logged while stopped was not routed"
+wait_for 10 "[ \$(sends 'Partition 1 DISARMED') -eq 1 ]" || fail "the disarm logged while stopped was not routed"
+sleep 1
+[ "$(sends 'Zone 3')" -eq 2 ] || fail "a zone fault was routed more than once"
+daemon_stop
+
+# Nothing new: a restart must not route anything again
+daemon_start "$log" -
+sleep 1
+[ "$(sends 'Zone 3')" -eq 2 ] && [ "$(sends 'Partition 1')" -eq 1 ] || fail "old changes were routed again"
+test_pass
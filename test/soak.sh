@@ -0,0 +1,108 @@
+#!/bin/bash
+#
+# Load and soak test for nx584-sms, needing neither an alarm panel nor a
+# modem.
+#
+# The real binary is run against a log written by fake_nx584_server, with
+# the stub gammu and nx584_client from test/bin first in the PATH, while
+# users send it commands by (stub) SMS.  It then reports how fast log lines
+# are taken in, how many processes are run per log line, how long alarms
+# take to reach gammu, and how much memory grows, and fails if any of these
+# is out of bounds.
+#
+#   test/soak.sh [log lines] [commands]
+#
+# The limits can be changed from the environment, e.g., for a slow machine:
+#   MIN_LINES_PER_SECOND, MAX_FORKS_PER_LINE, MAX_ALARM_MS, MAX_RSS_GROWTH_KB
+#
+
+set -u
+here=$(cd "$(dirname "$0")" && pwd)
+binary=${NX584_SMS:-$here/../nx584-sms}
+lines=${1:-5000}
+commands=${2:-100}
+min_lines_per_second=${MIN_LINES_PER_SECOND:-200}
+max_forks_per_line=${MAX_FORKS_PER_LINE:-0.25}
+max_alarm_ms=${MAX_ALARM_MS:-1000}
+max_rss_growth_kb=${MAX_RSS_GROWTH_KB:-256}
+
+. "$here/lib.sh"
+test_setup soak
+
+# 20 users, the first of them an admin, and faults on zone 32 (which the
+# generator otherwise leaves alone) are alarms
+for i in $(seq -w 0 19); do
+    if [ "$i" = 00 ]; then echo "admin +614000000$i"; else echo "user +614000000$i"; fi
+done >"$dir/conf"
+echo "rule zone=32 event=fault notify=all" >"$dir/rules"
+
+# Sends and command replies shouldn't wait for the rate limits
+daemon_start "$log" escalate=0 smsrate=60000 smsburst=1000 inbound_rate=6000 inbound_burst=1000 -
+
+# A burst, as fast as the log can be written, to see how fast it is read
+start=$(now_ms)
+"$here/fake_nx584_server" --events "$lines" --seed 1 --output "$log"
+wait_for_log_lines "$lines" 120 || fail "only $(stat_value 'Lines: \([0-9]*\) log') of $lines log lines were read"
+burst_ms=$(($(now_ms) - start))
+rss_before=$(rss_kb)
+spawns_before=$(stat_value 'Processes: \([0-9]*\) run')
+
+# Then steady traffic, with alarms and commands, to see how long alarms
+# take to go out, and whether memory keeps growing.
+"$here/fake_nx584_server" --events "$lines" --rate 500 --seed 2 --output "$log" \
+			  --alarm-zone 32 --alarm-every 250 --alarm-log "$dir/alarms" &
+generator=$!
+for n in $(seq 1 "$commands"); do
+    user=$(printf '+614000000%02d' $((n % 20)))
+    case $((n % 3)) in
+    0) text=status ;;
+    1) text=help ;;
+    2) text=help2 ;;
+    esac
+    sms_receive "$user" "$text"
+    sleep 0.05
+done
+wait $generator
+wait_for_log_lines $((lines * 2)) 120 || fail "only $(stat_value 'Lines: \([0-9]*\) log') of $((lines * 2)) log lines were read"
+# Let the last polls and sends finish
+wait_for 30 "[ \"\$(stat_value 'SMS: [0-9]* polls, \([0-9]*\) received')\" -ge $commands ]" \
+    || fail "only $(stat_value 'SMS: [0-9]* polls, \([0-9]*\) received') of $commands commands were received"
+sleep 2
+stats
+rss_after=$(rss_kb)
+spawns=$(($(stat_value 'Processes: \([0-9]*\) run') - spawns_before))
+
+# Each alarm should have reached gammu soon after it was logged
+alarm_ms=$(awk '
+    FNR==NR { alarms[n++]=$1; next }
+    $3=="sendsms" && $0 ~ /UNEXPECTED ALARM/ { sends[m++]=$1 }
+    END {
+	j=0
+	for(i=0;i<n;i++) {
+	    while(j<m&&sends[j]<alarms[i]) j++
+	    if (j==m) { missed++; continue }
+	    ms=(sends[j]-alarms[i])*1000
+	    total+=ms; count++
+	    if (ms>max) max=ms
+	}
+	printf "%d %d %d %d\n", count, count?total/count:0, max, missed
+    }' "$dir/alarms" "$dir/gammu.log")
+read -r alarms alarm_avg_ms alarm_max_ms alarms_missed <<<"$alarm_ms"
+replies=$(grep -c " sendsms +614000000.. Valid commands\| sendsms +614000000.. Alarm " "$dir/gammu.log")
+
+lines_per_second=$((lines * 1000 / (burst_ms ? burst_ms : 1)))
+forks_per_line=$(awk -v s="$spawns" -v l="$lines" 'BEGIN { printf "%.3f", s/l }')
+echo "Ingestion: $lines lines in ${burst_ms}ms ($lines_per_second lines/s)"
+echo "Processes: $spawns run for $lines log lines and $commands commands ($forks_per_line per log line)"
+echo "Alarms: $alarms sent, ${alarm_avg_ms}ms avg, ${alarm_max_ms}ms max from log to gammu, $alarms_missed never sent"
+echo "Commands: $commands received, $replies replies sent, $(stat_value 'SMS: .* \([0-9]*\) throttled') throttled"
+echo "Memory: ${rss_before}KB resident before, ${rss_after}KB after ($((rss_after - rss_before))KB growth)"
+
+[ "$lines_per_second" -ge "$min_lines_per_second" ] || fail "log lines read at $lines_per_second/s, below $min_lines_per_second/s"
+awk -v f="$forks_per_line" -v m="$max_forks_per_line" 'BEGIN { exit !(f<=m) }' \
+    || fail "$forks_per_line processes per log line, more than $max_forks_per_line"
+[ "$alarms" -gt 0 ] && [ "$alarms_missed" -eq 0 ] || fail "$alarms_missed alarms were never sent"
+[ "$alarm_max_ms" -le "$max_alarm_ms" ] || fail "an alarm took ${alarm_max_ms}ms to reach gammu, more than ${max_alarm_ms}ms"
+[ "$replies" -gt 0 ] || fail "no commands were answered"
+[ $((rss_after - rss_before)) -le "$max_rss_growth_kb" ] || fail "memory grew by $((rss_after - rss_before))KB"
+test_pass
@@ -0,0 +1,64 @@
+#!/bin/bash
+#
+# Check that alarms, and their acknowledgement, are delivered over SMTP, an
+# HTTP webhook and a local socket, to stand-in servers from
+# fake_notify_server, and that a webhook that never answers neither holds
+# up the others, nor keeps its worker waiting for longer than the socket
+# timeouts.
+#
+#   test/transports.sh
+#
+
+set -u
+here=$(cd "$(dirname "$0")" && pwd)
+binary=${NX584_SMS:-$here/../nx584-sms}
+
+. "$here/lib.sh"
+test_setup transports
+
+servers=
+for kind in smtp http hang unix; do
+    address=$dir/$kind.port
+    [ $kind = unix ] && address=$dir/alarm.sock
+    "$here/fake_notify_server" $kind "$address" "$dir/$kind.received" &
+    servers="$servers $!"
+done
+trap 'kill $servers 2>/dev/null; test_cleanup' EXIT
+wait_for 10 "[ -s '$dir/smtp.port' ] && [ -s '$dir/http.port' ] && [ -s '$dir/hang.port' ] && [ -S '$dir/alarm.sock' ]" \
+    || fail "the stand-in servers did not start"
+hang=http://127.0.0.1:$(cat "$dir/hang.port")/hook
+
+echo "rule zone=5 event=fault notify=all" >"$dir/rules"
+daemon_start notify=smtp://127.0.0.1:$(cat "$dir/smtp.port")/oncall@example.com \
+	     notify=http://127.0.0.1:$(cat "$dir/http.port")/hook \
+	     notify=unix:"$dir/alarm.sock" notify="$hang" "$log" -
+
+start=$(now_ms)
+echo "2026-10-18 09:00:00,000 controller INFO Zone 5 (Office) state is FAULT" >>"$log"
+for kind in smtp http unix; do
+    wait_for 5 "grep -q 'ALARM' '$dir/$kind.received' 2>/dev/null" || fail "nothing was delivered by $kind"
+done
+echo "Delivered by SMTP, HTTP and a local socket in $(($(now_ms) - start))ms, with a webhook hanging"
+
+# Acknowledging the alarm goes to the channels too
+send_line ack
+for kind in smtp http unix; do
+    wait_for 5 "grep -q 'acknowledged' '$dir/$kind.received' 2>/dev/null" || fail "the ack was not passed on by $kind"
+done
+
+# The worker waiting on the hung webhook has nothing of ours open but its
+# connection
+worker=
+for pid in $(pgrep -P "$daemon"); do
+    [ "$(cat "/proc/$pid/comm")" = nx584-sms ] && worker=$pid
+done
+[ -n "$worker" ] || fail "no worker was waiting on the webhook"
+fds=$(ls "/proc/$worker/fd" | wc -l)
+[ "$fds" -le 4 ] || fail "the worker has $fds fds open: $(ls -l "/proc/$worker/fd" | tail -n +2)"
+
+wait_for 15 "grep -q \"Notification to '$hang' failed\" '$dir/daemon.log'" \
+    || fail "the hung webhook was not given up on"
+took=$(($(now_ms) - start))
+echo "Gave up on the hung webhook after ${took}ms"
+[ "$took" -lt 15000 ] || fail "the hung webhook was waited on for ${took}ms"
+test_pass
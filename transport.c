@@ -0,0 +1,564 @@
+/*
+
+  NX584 modem interface to SMS controller
+  (C) Copyright Paul Gardner-Stephen 2018-2019
+
+  Alarm notifications over channels other than SMS.
+
+  SMS cost money, and depend on the mobile network, so alarms can also be
+  passed on to things that are free to reach and that the people on call
+  may already be watching.  Each channel is given as a URL:
+
+    smtp://host[:port]/mailbox     e-mail, through a (local) SMTP relay
+    http://host[:port]/path        a webhook, POSTed {"text": "..."}
+    unix:/path                     a line of text to a local socket
+    syslog:[/dev/log]              a syslog message at LOG_ALERT
+
+  Whatever is being notified goes through notify(), which queues the SMS
+  for the people concerned and the same text on every channel, so that
+  nothing can be told to one and not the other by mistake.
+
+  Each kind of channel is a transport_type, with its own deliver()
+  function, so that adding another only means adding an entry to
+  transport_types[].
+
+  Every channel has its own queue, and delivers one message at a time in a
+  worker process of its own (much as the modem pool does for SMS), so a
+  channel that is slow, or not answering at all, only delays itself.
+  Failed deliveries are retried a few times with increasing delays, and
+  each channel keeps count of what it has delivered, how long that took,
+  and what failed.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <netdb.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "code_instrumentation.h"
+#include "command.h"
+#include "handoff.h"
+#include "metrics.h"
+#include "pool.h"
+#include "smsq.h"
+#include "transport.h"
+
+// Give up on a delivery that has taken this long
+#define TRANSPORT_TIMEOUT_MS 30000
+// or on a connection that has gone this long without taking or giving us
+// anything
+#define TRANSPORT_IO_TIMEOUT_MS 10000
+#define TRANSPORT_MAX_ATTEMPTS 4
+#define TRANSPORT_RETRY_BASE_MS 5000
+
+struct transport transports[MAX_TRANSPORTS];
+int transport_count=0;
+
+// Set to stop new deliveries starting, e.g., while handing over
+int transport_hold=0;
+
+struct pool transport_texts=POOL_INIT("notifications",TRANSPORT_MAX_TEXT,8);
+
+int transport_write(int fd, const char *data, int len)
+{
+  while(len>0) {
+    ssize_t w=write(fd,data,len);
+    if (w<0&&errno==EINTR) continue;
+    if (w<=0) return -1;
+    data+=w;
+    len-=w;
+  }
+  return 0;
+}
+
+int transport_printf(int fd, const char *fmt, ...)
+{
+  char buf[1024];
+  va_list ap;
+  va_start(ap,fmt);
+  vsnprintf(buf,sizeof(buf),fmt,ap);
+  va_end(ap);
+  return transport_write(fd,buf,strlen(buf));
+}
+
+// Read one line of a reply, without the line ending.
+int transport_read_line(int fd, char *line, int max_len)
+{
+  int len=0;
+  char c;
+  while(read(fd,&c,1)==1) {
+    if (c=='\n') {
+      if (len&&line[len-1]=='\r') len--;
+      line[len]=0;
+      return len;
+    }
+    if (len<max_len-1) line[len++]=c;
+  }
+  return -1;
+}
+
+// Don't let a server that has stopped answering keep a worker waiting
+void transport_set_timeouts(int fd)
+{
+  struct timeval tv={TRANSPORT_IO_TIMEOUT_MS/1000,(TRANSPORT_IO_TIMEOUT_MS%1000)*1000};
+  setsockopt(fd,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(tv));
+  // Also limits how long connect() waits
+  setsockopt(fd,SOL_SOCKET,SO_SNDTIMEO,&tv,sizeof(tv));
+}
+
+int transport_connect(struct transport *t)
+{
+  char port[16];
+  snprintf(port,sizeof(port),"%d",t->port);
+  struct addrinfo hints,*addrs;
+  memset(&hints,0,sizeof(hints));
+  hints.ai_socktype=SOCK_STREAM;
+  if (getaddrinfo(t->host,port,&hints,&addrs)) return -1;
+  int fd=-1;
+  for(struct addrinfo *a=addrs;a;a=a->ai_next) {
+    fd=socket(a->ai_family,a->ai_socktype|SOCK_CLOEXEC,a->ai_protocol);
+    if (fd==-1) continue;
+    transport_set_timeouts(fd);
+    if (!connect(fd,a->ai_addr,a->ai_addrlen)) break;
+    close(fd);
+    fd=-1;
+  }
+  freeaddrinfo(addrs);
+  return fd;
+}
+
+// The code of an SMTP reply, which may run over several lines
+int transport_smtp_reply(int fd)
+{
+  char line[1024];
+  do {
+    if (transport_read_line(fd,line,sizeof(line))<4) return -1;
+  } while(line[3]=='-');
+  return atoi(line);
+}
+
+int transport_smtp_deliver(struct transport *t, const char *text)
+{
+  int fd=transport_connect(t);
+  if (fd==-1) return -1;
+
+  char host[256]="localhost";
+  gethostname(host,sizeof(host)-1);
+  int retVal=-1;
+  do {
+    if (transport_smtp_reply(fd)!=220) break;
+    transport_printf(fd,"HELO %s\r\n",host);
+    if (transport_smtp_reply(fd)!=250) break;
+    transport_printf(fd,"MAIL FROM:<nx584-sms@%s>\r\n",host);
+    if (transport_smtp_reply(fd)!=250) break;
+    transport_printf(fd,"RCPT TO:<%s>\r\n",t->path);
+    int r=transport_smtp_reply(fd);
+    if (r!=250&&r!=251) break;
+    transport_printf(fd,"DATA\r\n");
+    if (transport_smtp_reply(fd)!=354) break;
+    transport_printf(fd,"From: nx584-sms <nx584-sms@%s>\r\nTo: <%s>\r\nSubject: Alarm notification\r\n\r\n",
+		     host,t->path);
+    // One line at a time, with a . at the start of a line doubled
+    for(const char *l=text;*l;) {
+      int len=strcspn(l,"\r\n");
+      if (l[0]=='.') transport_write(fd,".",1);
+      transport_write(fd,l,len);
+      transport_write(fd,"\r\n",2);
+      l+=len;
+      if (*l=='\r') l++;
+      if (*l=='\n') l++;
+    }
+    transport_printf(fd,".\r\n");
+    if (transport_smtp_reply(fd)!=250) break;
+    transport_printf(fd,"QUIT\r\n");
+    retVal=0;
+  } while(0);
+  close(fd);
+  return retVal;
+}
+
+int transport_http_deliver(struct transport *t, const char *text)
+{
+  // {"text": "..."}, with the text escaped for JSON
+  char body[TRANSPORT_MAX_TEXT*6+32];
+  int len=snprintf(body,sizeof(body),"{\"text\": \"");
+  for(const unsigned char *s=(const unsigned char *)text;*s;s++) {
+    if (*s=='"'||*s=='\\') len+=sprintf(&body[len],"\\%c",*s);
+    else if (*s=='\n') len+=sprintf(&body[len],"\\n");
+    else if (*s<0x20) len+=sprintf(&body[len],"\\u%04x",*s);
+    else body[len++]=*s;
+  }
+  len+=sprintf(&body[len],"\"}");
+
+  int fd=transport_connect(t);
+  if (fd==-1) return -1;
+  int retVal=-1;
+  do {
+    if (transport_printf(fd,"POST %s HTTP/1.0\r\nHost: %s:%d\r\nUser-Agent: nx584-sms\r\n"
+			 "Content-Type: application/json\r\nContent-Length: %d\r\n\r\n",
+			 t->path,t->host,t->port,len)) break;
+    if (transport_write(fd,body,len)) break;
+    char line[1024];
+    int status=0;
+    if (transport_read_line(fd,line,sizeof(line))<0) break;
+    if (sscanf(line,"HTTP/%*d.%*d %d",&status)!=1) break;
+    if (status>=200&&status<300) retVal=0;
+  } while(0);
+  close(fd);
+  return retVal;
+}
+
+// Send to a local socket, which may be either a datagram or stream socket.
+int transport_socket_send(const char *path, const char *message)
+{
+  struct sockaddr_un addr;
+  memset(&addr,0,sizeof(addr));
+  addr.sun_family=AF_UNIX;
+  snprintf(addr.sun_path,sizeof(addr.sun_path),"%s",path);
+
+  int fd=socket(AF_UNIX,SOCK_DGRAM|SOCK_CLOEXEC,0);
+  if (fd==-1) return -1;
+  int r=sendto(fd,message,strlen(message),0,(struct sockaddr *)&addr,sizeof(addr));
+  close(fd);
+  if (r>=0) return 0;
+  if (errno!=EPROTOTYPE) return -1;
+
+  fd=socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0);
+  if (fd==-1) return -1;
+  transport_set_timeouts(fd);
+  r=connect(fd,(struct sockaddr *)&addr,sizeof(addr));
+  if (!r) r=transport_write(fd,message,strlen(message));
+  if (!r) r=transport_write(fd,"\n",1);
+  close(fd);
+  return r;
+}
+
+// The text as a single line
+void transport_one_line(const char *text, char *out, int max_len)
+{
+  int len=0;
+  for(;*text&&len<max_len-1;text++) {
+    if (*text=='\r') continue;
+    out[len++]=(*text=='\n')?' ':*text;
+  }
+  out[len]=0;
+}
+
+int transport_unix_deliver(struct transport *t, const char *text)
+{
+  char line[TRANSPORT_MAX_TEXT];
+  transport_one_line(text,line,sizeof(line));
+  return transport_socket_send(t->path,line);
+}
+
+int transport_syslog_deliver(struct transport *t, const char *text)
+{
+  char line[TRANSPORT_MAX_TEXT];
+  char message[TRANSPORT_MAX_TEXT+64];
+  transport_one_line(text,line,sizeof(line));
+  snprintf(message,sizeof(message),"<%d>nx584-sms[%d]: %s",
+	   LOG_USER|LOG_ALERT,(int)getppid(),line);
+  return transport_socket_send(t->path,message);
+}
+
+struct transport_type transport_types[]={
+  {"smtp",25,transport_smtp_deliver},
+  {"http",80,transport_http_deliver},
+  {"unix",0,transport_unix_deliver},
+  {"syslog",0,transport_syslog_deliver},
+  {NULL,0,NULL}
+};
+
+// Set up a channel from its URL.  Returns its number, or -1 if the URL
+// isn't one we understand.
+int transport_add(const char *spec)
+{
+  if (transport_count>=MAX_TRANSPORTS) {
+    LOG_ERROR("Too many notification channels, not using '%s'",spec);
+    return -1;
+  }
+  struct transport *t=&transports[transport_count];
+  memset(t,0,sizeof(*t));
+  snprintf(t->spec,sizeof(t->spec),"%s",spec);
+  t->pid=-1;
+
+  int scheme_len=strcspn(spec,":");
+  for(int i=0;transport_types[i].scheme;i++)
+    if ((int)strlen(transport_types[i].scheme)==scheme_len
+	&&!strncmp(spec,transport_types[i].scheme,scheme_len))
+      t->type=&transport_types[i];
+  if (!t->type||!spec[scheme_len]) {
+    LOG_ERROR("Don't know how to send notifications to '%s'",spec);
+    return -1;
+  }
+  const char *rest=&spec[scheme_len+1];
+
+  if (t->type->default_port) {
+    // scheme://host[:port]/path
+    if (strncmp(rest,"//",2)) {
+      LOG_ERROR("Expected %s://host[:port]/..., not '%s'",t->type->scheme,spec);
+      return -1;
+    }
+    rest+=2;
+    int host_len=strcspn(rest,":/");
+    if (!host_len||host_len>=(int)sizeof(t->host)) {
+      LOG_ERROR("No host in '%s'",spec);
+      return -1;
+    }
+    memcpy(t->host,rest,host_len);
+    t->host[host_len]=0;
+    rest+=host_len;
+    t->port=t->type->default_port;
+    if (*rest==':') t->port=strtol(rest+1,(char **)&rest,10);
+    // The mailbox for SMTP, or the whole path for HTTP
+    if (!strcmp(t->type->scheme,"smtp")&&*rest=='/') rest++;
+    snprintf(t->path,sizeof(t->path),"%s",*rest?rest:"/");
+  } else {
+    snprintf(t->path,sizeof(t->path),"%s",
+	     *rest?rest:(!strcmp(t->type->scheme,"syslog")?"/dev/log":""));
+    if (!t->path[0]) {
+      LOG_ERROR("No socket in '%s'",spec);
+      return -1;
+    }
+  }
+  if (!strcmp(t->type->scheme,"smtp")&&!strchr(t->path,'@')) {
+    LOG_ERROR("No mailbox to send to in '%s'",spec);
+    return -1;
+  }
+
+  LOG_NOTE("Sending alarm notifications to '%s'",spec);
+  return transport_count++;
+}
+
+int transport_queue(int n, const char *text)
+{
+  if (n<0||n>=transport_count) return -1;
+  struct transport *t=&transports[n];
+  if (t->queue_len>=TRANSPORT_QUEUE) {
+    LOG_ERROR("Notification queue for '%s' is full, dropping message",t->spec);
+    t->dropped++;
+    return -1;
+  }
+  char truncated[TRANSPORT_MAX_TEXT];
+  snprintf(truncated,sizeof(truncated),"%s",text);
+  struct transport_message *m=&t->queue[(t->queue_first+t->queue_len)%TRANSPORT_QUEUE];
+  m->text=pool_strdup(&transport_texts,truncated);
+  if (!m->text) {
+    LOG_ERROR("Could not allocate memory for notification to '%s'",t->spec);
+    t->dropped++;
+    return -1;
+  }
+  m->queued_ms=command_ms();
+  m->attempts=0;
+  m->next_attempt_ms=0;
+  t->queue_len++;
+  t->queued++;
+  return 0;
+}
+
+// Queue a notification on every channel.  Returns how many took it.
+int transport_send(const char *text)
+{
+  int queued=0;
+  for(int i=0;i<transport_count;i++)
+    if (!transport_queue(i,text)) queued++;
+  return queued;
+}
+
+/*
+  Send a notification by SMS, at the given smsq priority, to each of the
+  numbers given, and (with NOTIFY_CHANNELS) on every channel.  Returns the
+  number of SMS segments queued, and sets *sms_users (if not NULL) to the
+  number of people an SMS was queued for.
+*/
+int notify(const char *text, int priority, char **numbers, int count, int channels, int *sms_users)
+{
+  if (channels==NOTIFY_CHANNELS) transport_send(text);
+  int users=0,segments=0;
+  for(int i=0;i<count;i++) {
+    int r=smsq_send(numbers[i],text,priority);
+    if (r>0) { users++; segments+=r; }
+  }
+  if (sms_users) *sms_users=users;
+  return segments;
+}
+
+void transport_finished(struct transport *t, int ok, long long now)
+{
+  struct transport_message *m=&t->queue[t->queue_first];
+  if (ok) {
+    long long latency=now-m->queued_ms;
+    t->sent++;
+    t->latency_ms_total+=latency;
+    if (latency>t->latency_ms_max) t->latency_ms_max=latency;
+  } else if (m->attempts<TRANSPORT_MAX_ATTEMPTS) {
+    long long delay=(long long)TRANSPORT_RETRY_BASE_MS<<(m->attempts-1);
+    LOG_WARN("Notification to '%s' failed, retrying in %lld seconds",t->spec,delay/1000);
+    m->next_attempt_ms=now+delay;
+    t->retries++;
+    return;
+  } else {
+    LOG_ERROR("Giving up on notification to '%s' after %d attempts",t->spec,m->attempts);
+    t->failed++;
+  }
+
+  pool_free(&transport_texts,m->text);
+  m->text=NULL;
+  t->queue_first=(t->queue_first+1)%TRANSPORT_QUEUE;
+  t->queue_len--;
+}
+
+/*
+  Collect the results of finished deliveries, and start the next delivery
+  on each channel that is free.  Returns the number started.
+*/
+int transport_run(void)
+{
+  int started=0;
+  long long now=command_ms();
+  for(int i=0;i<transport_count;i++) {
+    struct transport *t=&transports[i];
+
+    if (t->pid!=-1) {
+      int status;
+      pid_t r=waitpid(t->pid,&status,WNOHANG);
+      if (r==0) {
+	if (now-t->started_ms<TRANSPORT_TIMEOUT_MS) continue;
+	LOG_ERROR("Notification to '%s' has not finished after %lld seconds, giving up on it",
+		  t->spec,(now-t->started_ms)/1000);
+	kill(t->pid,SIGKILL);
+	waitpid(t->pid,&status,0);
+	status=-1;
+      } else if (r==-1) {
+	perror("waitpid");
+	status=-1;
+      }
+      t->pid=-1;
+      transport_finished(t,status!=-1&&WIFEXITED(status)&&!WEXITSTATUS(status),now);
+    }
+
+    if (!t->queue_len||transport_hold) continue;
+    struct transport_message *m=&t->queue[t->queue_first];
+    if (m->next_attempt_ms>now) continue;
+
+    m->attempts++;
+    pid_t pid=fork();
+    if (pid==-1) {
+      perror("fork");
+      LOG_ERROR("Could not fork to send notification to '%s'",t->spec);
+      transport_finished(t,0,now);
+      continue;
+    }
+    if (!pid) {
+      // Worker: deliver, and report how it went by our exit status.  It
+      // has no use for our logs, serial ports and sockets, and shouldn't
+      // keep them open if it outlives us.
+      for(int fd=3;fd<1024;fd++) close(fd);
+      signal(SIGPIPE,SIG_DFL);
+      signal(SIGALRM,SIG_DFL);
+      alarm(TRANSPORT_TIMEOUT_MS/1000);
+      _exit(t->type->deliver(t,m->text)?1:0);
+    }
+    t->pid=pid;
+    t->started_ms=now;
+    started++;
+  }
+  return started;
+}
+
+int transport_busy_count(void)
+{
+  int count=0;
+  for(int i=0;i<transport_count;i++) if (transports[i].pid!=-1) count++;
+  return count;
+}
+
+void transport_report(char *out, int max_len)
+{
+  int len=0;
+  out[0]=0;
+  for(int i=0;i<transport_count&&len<max_len;i++) {
+    struct transport *t=&transports[i];
+    snprintf(&out[len],max_len-len,
+	     "%s: %d waiting, %llu sent (%lldms avg, %lldms max), %llu retried, %llu failed, %llu dropped.\n",
+	     t->spec,t->queue_len,t->sent,
+	     t->sent?t->latency_ms_total/(long long)t->sent:0,t->latency_ms_max,
+	     t->retries,t->failed,t->dropped);
+    len=strlen(out);
+  }
+}
+
+void transport_write_counter(FILE *f, const char *name, const char *type, const char *help,
+			     int field)
+{
+  metrics_describe(f,name,type,help);
+  for(int i=0;i<transport_count;i++) {
+    struct transport *t=&transports[i];
+    fprintf(f,"%s{transport=",name);
+    metrics_label_value(f,t->spec);
+    switch(field) {
+    case 0: fprintf(f,"} %llu\n",t->sent); break;
+    case 1: fprintf(f,"} %llu\n",t->failed); break;
+    case 2: fprintf(f,"} %llu\n",t->retries); break;
+    case 3: fprintf(f,"} %llu\n",t->dropped); break;
+    case 4: fprintf(f,"} %d\n",t->queue_len); break;
+    case 5: fprintf(f,"} %.3f\n",t->latency_ms_total/1000.0); break;
+    case 6: fprintf(f,"} %.3f\n",t->latency_ms_max/1000.0); break;
+    }
+  }
+}
+
+void transport_write_metrics(FILE *f)
+{
+  if (!transport_count) return;
+  transport_write_counter(f,"nx584_sms_notifications_sent_total","counter",
+			  "Alarm notifications delivered, by channel.",0);
+  transport_write_counter(f,"nx584_sms_notifications_failed_total","counter",
+			  "Alarm notifications given up on, by channel.",1);
+  transport_write_counter(f,"nx584_sms_notifications_retries_total","counter",
+			  "Alarm notification deliveries retried, by channel.",2);
+  transport_write_counter(f,"nx584_sms_notifications_dropped_total","counter",
+			  "Alarm notifications dropped because the channel's queue was full.",3);
+  transport_write_counter(f,"nx584_sms_notifications_waiting","gauge",
+			  "Alarm notifications waiting to be delivered, by channel.",4);
+  transport_write_counter(f,"nx584_sms_notification_latency_seconds_total","counter",
+			  "Time from queueing to delivery, over all delivered notifications, by channel.",5);
+  transport_write_counter(f,"nx584_sms_notification_latency_seconds_max","gauge",
+			  "Longest time from queueing to delivery, by channel.",6);
+}
+
+// Write out the notifications still waiting, for the process we are handing
+// over to.
+void transport_save(FILE *f)
+{
+  for(int i=0;i<transport_count;i++)
+    for(int j=0;j<transports[i].queue_len;j++) {
+      struct transport_message *m=&transports[i].queue[(transports[i].queue_first+j)%TRANSPORT_QUEUE];
+      fprintf(f,"notification %d ",i);
+      handoff_put_hex(f,m->text,strlen(m->text));
+      fprintf(f,"\n");
+    }
+}
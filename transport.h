@@ -0,0 +1,76 @@
+#ifndef __TRANSPORT_H__
+#define __TRANSPORT_H__
+
+#include <stdio.h>
+#include <sys/types.h>
+
+//
+// 'transport.h/.c' deliver alarm notifications over channels other than
+// SMS (e-mail through a local SMTP relay, an HTTP webhook, or a local
+// socket), each with its own queue and worker, so that a slow or broken
+// channel never holds up the others.  notify() is how everything else
+// sends a notification: by SMS to the numbers given, and on every channel.
+//
+
+#define MAX_TRANSPORTS 8
+#define TRANSPORT_QUEUE 32
+#define TRANSPORT_MAX_TEXT 2048
+
+struct transport;
+
+// A kind of channel, chosen by the scheme of its URL.  deliver() runs in a
+// worker process, and returns 0 if the message was accepted.
+struct transport_type {
+  const char *scheme;
+  int default_port;      // 0 if it isn't a network address
+  int (*deliver)(struct transport *t, const char *text);
+};
+
+struct transport_message {
+  char *text;
+  long long queued_ms;
+  int attempts;
+  long long next_attempt_ms;
+};
+
+struct transport {
+  char spec[1024];
+  struct transport_type *type;
+  char host[256];
+  int port;
+  char path[1024];       // URL path, mailbox, or socket, depending on type
+
+  struct transport_message queue[TRANSPORT_QUEUE];
+  int queue_first;
+  int queue_len;
+  pid_t pid;             // worker delivering the first message, or -1
+  long long started_ms;
+
+  unsigned long long queued;
+  unsigned long long sent;
+  unsigned long long retries;
+  unsigned long long failed;
+  unsigned long long dropped;
+  long long latency_ms_total;  // queue-to-delivered, over all sent messages
+  long long latency_ms_max;
+};
+
+// Whether notify() also sends on the channels, or only by SMS (e.g., when
+// escalating, as the channels have already heard)
+#define NOTIFY_SMS_ONLY 0
+#define NOTIFY_CHANNELS 1
+
+extern struct transport transports[MAX_TRANSPORTS];
+extern int transport_count;
+extern int transport_hold;
+
+int transport_add(const char *spec);
+int notify(const char *text, int priority, char **numbers, int count, int channels, int *sms_users);
+int transport_run(void);
+int transport_busy_count(void);
+void transport_report(char *out, int max_len);
+void transport_write_metrics(FILE *f);
+void transport_save(FILE *f);
+int transport_queue(int t, const char *text);
+
+#endif
@@ -0,0 +1,200 @@
+/*
+
+  NX584 modem interface to SMS controller
+  (C) Copyright Paul Gardner-Stephen 2018-2019
+
+  Main loop stall detection.
+
+  Everything happens in the one main loop, so while it is waiting for gammu
+  or nx584_client to finish, nothing else is being read, and a siren could
+  go unnoticed.  Each operation that can block reports how long it took, and
+  where it was called from, with watchdog_op().  At the end of each pass of
+  the main loop, if the pass took longer than watchdog_threshold_ms, it is
+  recorded as a stall, and blamed on the longest operation within it.
+
+  When run by systemd with WatchdogSec= set, the watchdog is only fed after
+  passes that were not stalls, so that systemd restarts us if we get stuck
+  for good, rather than just for a while.  The notification protocol is
+  simple enough that we speak it directly, rather than needing libsystemd.
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+
+*/
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "code_instrumentation.h"
+#include "clock.h"
+#include "command.h"
+#include "watchdog.h"
+
+int watchdog_threshold_ms=1000;
+unsigned long long watchdog_stalls=0;
+struct watchdog_stall watchdog_worst;
+struct watchdog_site watchdog_sites[WATCHDOG_MAX_SITES];
+int watchdog_site_count=0;
+
+// The most recent stalls, oldest overwritten first
+struct watchdog_stall watchdog_recent[WATCHDOG_RECENT];
+int watchdog_recent_next=0;
+
+// The longest operation in the current pass of the main loop
+struct watchdog_site *watchdog_pass_culprit=NULL;
+long long watchdog_pass_culprit_ms=0;
+
+// systemd watchdog, if we are running under one
+int watchdog_notify_fd=-1;
+struct sockaddr_un watchdog_notify_addr;
+socklen_t watchdog_notify_addr_len=0;
+long long watchdog_notify_interval_ms=0;
+long long watchdog_last_notify_ms=0;
+
+int watchdog_notify(const char *message)
+{
+  if (watchdog_notify_fd==-1) return -1;
+  return sendto(watchdog_notify_fd,message,strlen(message),MSG_NOSIGNAL,
+		(struct sockaddr *)&watchdog_notify_addr,watchdog_notify_addr_len);
+}
+
+void watchdog_setup(void)
+{
+  const char *socket_path=getenv("NOTIFY_SOCKET");
+  const char *usec=getenv("WATCHDOG_USEC");
+  const char *pid=getenv("WATCHDOG_PID");
+  if (!socket_path||!socket_path[0]) return;
+  if (strlen(socket_path)>=sizeof(watchdog_notify_addr.sun_path)) return;
+
+  watchdog_notify_addr.sun_family=AF_UNIX;
+  memcpy(watchdog_notify_addr.sun_path,socket_path,strlen(socket_path));
+  // A leading @ means an abstract socket
+  if (socket_path[0]=='@') watchdog_notify_addr.sun_path[0]=0;
+  watchdog_notify_addr_len=offsetof(struct sockaddr_un,sun_path)+strlen(socket_path);
+  watchdog_notify_fd=socket(AF_UNIX,SOCK_DGRAM|SOCK_CLOEXEC,0);
+  if (watchdog_notify_fd==-1) {
+    perror("socket");
+    return;
+  }
+
+  // The watchdog may be meant for some other process, e.g., a wrapper script
+  if (usec&&((!pid)||atoi(pid)==getpid())) {
+    // Feed it twice as often as it needs, as systemd recommends
+    watchdog_notify_interval_ms=atoll(usec)/2000;
+    LOG_NOTE("Feeding the systemd watchdog every %lldms while the main loop is healthy",
+	     watchdog_notify_interval_ms);
+  }
+  // After a hand over, we are the main process in place of our parent
+  char ready[64];
+  snprintf(ready,sizeof(ready),"READY=1\nMAINPID=%d",(int)getpid());
+  watchdog_notify(ready);
+}
+
+struct watchdog_site *watchdog_find_site(const char *file, int line, const char *what)
+{
+  for(int i=0;i<watchdog_site_count;i++)
+    if (watchdog_sites[i].line==line&&!strcmp(watchdog_sites[i].file,file)
+	&&!strcmp(watchdog_sites[i].what,what))
+      return &watchdog_sites[i];
+  if (watchdog_site_count>=WATCHDOG_MAX_SITES) return NULL;
+  struct watchdog_site *s=&watchdog_sites[watchdog_site_count++];
+  s->file=file;
+  s->line=line;
+  snprintf(s->what,sizeof(s->what),"%s",what);
+  return s;
+}
+
+void watchdog_op(const char *file, int line, const char *what, long long ms)
+{
+  struct watchdog_site *s=watchdog_find_site(file,line,what);
+  if (!s) return;
+  s->count++;
+  s->total_ms+=ms;
+  if (ms>s->max_ms) s->max_ms=ms;
+  if (ms>watchdog_pass_culprit_ms) {
+    watchdog_pass_culprit=s;
+    watchdog_pass_culprit_ms=ms;
+  }
+}
+
+void watchdog_loop_end(long long busy_ms)
+{
+  if (busy_ms>=watchdog_threshold_ms) {
+    struct watchdog_stall st;
+    st.when=clock_now();
+    st.ms=busy_ms;
+    // Only blame an operation if it accounts for most of the stall
+    st.culprit=(watchdog_pass_culprit_ms*2>=busy_ms)?watchdog_pass_culprit:NULL;
+    st.culprit_ms=st.culprit?watchdog_pass_culprit_ms:0;
+    watchdog_stalls++;
+    watchdog_recent[watchdog_recent_next]=st;
+    watchdog_recent_next=(watchdog_recent_next+1)%WATCHDOG_RECENT;
+    if (st.ms>watchdog_worst.ms) watchdog_worst=st;
+    if (st.culprit)
+      LOG_WARN("Main loop stalled for %lldms, %lldms of it in %s at %s:%d",
+	       st.ms,st.culprit_ms,st.culprit->what,st.culprit->file,st.culprit->line);
+    else
+      LOG_WARN("Main loop stalled for %lldms, not explained by any one operation",st.ms);
+  } else if (watchdog_notify_interval_ms) {
+    long long now=command_ms();
+    if (now-watchdog_last_notify_ms>=watchdog_notify_interval_ms) {
+      watchdog_notify("WATCHDOG=1");
+      watchdog_last_notify_ms=now;
+    }
+  }
+  watchdog_pass_culprit=NULL;
+  watchdog_pass_culprit_ms=0;
+}
+
+void watchdog_describe(struct watchdog_stall *st, char *out, int max_len)
+{
+  struct tm tm;
+  localtime_r(&st->when,&tm);
+  int len=strftime(out,max_len,"%d/%m %H:%M:%S",&tm);
+  if (st->culprit)
+    snprintf(&out[len],max_len-len," %lldms (%s %s:%d %lldms)",
+	     st->ms,st->culprit->what,st->culprit->file,st->culprit->line,st->culprit_ms);
+  else
+    snprintf(&out[len],max_len-len," %lldms (unattributed)",st->ms);
+}
+
+void watchdog_report(char *out, int max_len)
+{
+  int len=snprintf(out,max_len,"%llu stalls over %dms.\n",watchdog_stalls,watchdog_threshold_ms);
+  if (watchdog_stalls) {
+    len+=snprintf(&out[len],max_len-len,"Worst: ");
+    watchdog_describe(&watchdog_worst,&out[len],max_len-len);
+    len=strlen(out);
+    len+=snprintf(&out[len],max_len-len,"\nRecent:\n");
+    for(int i=1;i<=WATCHDOG_RECENT&&len<max_len;i++) {
+      struct watchdog_stall *st=
+	&watchdog_recent[(watchdog_recent_next+WATCHDOG_RECENT-i)%WATCHDOG_RECENT];
+      if (!st->when) break;
+      watchdog_describe(st,&out[len],max_len-len);
+      len=strlen(out);
+      len+=snprintf(&out[len],max_len-len,"\n");
+    }
+  }
+  if (len<max_len) len+=snprintf(&out[len],max_len-len,"Blocking calls (max/avg ms):\n");
+  for(int i=0;i<watchdog_site_count&&len<max_len;i++) {
+    struct watchdog_site *s=&watchdog_sites[i];
+    len+=snprintf(&out[len],max_len-len,"%s %s:%d %lld/%lld\n",
+		  s->what,s->file,s->line,s->max_ms,s->count?s->total_ms/(long long)s->count:0);
+  }
+}
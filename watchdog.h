@@ -0,0 +1,44 @@
+#ifndef __WATCHDOG_H__
+#define __WATCHDOG_H__
+
+#include <time.h>
+
+//
+// 'watchdog.h/.c' notice when the main loop has been held up, work out what
+// was holding it up, and keep the systemd watchdog fed only while it isn't.
+//
+
+#define WATCHDOG_OP_NAME 32
+#define WATCHDOG_RECENT 8
+#define WATCHDOG_MAX_SITES 32
+
+// Time spent blocked in one place (source file and line) in the code
+struct watchdog_site {
+  const char *file;
+  int line;
+  char what[WATCHDOG_OP_NAME];
+  unsigned long long count;
+  long long total_ms;
+  long long max_ms;
+};
+
+// A main loop iteration that took longer than watchdog_threshold_ms
+struct watchdog_stall {
+  time_t when;
+  long long ms;
+  struct watchdog_site *culprit;  // NULL if no single operation explains it
+  long long culprit_ms;
+};
+
+extern int watchdog_threshold_ms;
+extern unsigned long long watchdog_stalls;
+extern struct watchdog_stall watchdog_worst;
+extern struct watchdog_site watchdog_sites[WATCHDOG_MAX_SITES];
+extern int watchdog_site_count;
+
+void watchdog_setup(void);
+void watchdog_op(const char *file, int line, const char *what, long long ms);
+void watchdog_loop_end(long long busy_ms);
+void watchdog_report(char *out, int max_len);
+
+#endif